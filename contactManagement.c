@@ -1,395 +1,5693 @@
+// Contact Management System
+// Build with: cc -std=c11 -O2 -pthread contactManagement.c -o contactManagement
+// (-pthread is required: imports and the server use threads.) Needs a POSIX system.
+// The behaviour tests in tests/contactManagementTests.c say how to build and run them.
+
+// POSIX.1-2008 for getline, open_memstream, pread, fdatasync, ftruncate, fileno, strcasecmp and CLOCK_MONOTONIC, and
+// the usual extensions on top for madvise's MADV_SEQUENTIAL, so the file builds as ISO C and not only as GNU C
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>  // For standard input/output functions
 #include <stdlib.h>  // For general utilities such as memory allocation 
 #include <string.h>  // For string manipulation functions
+#include <strings.h> // For strcasecmp() and strncasecmp()
 #include <ctype.h>   // For handling character-related functions like checking or converting case
+#include <fcntl.h>   // For open()
+#include <unistd.h>  // For close(), fsync()
+#include <sys/mman.h> // For mapping snapshot files into memory
+#include <sys/stat.h> // For fstat() to get a snapshot's size
+#include <sys/wait.h> // For waiting on the journal compaction child
+#include <pthread.h>  // For the import worker threads; build with -pthread
+#include <time.h>     // For clock_gettime() in the benchmark
+#include <sys/resource.h> // For getrusage() to report the benchmark's peak memory
+#include <sys/socket.h> // For the server's Unix domain socket
+#include <sys/un.h>     // For struct sockaddr_un
+#include <signal.h>     // For stopping the server cleanly on SIGINT/SIGTERM
+#include <sched.h>      // For sched_yield() while a server write waits for readers
+#include <stdatomic.h>  // For the server's lock-free reader bookkeeping
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h> // For the SSE2/AVX2 substring scan; AVX2 is only used if the CPU has it
+#define SCAN_X86 1
+#endif
 #include "contactManagement.h"  // For Contact structure and related functions
 
-// Define maximum sizes for different fields and the total number of contacts
-#define MAX_CONTACTS 100
-#define MAX_NAME_LEN 30
-#define MAX_ADDRESS_LEN 50
-#define MAX_EMAIL_LEN 30
-#define MAX_PHONE_LEN 20
-
 // Function declarations; these pretty much tell the compiler about functions defined later on in this code
-void addContact(struct Contact contacts[], int *count);
-void listContacts(struct Contact contacts[], int count);
-void searchContact(struct Contact contacts[], int count);
-void editContact(struct Contact contacts[], int count);
-void deleteContact(struct Contact contacts[], int *count);
-void saveContactsToFile(struct Contact contacts[], int count);
-void loadContactsFromFile(struct Contact contacts[], int *count);
+void addContact(struct ContactStore *store);
+void listContacts(struct ContactStore *store);
+void listContactRange(struct ContactStore *store);
+void searchContact(struct ContactStore *store);
+void fuzzySearchContact(struct ContactStore *store);
+void editContact(struct ContactStore *store);
+void deleteContact(struct ContactStore *store);
+void saveContactsToFile(struct ContactStore *store);
+void loadContactsFromFile(struct ContactStore *store);
 void displayMenu();
-int compareContacts(const void *a, const void *b);
+char *caseInsensitiveStrStr(const char *haystack, const char *needle);
+static void journalLog(struct ContactStore *store, enum JournalOp op, const char *key, const struct Contact *contact);
 
-// substring search that is case insensitive and useful for our searchContact() function
-char *caseInsensitiveStrStr(const char *haystack, const char *needle) {
-    // If the needle (substring we're looking for) is empty, then the entire haystack is a match
-    if (!*needle) return (char *)haystack;
+#if CM_ENABLE_STATS
+// Each thread counts into a block of its own, so the hot paths never take a lock or share a cache line with
+// another thread, and statsPrint adds the blocks up. Only the owning thread writes a block, which is why
+// relaxed atomic loads and stores are enough for statsPrint to read it while it's being updated
+struct StatsBlock {
+    struct Stats stats;
+    struct StatsBlock *next;
+};
+static struct StatsBlock *statsBlocks;   // Blocks of the threads still running
+static struct Stats statsFinished;       // Totals of the threads that have ended
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct StatsBlock *statsMine;
+static struct StatsBlock statsSpare;     // For a thread that couldn't get a block of its own; never reported
+
+static struct Stats *statsLocal(void) {
+    if (!statsMine) {
+        struct StatsBlock *block = calloc(1, sizeof(*block));
+        if (!block) return &statsSpare.stats;
+        pthread_mutex_lock(&statsLock);
+        block->next = statsBlocks;
+        statsBlocks = block;
+        pthread_mutex_unlock(&statsLock);
+        statsMine = block;
+    }
+    return &statsMine->stats;
+}
 
-    size_t hay_len = strlen(haystack); // Get the length of the haystack string
-    size_t nee_len = strlen(needle); // Get the length of the needle string
+static inline void statsBump(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-    // Allocate memory for lowercase versions of haystack and needle
-    // The + 1 is for the null terminator at the end of strings
-    char *haystack_lower = malloc(hay_len + 1); 
-    char *needle_lower = malloc(nee_len + 1);
+static inline uint64_t statsRead(const uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
 
-    // Check if memory allocation was successful and if not, then clean up and exit
-    if (!haystack_lower || !needle_lower) {
-        if (haystack_lower) free(haystack_lower); // Free memory if allocated
-        if (needle_lower) free(needle_lower); // Free memory if allocated
-        return NULL; // Return "NULL" indicating failure
+// Add one thread's numbers into a total
+static void statsMerge(struct Stats *total, const struct Stats *block) {
+    for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+        struct StatHistogram *to = &total->operations[op];
+        const struct StatHistogram *from = &block->operations[op];
+        to->calls += statsRead(&from->calls);
+        to->totalNs += statsRead(&from->totalNs);
+        uint64_t maxNs = statsRead(&from->maxNs);
+        if (maxNs > to->maxNs) to->maxNs = maxNs;
+        for (int b = 0; b < STAT_BUCKETS; b++) to->buckets[b] += statsRead(&from->buckets[b]);
     }
+    for (int c = 0; c < STAT_COUNTER_COUNT; c++) total->counters[c] += statsRead(&block->counters[c]);
+}
+
+// Fold the calling thread's block into the totals before the thread ends, so short-lived threads don't
+// leave a block behind each
+static void statsThreadDone(void) {
+    if (!statsMine) return;
+    pthread_mutex_lock(&statsLock);
+    struct StatsBlock **link = &statsBlocks;
+    while (*link != statsMine) link = &(*link)->next;
+    *link = statsMine->next;
+    statsMerge(&statsFinished, &statsMine->stats);
+    pthread_mutex_unlock(&statsLock);
+    free(statsMine);
+    statsMine = NULL;
+}
+
+static uint64_t statsNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Add one call that started at `started` to an operation's histogram
+static void statsRecord(enum StatOperation operation, uint64_t started) {
+    uint64_t elapsed = statsNow() - started;
+    struct StatHistogram *histogram = &statsLocal()->operations[operation];
+    int bucket = 63 - __builtin_clzll(elapsed | 1); // floor(log2), so each bucket is twice as wide as the last
+    statsBump(&histogram->calls, 1);
+    statsBump(&histogram->totalNs, elapsed);
+    if (elapsed > histogram->maxNs) __atomic_store_n(&histogram->maxNs, elapsed, __ATOMIC_RELAXED);
+    statsBump(&histogram->buckets[bucket < STAT_BUCKETS ? bucket : STAT_BUCKETS - 1], 1);
+}
+
+#define STATS_COUNT(counter) statsBump(&statsLocal()->counters[counter], 1)
+#define STATS_ADD(counter, n) statsBump(&statsLocal()->counters[counter], (n))
+#define STATS_TIMER(name) uint64_t name = statsNow()
+#define STATS_RECORD(operation, name) statsRecord(operation, name)
+#define STATS_THREAD_DONE() statsThreadDone()
+#else
+#define STATS_COUNT(counter) ((void)0)
+#define STATS_ADD(counter, n) ((void)(n)) // Still "uses" a local that only exists to be counted
+#define STATS_TIMER(name) ((void)0)
+#define STATS_RECORD(operation, name) ((void)0)
+#define STATS_THREAD_DONE() ((void)0)
+#endif
 
-    // convert haystack to lowercase so we can do case-insensitive comparison
-    for (size_t i = 0; i <= hay_len; i++)
-        haystack_lower[i] = (char)tolower((unsigned char)haystack[i]);
+// Phone numbers are stored as typed, so "+44..." and "0044..." are the same number; strip the prefix for comparisons
+const char *phoneKey(const char *phone) {
+    if (phone[0] == '+') return phone + 1;                   // Skip the '+' sign
+    if (phone[0] == '0' && phone[1] == '0') return phone + 2; // Skip the leading zeros
+    return phone;
+}
 
-    // Convert needle to lowercase for the same reason
-    for (size_t i = 0; i <= nee_len; i++)
-        needle_lower[i] = (char)tolower((unsigned char)needle[i]);
-    
-    // use strstr To find the substring in lowercase
-    char *pos = strstr(haystack_lower, needle_lower);
-    char *result = NULL; // This will hold the location of the match in the original haystack string
-    // if pos is not "NULL", it means a match was found
-    if (pos) {
-        size_t offset = pos - haystack_lower; // Calculate the offset to find the position in the original string
-        result = (char *)haystack + offset; // Get the address in the original haystack string
+// FNV-1a hash over the lowercase bytes of a string
+static uint32_t hashFolded(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash ^= (unsigned char)tolower((unsigned char)*s);
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    // Free the allocated memory
-    free(haystack_lower);
-    free(needle_lower);
+// FNV-1a hash over the raw bytes of a string
+static uint32_t hashBytes(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash ^= (unsigned char)*s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    return result; // Return the position of the match in the original haystack, or "NULL" if no match
+// The field of a stored contact an index is keyed on
+static const char *indexField(const struct HashIndex *index, const struct ContactStore *store, size_t pos) {
+    return storeField(store, pos, index->key == INDEX_BY_NAME ? FIELD_NAME : FIELD_PHONE);
 }
 
-int main() {
-    struct Contact contacts[MAX_CONTACTS];  // Array to store up to MAX_CONTACTS contacts
-    int count = 0;  // Initialize the contact count to 0 
-    loadContactsFromFile(contacts, &count); // Load existing contacts from a file
+// Hash a lookup key the same way the index hashes its contacts
+static uint32_t indexHash(const struct HashIndex *index, const char *key) {
+    return index->key == INDEX_BY_NAME ? hashFolded(key) : hashBytes(phoneKey(key));
+}
 
-    int choice;  // Variable to store user's menu choice
-    while (1) { // Keep looping until the user decides to exit
-        displayMenu();  // Display the menu options
-        printf("Enter your choice: ");
-        // Validate input to make sure the user enters a valid number
-        if (scanf("%d", &choice) != 1) {
-            printf("Invalid input! Please enter a number.\n");
-            while (getchar() != '\n');  // Clear the input buffer to avoid infinite loop
-            continue; // Go back to the beginning of the loop and try again
-        }
+// Hash a stored contact's key; names are hashed from the folded column, which gives the same value as hashFolded
+static uint32_t indexHashAt(const struct HashIndex *index, const struct ContactStore *store, size_t pos) {
+    if (index->key == INDEX_BY_NAME) return hashBytes(storeField(store, pos, FIELD_FOLDED_NAME));
+    return hashBytes(phoneKey(storeField(store, pos, FIELD_PHONE)));
+}
 
-        // Handle menu choices with a switch statement 
-        switch (choice) {
-            case 1: addContact(contacts, &count); break;  // Add a new contact; calls the addContact function
-            case 2: listContacts(contacts, count); break;  // List all contacts; calls the listContacts function
-            case 3: searchContact(contacts, count); break;  // Search for a contact; calls the searchContact function
-            case 4: editContact(contacts, count); break;   // Edit a contact's details; calls the editContact function
-            case 5: deleteContact(contacts, &count); break;   // Delete a contact; calls the deleteContact function
-            case 0: // User wants to exit
-                printf("Exiting the program. Goodbye!\n");
-                saveContactsToFile(contacts, count);  // Save contacts to a file before exiting
-                return 0;  // Exit the program 
-            default: 
-                printf("Invalid choice! Please enter a valid option.\n");   // Invalid menu choice
-        }
-    }
+// Two keys are equal if the names match ignoring case, or the phones match once normalized
+static int indexKeysEqual(const struct HashIndex *index, const char *a, const char *b) {
+    if (index->key == INDEX_BY_NAME) return strcasecmp(a, b) == 0;
+    return strcmp(phoneKey(a), phoneKey(b)) == 0;
 }
 
-// Display the main menu with options for the user
-void displayMenu() {
-    printf("\n\t\t***** Contact Management System *****\n"); // Menu Title
-    printf("\t\t=====================================\n"); // Title seperator
-    printf("\t\t[1] Add a New Contact\n"); // Option 1; add a contact
-    printf("\t\t[2] List All Contacts\n"); // Option 2; list all contacts
-    printf("\t\t[3] Search for a Contact\n"); // Option 3; search for a contact
-    printf("\t\t[4] Edit a Contact\n"); // Option 4; edit a contact
-    printf("\t\t[5] Delete a Contact\n"); // Option 5; delete a contact
-    printf("\t\t[0] Exit\n"); // Option 0; exit the program
-    printf("\t\t=====================================\n"); // Another seperator
+// Set up an empty index; the table is allocated on the first insert
+static void hashIndexInit(struct HashIndex *index, enum HashIndexKey key) {
+    index->key = key;
+    index->slots = NULL;
+    index->hashes = NULL;
+    index->cap = 0;
+    index->used = 0;
 }
 
-// Add a new contact to the contact list
-void addContact(struct Contact contacts[], int *count) {
-    // Check if the contact list is already full
-    if (*count >= MAX_CONTACTS) {
-        printf("Contact list is full. Cannot add more contacts.\n");
-        return; // Just exit the function if the list is full
+// Release the index's table
+static void hashIndexFree(struct HashIndex *index) {
+    free(index->slots);
+    free(index->hashes);
+    hashIndexInit(index, index->key);
+}
+
+// Place an entry in the first free slot of its probe sequence; the table must have room
+static void hashIndexPlace(struct HashIndex *index, uint32_t hash, uint32_t slot) {
+    size_t mask = index->cap - 1;
+    size_t i = hash & mask;
+    while (index->slots[i] != 0) i = (i + 1) & mask; // Linear probing
+    index->slots[i] = slot;
+    index->hashes[i] = hash;
+    index->used++;
+}
+
+// Rehash every entry into a table of newCap slots using the cached hashes; returns -1 if out of memory
+static int hashIndexResize(struct HashIndex *index, size_t newCap) {
+    uint32_t *slots = calloc(newCap, sizeof(*slots));
+    uint32_t *hashes = malloc(newCap * sizeof(*hashes));
+    if (!slots || !hashes) {
+        free(slots);
+        free(hashes);
+        return -1;
     }
-    while (getchar() != '\n'); // Clear any leftover characters in the input buffer
 
-    // Get contact details from the user
-    struct Contact *contact = &contacts[*count]; // Get a pointer to the next available slot in the contacts array
-    int checkDuplicate = 0; // initialize variable to check if a duplicate name was added as we don't want duplicate names
+    uint32_t *oldSlots = index->slots;
+    uint32_t *oldHashes = index->hashes;
+    size_t oldCap = index->cap;
+    index->slots = slots;
+    index->hashes = hashes;
+    index->cap = newCap;
+    index->used = 0;
+    for (size_t i = 0; i < oldCap; i++) {
+        if (oldSlots[i] != 0) hashIndexPlace(index, oldHashes[i], oldSlots[i]);
+    }
+    free(oldSlots);
+    free(oldHashes);
+    return 0;
+}
 
-    // Loop until we get a valid name
-    do {
-        printf("Enter contact name: ");
-        fgets(contact->name, sizeof(contact->name), stdin); // Read the name from input
-        contact->name[strcspn(contact->name, "\n")] = 0; // Remove newline from the name
+// Add a store position whose key hashes to `hash`, doubling the table when it passes the load factor
+static int hashIndexInsertHashed(struct HashIndex *index, uint32_t hash, size_t pos) {
+    if ((index->used + 1) * HASH_INDEX_LOAD_DEN > index->cap * HASH_INDEX_LOAD_NUM) {
+        size_t newCap = index->cap ? index->cap * 2 : HASH_INDEX_MIN_CAP;
+        if (hashIndexResize(index, newCap) != 0) return -1;
+    }
+    hashIndexPlace(index, hash, (uint32_t)pos + 1);
+    return 0;
+}
 
-        // Check if the entered name is empty
-        if (strlen(contact->name) == 0) {
-            printf("Name cannot be empty. Please enter a valid name.\n");
-            continue; // Go back to the beginning of the loop and try again
+// Add the contact at a store position to the index
+static int hashIndexInsert(struct HashIndex *index, const struct ContactStore *store, size_t pos) {
+    return hashIndexInsertHashed(index, indexHashAt(index, store, pos), pos);
+}
+
+// Drop the entry for a store position; later entries of the cluster are shifted back so no tombstones are needed
+static void hashIndexRemove(struct HashIndex *index, const struct ContactStore *store, size_t pos) {
+    if (index->cap == 0) return;
+    size_t mask = index->cap - 1;
+    size_t i = indexHashAt(index, store, pos) & mask;
+    while (index->slots[i] != (uint32_t)pos + 1) {
+        if (index->slots[i] == 0) return; // Not indexed
+        i = (i + 1) & mask;
+    }
+
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (index->slots[j] == 0) break;
+        size_t home = index->hashes[j] & mask; // Where the entry at j would ideally live
+        // Move it into the hole unless its home lies cyclically between the hole and j
+        int between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!between) {
+            index->slots[i] = index->slots[j];
+            index->hashes[i] = index->hashes[j];
+            i = j;
         }
+    }
+    index->slots[i] = 0;
+    index->used--;
+}
 
-        checkDuplicate = 0; // Reset the duplicate flag
-        // Check if the entered name already exists
-        for (int i = 0; i < *count; i++) {
-            if (strcasecmp(contact->name, contacts[i].name) == 0) { // Use strcasecmp for case-insensitive comparision
-                printf("A contact with this name already exists. Please Enter a New Name:\n");
-                checkDuplicate = 1; // Set the duplicate flag
-                break; // No need to continue checking once a duplicate is found
-            }
+// Find the store position of a contact whose indexed field matches a key that hashes to `hash`
+static size_t hashIndexFindHashed(const struct HashIndex *index, const struct ContactStore *store, const char *key, uint32_t hash) {
+    if (index->cap == 0) return CONTACT_NOT_FOUND;
+    size_t mask = index->cap - 1, probes = 0, found = CONTACT_NOT_FOUND;
+    for (size_t i = hash & mask; index->slots[i] != 0; i = (i + 1) & mask) {
+        probes++; // Counted here and added to the stats once, so a long probe doesn't bump a counter per slot
+        size_t pos = index->slots[i] - 1;
+        if (index->hashes[i] == hash && indexKeysEqual(index, indexField(index, store, pos), key)) {
+            found = pos;
+            break;
         }
-    } while (strlen(contact->name) == 0 || checkDuplicate == 1); // Keep looping if the name is empty or a duplicate
+    }
+    STATS_ADD(STAT_HASH_PROBES, probes);
+    return found;
+}
 
-    int validNumber = 0; // Set up a validity checker; we want a valid phone number
+// Find the store position of a contact whose indexed field matches the key
+static size_t hashIndexFind(const struct HashIndex *index, const struct ContactStore *store, const char *key) {
+    return hashIndexFindHashed(index, store, key, indexHash(index, key));
+}
 
-    while (!validNumber) {
-        printf("Enter phone number: ");
-        validNumber = 1; // Assume the number is valid until proven otherwise
+// Pack three consecutive characters, lowercased, into a trigram key
+static uint32_t trigramAt(const char *s) {
+    return (uint32_t)(unsigned char)tolower((unsigned char)s[0]) << 16 |
+           (uint32_t)(unsigned char)tolower((unsigned char)s[1]) << 8 |
+           (uint32_t)(unsigned char)tolower((unsigned char)s[2]);
+}
 
-        fgets(contact->phone, sizeof(contact->phone), stdin);  // Read phone number as string
-        contact->phone[strcspn(contact->phone, "\n")] = 0;     // Remove trailing newline
+// Spread the trigram bits across the table (Fibonacci hashing)
+static size_t trigramSlot(const struct TrigramIndex *index, uint32_t key) {
+    return (size_t)((key * 2654435769u) >> 8) & (index->cap - 1);
+}
 
-        // Check if the phone number is empty
-        if (strlen(contact->phone) == 0) {
-            printf("Phone number cannot be empty.\n");
-            validNumber = 0;
-            continue;
-        }
+// Set up an empty trigram index; the table is allocated on the first insert
+static void trigramIndexInit(struct TrigramIndex *index) {
+    index->table = NULL;
+    index->cap = 0;
+    index->used = 0;
+}
+
+// Release every posting list and the table
+static void trigramIndexFree(struct TrigramIndex *index) {
+    for (size_t i = 0; i < index->cap; i++)
+        free(index->table[i].positions);
+    free(index->table);
+    trigramIndexInit(index);
+}
+
+// Find the posting list of a trigram, NULL if no name contains it
+static struct TrigramPosting *trigramFind(const struct TrigramIndex *index, uint32_t key) {
+    if (index->cap == 0) return NULL;
+    for (size_t i = trigramSlot(index, key); index->table[i].key != 0; i = (i + 1) & (index->cap - 1)) {
+        if (index->table[i].key == key) return &index->table[i];
+    }
+    return NULL;
+}
+
+// Find or create the posting list of a trigram, doubling the table past the load factor
+static struct TrigramPosting *trigramGet(struct TrigramIndex *index, uint32_t key) {
+    struct TrigramPosting *posting = trigramFind(index, key);
+    if (posting) return posting;
 
-        // Check for allowed characters: digits, '+', and leading '00'
-        int i = 0;
-        if (contact->phone[0] == '+') {
-            i = 1; // Skip the '+' sign
-        } else if (contact->phone[0] == '0' && contact->phone[1] == '0') {
-            i = 2; // Skip the leading zeros
+    if ((index->used + 1) * HASH_INDEX_LOAD_DEN > index->cap * HASH_INDEX_LOAD_NUM) {
+        size_t newCap = index->cap ? index->cap * 2 : HASH_INDEX_MIN_CAP;
+        struct TrigramPosting *table = calloc(newCap, sizeof(*table));
+        if (!table) return NULL;
+        struct TrigramPosting *oldTable = index->table;
+        size_t oldCap = index->cap;
+        index->table = table;
+        index->cap = newCap;
+        for (size_t i = 0; i < oldCap; i++) {
+            if (oldTable[i].key == 0) continue;
+            size_t j = trigramSlot(index, oldTable[i].key);
+            while (table[j].key != 0) j = (j + 1) & (newCap - 1);
+            table[j] = oldTable[i]; // The posting list moves over as-is
         }
+        free(oldTable);
+    }
 
-        for (; contact->phone[i] != '\0'; i++) {
-            if (!isdigit(contact->phone[i])) {
-                printf("Invalid characters in phone number. Please enter number in the format +XXXXXXXXXXXX or 00XXXXXXXXXXXX or XXXXXXXXXXXX\n");
-                validNumber = 0;
-                break;
-            }
+    size_t i = trigramSlot(index, key);
+    while (index->table[i].key != 0) i = (i + 1) & (index->cap - 1);
+    index->table[i].key = key;
+    index->used++;
+    return &index->table[i];
+}
+
+// First slot in a sorted posting list whose position is >= pos
+static uint32_t postingLowerBound(const struct TrigramPosting *posting, uint32_t pos) {
+    uint32_t lo = 0, hi = posting->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (posting->positions[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Remove a store position from the posting list of every trigram in a name
+static void trigramIndexRemove(struct TrigramIndex *index, size_t pos, const char *name) {
+    for (size_t i = 0; name[i] && name[i + 1] && name[i + 2]; i++) {
+        struct TrigramPosting *posting = trigramFind(index, trigramAt(name + i));
+        if (!posting) continue;
+        uint32_t at = postingLowerBound(posting, (uint32_t)pos);
+        if (at == posting->count || posting->positions[at] != (uint32_t)pos) continue; // Repeated trigram, already gone
+        memmove(&posting->positions[at], &posting->positions[at + 1], (posting->count - at - 1) * sizeof(uint32_t));
+        posting->count--;
+    }
+}
+
+// Add a store position to the posting list of every trigram in a name; repeated trigrams are stored once
+static int trigramIndexInsert(struct TrigramIndex *index, size_t pos, const char *name) {
+    for (size_t i = 0; name[i] && name[i + 1] && name[i + 2]; i++) {
+        struct TrigramPosting *posting = trigramGet(index, trigramAt(name + i));
+        if (!posting) goto fail;
+        uint32_t at = postingLowerBound(posting, (uint32_t)pos);
+        if (at < posting->count && posting->positions[at] == (uint32_t)pos) continue;
+        if (posting->count == posting->cap) {
+            uint32_t newCap = posting->cap ? posting->cap * 2 : 4;
+            uint32_t *positions = realloc(posting->positions, newCap * sizeof(uint32_t));
+            if (!positions) goto fail;
+            posting->positions = positions;
+            posting->cap = newCap;
         }
+        // New contacts get the highest position, so this is nearly always an append
+        memmove(&posting->positions[at + 1], &posting->positions[at], (posting->count - at) * sizeof(uint32_t));
+        posting->positions[at] = (uint32_t)pos;
+        posting->count++;
+    }
+    return 0;
 
-        // Check for duplicate phone number if input is otherwise valid
-        if (validNumber) {
-            for (int i = 0; i < *count; i++) {
-                if (strcmp(contacts[i].phone, contact->phone) == 0) { // Compare strings
-                    printf("This phone number already exists please try again:\n");
-                    validNumber = 0; // Duplicate found
-                    break;
-                }
+fail:
+    trigramIndexRemove(index, pos, name); // Take back the trigrams added so far
+    return -1;
+}
+
+// Set up an empty fuzzy index; nothing is allocated until it's built
+static void fuzzyIndexInit(struct FuzzyIndex *index) {
+    index->nodes = NULL;
+    index->count = 0;
+    index->cap = 0;
+    index->slots = NULL;
+    index->slotCap = 0;
+    index->words = NULL;
+    index->wordsSize = 0;
+    index->wordsCap = 0;
+    index->built = 0;
+}
+
+// Release the whole index; the next fuzzy search builds it again
+static void fuzzyIndexFree(struct FuzzyIndex *index) {
+    for (size_t i = 0; i < index->count; i++)
+        free(index->nodes[i].positions);
+    free(index->nodes);
+    free(index->slots);
+    free(index->words);
+    fuzzyIndexInit(index);
+}
+
+// Copy the next word of a case-folded name into `word`, cut to FUZZY_MAX_WORD bytes. Words are split at spaces and
+// punctuation that doesn't belong inside a name; apostrophes and hyphens do. Returns where to carry on from, or
+// NULL once there are no more words
+static const char *fuzzyNextWord(const char *p, char word[FUZZY_MAX_WORD + 1], size_t *length) {
+    while (*p && (isspace((unsigned char)*p) || strchr(",;.()/\"", *p))) p++;
+    if (!*p) return NULL;
+    *length = 0;
+    for (; *p && !isspace((unsigned char)*p) && !strchr(",;.()/\"", *p); p++) {
+        if (*length < FUZZY_MAX_WORD) word[(*length)++] = *p;
+    }
+    word[*length] = '\0';
+    return p;
+}
+
+// Damerau-Levenshtein distance: the fewest insertions, deletions, substitutions and swaps of two neighbouring
+// characters that turn one word into the other. This is the unrestricted version (Lowrance-Wagner), which unlike
+// the cheaper optimal string alignment distance is a true metric, as the BK-tree needs
+static unsigned fuzzyDistance(const char *a, size_t aLength, const char *b, size_t bLength) {
+    unsigned d[FUZZY_MAX_WORD + 2][FUZZY_MAX_WORD + 2]; // d[i + 1][j + 1] is the distance between a[0..i) and b[0..j)
+    unsigned char lastRow[256]; // Last row of `a` each character was seen in, 1-based; only the entries used are cleared
+    for (size_t i = 0; i < aLength; i++) lastRow[(unsigned char)a[i]] = 0;
+    for (size_t j = 0; j < bLength; j++) lastRow[(unsigned char)b[j]] = 0;
+    unsigned infinity = (unsigned)(aLength + bLength);
+    d[0][0] = infinity;
+    for (size_t i = 0; i <= aLength; i++) {
+        d[i + 1][0] = infinity;
+        d[i + 1][1] = (unsigned)i;
+    }
+    for (size_t j = 0; j <= bLength; j++) {
+        d[0][j + 1] = infinity;
+        d[1][j + 1] = (unsigned)j;
+    }
+    for (size_t i = 1; i <= aLength; i++) {
+        size_t lastColumn = 0; // Last column of this row where the characters matched
+        for (size_t j = 1; j <= bLength; j++) {
+            size_t k = lastRow[(unsigned char)b[j - 1]], l = lastColumn;
+            unsigned cost = 1;
+            if (a[i - 1] == b[j - 1]) {
+                cost = 0;
+                lastColumn = j;
             }
+            unsigned best = d[i][j] + cost;                                   // Substitute
+            if (d[i + 1][j] + 1 < best) best = d[i + 1][j] + 1;               // Insert
+            if (d[i][j + 1] + 1 < best) best = d[i][j + 1] + 1;               // Delete
+            unsigned swap = d[k][l] + (unsigned)(i - k - 1) + 1 + (unsigned)(j - l - 1); // Swap, with anything between
+            if (swap < best) best = swap;
+            d[i + 1][j + 1] = best;
         }
+        lastRow[(unsigned char)a[i - 1]] = (unsigned char)i;
     }
+    return d[aLength + 1][bLength + 1];
+}
 
-    printf("Enter address: ");
-    fgets(contact->address, sizeof(contact->address), stdin); // Read the address from input
-    contact->address[strcspn(contact->address, "\n")] = 0; // Remove newline from the address
+// Node holding a word, or FUZZY_NO_NODE
+static uint32_t fuzzyFind(const struct FuzzyIndex *index, const char *word, uint32_t hash) {
+    if (index->slotCap == 0) return FUZZY_NO_NODE;
+    for (size_t i = hash & (index->slotCap - 1); index->slots[i] != 0; i = (i + 1) & (index->slotCap - 1)) {
+        uint32_t node = index->slots[i] - 1;
+        if (strcmp(index->words + index->nodes[node].word, word) == 0) return node;
+    }
+    return FUZZY_NO_NODE;
+}
 
-    int validEmail = 0; // Check validity of email
-    // Loop until we get a valid email
-    while (!validEmail) {
-        printf("Enter email: ");
-        fgets(contact->email, sizeof(contact->email), stdin); // Takes input 
-        contact->email[strcspn(contact->email, "\n")] = 0;   // Remove newline character 
+// Add a node for a word that isn't in the index yet, hashing it and hanging it in the tree. Returns the node or
+// FUZZY_NO_NODE if out of memory, with the index unchanged
+static uint32_t fuzzyAddNode(struct FuzzyIndex *index, const char *word, size_t length, uint32_t hash) {
+    if (index->count >= FUZZY_NO_NODE - 1) return FUZZY_NO_NODE;
+    if ((index->count + 1) * HASH_INDEX_LOAD_DEN > index->slotCap * HASH_INDEX_LOAD_NUM) {
+        size_t newCap = index->slotCap ? index->slotCap * 2 : HASH_INDEX_MIN_CAP;
+        uint32_t *slots = calloc(newCap, sizeof(*slots));
+        if (!slots) return FUZZY_NO_NODE;
+        for (size_t node = 0; node < index->count; node++) {
+            size_t i = hashBytes(index->words + index->nodes[node].word) & (newCap - 1);
+            while (slots[i] != 0) i = (i + 1) & (newCap - 1);
+            slots[i] = (uint32_t)node + 1;
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->slotCap = newCap;
+    }
+    if (index->count == index->cap) {
+        size_t newCap = index->cap ? index->cap * 2 : 256;
+        struct FuzzyNode *nodes = realloc(index->nodes, newCap * sizeof(*nodes));
+        if (!nodes) return FUZZY_NO_NODE;
+        index->nodes = nodes;
+        index->cap = newCap;
+    }
+    if (index->wordsSize + length + 1 > index->wordsCap || index->wordsSize + length + 1 > UINT32_MAX) {
+        size_t newCap = index->wordsCap ? index->wordsCap * 2 : COLUMN_MIN_HEAP;
+        if (newCap > UINT32_MAX) newCap = UINT32_MAX;
+        char *words = newCap >= index->wordsSize + length + 1 ? realloc(index->words, newCap) : NULL;
+        if (!words) return FUZZY_NO_NODE;
+        index->words = words;
+        index->wordsCap = newCap;
+    }
 
-        // Check if the entered email is empty
-        if (strlen(contact->email) == 0) {
-            printf("Email cannot be empty!\n");
-            continue; // Go back to the beginning of the loop and try again
+    uint32_t added = (uint32_t)index->count++;
+    struct FuzzyNode *node = &index->nodes[added];
+    node->word = (uint32_t)index->wordsSize;
+    node->distance = 0;
+    node->length = (uint16_t)length;
+    node->child = node->sibling = FUZZY_NO_NODE;
+    node->count = node->cap = 0;
+    node->positions = NULL;
+    memcpy(index->words + index->wordsSize, word, length + 1);
+    index->wordsSize += length + 1;
+    size_t i = hash & (index->slotCap - 1);
+    while (index->slots[i] != 0) i = (i + 1) & (index->slotCap - 1);
+    index->slots[i] = added + 1;
+
+    // Walk down from the root, following the child at the same distance as the new word, until there isn't one
+    for (uint32_t parent = 0; added != 0;) {
+        const struct FuzzyNode *parentNode = &index->nodes[parent];
+        unsigned distance = fuzzyDistance(word, length, index->words + parentNode->word, parentNode->length);
+        uint32_t child = parentNode->child;
+        while (child != FUZZY_NO_NODE && index->nodes[child].distance != distance) child = index->nodes[child].sibling;
+        if (child == FUZZY_NO_NODE) {
+            index->nodes[added].distance = (uint16_t)distance;
+            index->nodes[added].sibling = index->nodes[parent].child;
+            index->nodes[parent].child = added;
+            break;
         }
+        parent = child;
+    }
+    return added;
+}
 
-        // Simple check to ensure both '@' and '.' are present in the email
-        if (strchr(contact->email, '@') != NULL && strchr(contact->email, '.') != NULL) {
-            validEmail = 1; // Email is valid 
-        } else {
-            printf("Invalid email! Email must contain both '@' and '.'.\n");
+// First slot in a node's sorted positions that is >= pos
+static uint32_t fuzzyLowerBound(const struct FuzzyNode *node, uint32_t pos) {
+    uint32_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (node->positions[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Remove a store position from the node of every word in a name
+static void fuzzyIndexRemove(struct FuzzyIndex *index, size_t pos, const char *name) {
+    char word[FUZZY_MAX_WORD + 1];
+    size_t length;
+    for (const char *p = name; (p = fuzzyNextWord(p, word, &length));) {
+        uint32_t node = fuzzyFind(index, word, hashBytes(word));
+        if (node == FUZZY_NO_NODE) continue;
+        struct FuzzyNode *found = &index->nodes[node];
+        uint32_t lo = fuzzyLowerBound(found, (uint32_t)pos);
+        if (lo == found->count || found->positions[lo] != (uint32_t)pos) continue; // Repeated word, already gone
+        memmove(&found->positions[lo], &found->positions[lo + 1], (found->count - lo - 1) * sizeof(uint32_t));
+        found->count--;
+    }
+}
+
+// Add a store position to the node of every word in a name, adding nodes for new words
+static int fuzzyIndexInsert(struct FuzzyIndex *index, size_t pos, const char *name) {
+    char word[FUZZY_MAX_WORD + 1];
+    size_t length;
+    for (const char *p = name; (p = fuzzyNextWord(p, word, &length));) {
+        uint32_t hash = hashBytes(word);
+        uint32_t node = fuzzyFind(index, word, hash);
+        if (node == FUZZY_NO_NODE && (node = fuzzyAddNode(index, word, length, hash)) == FUZZY_NO_NODE) goto fail;
+        struct FuzzyNode *found = &index->nodes[node];
+        uint32_t lo = fuzzyLowerBound(found, (uint32_t)pos);
+        if (lo < found->count && found->positions[lo] == (uint32_t)pos) continue;
+        if (found->count == found->cap) {
+            uint32_t newCap = found->cap ? found->cap * 2 : 2;
+            uint32_t *positions = realloc(found->positions, newCap * sizeof(uint32_t));
+            if (!positions) goto fail;
+            found->positions = positions;
+            found->cap = newCap;
         }
+        memmove(&found->positions[lo + 1], &found->positions[lo], (found->count - lo) * sizeof(uint32_t));
+        found->positions[lo] = (uint32_t)pos;
+        found->count++;
     }
+    return 0;
 
-    (*count)++;  // Increment the contact count as a new contact was added
-    printf("Contact added successfully!\n");
+fail:
+    fuzzyIndexRemove(index, pos, name); // Take back the words added so far
+    return -1;
 }
 
-// List all contacts in the address book 
-void listContacts(struct Contact contacts[], int count) {
-    // Check if there are any contacts to display
-    if (count == 0) {
-        printf("No contacts to display.\n");
-        return; // Exits the function
+// Set up an empty phone trie; nothing is allocated until the first key goes in
+static void phoneTrieInit(struct PhoneTrie *trie) {
+    trie->nodes = NULL;
+    trie->count = 0;
+    trie->cap = 0;
+    trie->freeNodes = PHONE_TRIE_NONE;
+    trie->freeCount = 0;
+    trie->built = 0;
+}
+
+static void phoneTrieFree(struct PhoneTrie *trie) {
+    free(trie->nodes);
+    phoneTrieInit(trie);
+}
+
+// The key a stored phone number is indexed under: the phone index's own key, the digits after its '+' or '00'.
+// A number with anything else in it or with more than PHONE_TRIE_MAX_KEY digits is left out, so every key in
+// the trie is exactly one the phone index has and exact lookups can go to the phone index instead. Returns the key's length, 0 if the number isn't indexed
+static size_t phoneTrieKey(const char *phone, char key[PHONE_TRIE_MAX_KEY + 1]) {
+    const char *digits = phoneKey(phone);
+    size_t length = 0;
+    for (; digits[length]; length++) {
+        if (length == PHONE_TRIE_MAX_KEY || !isdigit((unsigned char)digits[length])) return 0;
+        key[length] = digits[length];
     }
+    key[length] = '\0';
+    return length;
+}
 
-    // Sort the contacts alphabetically by name before displaying
-    qsort(contacts, count, sizeof(struct Contact), compareContacts);
+// The digits of a number or prefix being looked up, after its '+' or '00' and leaving out anything else such as
+// spaces or dashes. Returns how many there are, which can be more than the PHONE_TRIE_MAX_KEY copied into `key`
+static size_t phoneTrieQuery(const char *text, char key[PHONE_TRIE_MAX_KEY + 1]) {
+    size_t length = 0;
+    for (const char *c = phoneKey(text); *c; c++) {
+        if (!isdigit((unsigned char)*c)) continue;
+        if (length < PHONE_TRIE_MAX_KEY) key[length] = *c;
+        length++;
+    }
+    key[length < PHONE_TRIE_MAX_KEY ? length : PHONE_TRIE_MAX_KEY] = '\0';
+    return length;
+}
 
-    // Display the contact details in a formatted manner
-    printf("\n\t\t*** List of Contacts ***\n");
-    printf("=====================================================================\n");
-    printf("Name\t\t\tPhone\t\t\tAddress\t\t\tEmail\n"); // This is the header row
-    printf("=====================================================================\n");
+// Make sure `extra` more nodes can be taken without the nodes array moving
+static int phoneTrieReserve(struct PhoneTrie *trie, size_t extra) {
+    if (extra <= trie->freeCount || trie->count + extra - trie->freeCount <= trie->cap) return 0;
+    size_t newCap = trie->cap ? trie->cap * 2 : 256;
+    while (newCap < trie->count + extra) newCap *= 2;
+    if (newCap > PHONE_TRIE_NONE) return -1;
+    struct PhoneTrieNode *nodes = realloc(trie->nodes, newCap * sizeof(*nodes));
+    if (!nodes) return -1;
+    trie->nodes = nodes;
+    trie->cap = newCap;
+    return 0;
+}
 
-    for (int i = 0; i < count; i++) {
-        printf("%-30s %-20s %-30s %s\n", contacts[i].name, contacts[i].phone, contacts[i].address, contacts[i].email); // Print each contact's details
+// Take a node off the free list, or the end of the array, and give it a label; room must have been reserved
+static uint32_t phoneTrieTake(struct PhoneTrie *trie, uint32_t parent, const char *label, size_t length) {
+    uint32_t node;
+    if (trie->freeNodes != PHONE_TRIE_NONE) {
+        node = trie->freeNodes;
+        trie->freeNodes = trie->nodes[node].sibling;
+        trie->freeCount--;
+    } else {
+        node = (uint32_t)trie->count++;
     }
+    struct PhoneTrieNode *taken = &trie->nodes[node];
+    memcpy(taken->label, label, length);
+    taken->length = (uint8_t)length;
+    taken->parent = parent;
+    taken->child = taken->sibling = PHONE_TRIE_NONE;
+    taken->pos = 0;
+    return node;
 }
 
-// Comparison function for sorting contacts alphabetically (used by the qsort function)
-int compareContacts(const void *a, const void *b) {
-    // Cast the void pointers to Contact pointers
-    const struct Contact *contactA = (const struct Contact *)a;
-    const struct Contact *contactB = (const struct Contact *)b;
-    return strcasecmp(contactA->name, contactB->name); // Compare the names using strcasecmp (case-insensitive)
+// Put a node on the free list
+static void phoneTrieGive(struct PhoneTrie *trie, uint32_t node) {
+    trie->nodes[node].pos = 0;
+    trie->nodes[node].sibling = trie->freeNodes;
+    trie->freeNodes = node;
+    trie->freeCount++;
 }
 
-// Search for a contact by name, or partial substring search
-void searchContact(struct Contact contacts[], int count) {
-    // Check if there are any contacts to search
-    if (count == 0) {
-        printf("No contacts to search.\n");
-        return; // Nothing to search so it exits the function
+// Child of a node whose label starts with `digit`, or PHONE_TRIE_NONE. *prev is set to the child before where it
+// is or would go, PHONE_TRIE_NONE if that's the front of the list
+static uint32_t phoneTrieChild(const struct PhoneTrie *trie, uint32_t node, char digit, uint32_t *prev) {
+    *prev = PHONE_TRIE_NONE;
+    uint32_t child = trie->nodes[node].child;
+    while (child != PHONE_TRIE_NONE && trie->nodes[child].label[0] < digit) {
+        *prev = child;
+        child = trie->nodes[child].sibling;
     }
+    return child != PHONE_TRIE_NONE && trie->nodes[child].label[0] == digit ? child : PHONE_TRIE_NONE;
+}
 
-    // Ensures alphabetical order when searching
-    qsort(contacts, count, sizeof(struct Contact), compareContacts); // Sort contacts alphabetically by name
+// The link field that points at the node after `prev` in a parent's list of children
+static uint32_t *phoneTrieLink(struct PhoneTrie *trie, uint32_t parent, uint32_t prev) {
+    return prev == PHONE_TRIE_NONE ? &trie->nodes[parent].child : &trie->nodes[prev].sibling;
+}
 
-    // reads the name and does a substring search; prompt the user to enter the name (or part of the name) to search for
-    getchar(); // Clear any leftover characters in the input buffer
-    char input[MAX_NAME_LEN]; // Array to store the user's input
-    printf("Please enter the contact's name: ");
-    fgets(input, sizeof(input), stdin); // Read the input from the user
-    input[strcspn(input, "\n")] = 0; // Remove newline from the input
+// How many leading digits of a key match a node's label
+static size_t phoneTrieCommon(const struct PhoneTrieNode *node, const char *key, size_t length) {
+    size_t common = 0;
+    while (common < node->length && common < length && node->label[common] == key[common]) common++;
+    return common;
+}
 
-    // Check if the user entered anything
-    if (strlen(input) == 0) {
-        printf("No input provided. Returning.\n");
-        return; // Nothing to search so it exits the function
+// Follow a key down from the root. Returns the node the key ends at, with *partial set if it ends part-way
+// along that node's label, or PHONE_TRIE_NONE if no phone key starts with it. *longest is set to the deepest
+// node passed whose contact's key is a prefix of this one (or the whole of it), PHONE_TRIE_NONE if none is
+static uint32_t phoneTrieWalk(const struct PhoneTrie *trie, const char *key, size_t length, uint32_t *longest,
+                              int *partial) {
+    *longest = PHONE_TRIE_NONE;
+    *partial = 0;
+    if (trie->count == 0) return PHONE_TRIE_NONE;
+    for (uint32_t node = 0;;) {
+        if (trie->nodes[node].pos != 0) *longest = node;
+        if (length == 0) return node;
+        uint32_t prev, child = phoneTrieChild(trie, node, key[0], &prev);
+        if (child == PHONE_TRIE_NONE) return PHONE_TRIE_NONE;
+        size_t common = phoneTrieCommon(&trie->nodes[child], key, length);
+        if (common < trie->nodes[child].length) {
+            *partial = common == length;
+            return *partial ? child : PHONE_TRIE_NONE;
+        }
+        node = child;
+        key += common;
+        length -= common;
+    }
+}
+
+// Add the phone key of the contact at a store position. A key that's already there is taken over by the new
+// position, and phoneTrieRemove hands the key back. Returns 0, or -1 if out of memory with the trie unchanged
+static int phoneTrieInsert(struct PhoneTrie *trie, const char *phone, size_t pos) {
+    char key[PHONE_TRIE_MAX_KEY + 1];
+    size_t length = phoneTrieKey(phone, key);
+    if (length == 0) return 0; // Nothing to look it up by
+
+    // See where the key leaves the trie first, so exactly the nodes it needs can be reserved before anything
+    // changes: one to split a label the key leaves part-way along, then a chain for the rest of the key
+    size_t done = 0;
+    int split = 0;
+    for (uint32_t node = 0; trie->count > 0 && done < length;) {
+        uint32_t prev, child = phoneTrieChild(trie, node, key[done], &prev);
+        if (child == PHONE_TRIE_NONE) break;
+        size_t common = phoneTrieCommon(&trie->nodes[child], key + done, length - done);
+        done += common;
+        if (common < trie->nodes[child].length) {
+            split = 1;
+            break;
+        }
+        node = child;
     }
+    size_t chain = (length - done + PHONE_TRIE_LABEL - 1) / PHONE_TRIE_LABEL;
+    if (phoneTrieReserve(trie, (trie->count == 0) + split + chain) != 0) return -1;
+    if (trie->count == 0) phoneTrieTake(trie, PHONE_TRIE_NONE, "", 0);
 
-    int found = 0; // Flag to indicate if any matching contacts were found
-    // Loop through all the contacts
-    for (int i = 0; i < count; i++) {
-        // partial substring search to check if the input is a substring of the contact's name (case-insensitive)
-        if (caseInsensitiveStrStr(contacts[i].name, input) != NULL) {
-            if (!found) { // If this is the first match, print a header
-                // Print the contact details if found
-                printf("\nContacts matching '%s':\n", input);
+    uint32_t node = 0;
+    for (done = 0; done < length;) {
+        uint32_t prev, child = phoneTrieChild(trie, node, key[done], &prev);
+        if (child == PHONE_TRIE_NONE) { // Nothing shares the next digit: hang the rest of the key off here
+            while (done < length) {
+                size_t run = length - done < PHONE_TRIE_LABEL ? length - done : PHONE_TRIE_LABEL;
+                uint32_t added = phoneTrieTake(trie, node, key + done, run);
+                uint32_t *link = phoneTrieLink(trie, node, prev);
+                trie->nodes[added].sibling = *link;
+                *link = added;
+                node = added;
+                prev = PHONE_TRIE_NONE;
+                done += run;
             }
-            found = 1; // Set the found flag to 1
-            // Print the contact's details
-            printf("Name: %s\nPhone: %s\nAddress: %s\nEmail: %s\n\n", // Phone is now a string (%s)
-                   contacts[i].name, contacts[i].phone, contacts[i].address, contacts[i].email);
+            break;
         }
+        struct PhoneTrieNode *found = &trie->nodes[child];
+        size_t common = phoneTrieCommon(found, key + done, length - done);
+        if (common < found->length) {
+            // The key leaves the label part-way: a new node takes the shared digits and the old one hangs off it
+            uint32_t upper = phoneTrieTake(trie, node, found->label, common);
+            *phoneTrieLink(trie, node, prev) = upper;
+            trie->nodes[upper].sibling = found->sibling;
+            trie->nodes[upper].child = child;
+            memmove(found->label, found->label + common, found->length - common);
+            found->length = (uint8_t)(found->length - common);
+            found->parent = upper;
+            found->sibling = PHONE_TRIE_NONE;
+            child = upper;
+        }
+        node = child;
+        done += common;
     }
+    trie->nodes[node].pos = (uint32_t)pos + 1;
+    return 0;
+}
 
-    // If no matching contacts were found
-    if (!found) {
-        printf("No contact found containing '%s'.\n", input);
+// Remove the phone key of the contact at a store position. If another contact has the same number, `other`,
+// the key goes to it instead, so the trie keeps every number the phone index still has. Otherwise nodes left with
+// no contact and no children go back on the free list, and a node left with no contact and one child takes over
+// the child's label when both fit in one
+static void phoneTrieRemove(struct PhoneTrie *trie, const char *phone, size_t pos, size_t other) {
+    char key[PHONE_TRIE_MAX_KEY + 1];
+    size_t length = phoneTrieKey(phone, key);
+    uint32_t longest;
+    int partial;
+    uint32_t node = phoneTrieWalk(trie, key, length, &longest, &partial);
+    if (length == 0 || node == PHONE_TRIE_NONE || partial || trie->nodes[node].pos != (uint32_t)pos + 1) return;
+    trie->nodes[node].pos = other != CONTACT_NOT_FOUND ? (uint32_t)other + 1 : 0;
+    if (other != CONTACT_NOT_FOUND) return;
+    while (node != 0 && trie->nodes[node].pos == 0 && trie->nodes[node].child == PHONE_TRIE_NONE) {
+        uint32_t parent = trie->nodes[node].parent, prev = PHONE_TRIE_NONE;
+        for (uint32_t child = trie->nodes[parent].child; child != node; child = trie->nodes[child].sibling) prev = child;
+        *phoneTrieLink(trie, parent, prev) = trie->nodes[node].sibling;
+        phoneTrieGive(trie, node);
+        node = parent;
     }
+    struct PhoneTrieNode *merged = &trie->nodes[node];
+    uint32_t only = merged->child;
+    if (node == 0 || merged->pos != 0 || only == PHONE_TRIE_NONE || trie->nodes[only].sibling != PHONE_TRIE_NONE ||
+        merged->length + trie->nodes[only].length > PHONE_TRIE_LABEL) return;
+    const struct PhoneTrieNode *child = &trie->nodes[only];
+    memcpy(merged->label + merged->length, child->label, child->length);
+    merged->length = (uint8_t)(merged->length + child->length);
+    merged->pos = child->pos;
+    merged->child = child->child;
+    for (uint32_t grandchild = merged->child; grandchild != PHONE_TRIE_NONE; grandchild = trie->nodes[grandchild].sibling)
+        trie->nodes[grandchild].parent = node;
+    phoneTrieGive(trie, only);
 }
 
-// Edit an existing contact
-void editContact(struct Contact contacts[], int count) {
-    char name[MAX_NAME_LEN]; // Array to store the name of the contact to edit
-    printf("Enter the name of the contact to edit: ");
-    getchar(); // Clear any leftover characters in the input buffer
-    fgets(name, sizeof(name), stdin); // Read the name from the user
-    name[strcspn(name, "\n")] = 0; // Remove newline from the name
+// Set up an empty match list
+void matchesInit(struct ContactMatches *matches) {
+    matches->positions = NULL;
+    matches->count = 0;
+    matches->cap = 0;
+}
+
+// Release a match list
+void matchesFree(struct ContactMatches *matches) {
+    free(matches->positions);
+    matchesInit(matches);
+}
+
+// Append a store position to a match list
+static int matchesPush(struct ContactMatches *matches, size_t pos) {
+    if (matches->count == matches->cap) {
+        size_t newCap = matches->cap ? matches->cap * 2 : 16;
+        size_t *positions = realloc(matches->positions, newCap * sizeof(*positions));
+        if (!positions) return -1;
+        matches->positions = positions;
+        matches->cap = newCap;
+    }
+    matches->positions[matches->count++] = pos;
+    return 0;
+}
 
-    // Search for the contact to edit
-    for (int i = 0; i < count; i++) {
-        // If the contact is found (case-insensitive comparison)
-        if (strcasecmp(contacts[i].name, name) == 0) {
-            printf("Editing contact '%s'\n", contacts[i].name);
-            // Get new contact details from the user
-            printf("New Name: ");
-            fgets(contacts[i].name, sizeof(contacts[i].name), stdin); // Read the new name
-            contacts[i].name[strcspn(contacts[i].name, "\n")] = 0; // Remove newline from the name
+// Case-insensitive compare of `length` haystack bytes against an already lowercased needle
+static int scanEqual(const char *haystack, const char *folded, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        if (tolower((unsigned char)haystack[i]) != (unsigned char)folded[i]) return 0;
+    return 1;
+}
 
-            printf("New Phone: ");
-            fgets(contacts[i].phone, sizeof(contacts[i].phone), stdin); // Read new phone as string 
-            contacts[i].phone[strcspn(contacts[i].phone, "\n")] = 0;     // Remove trailing newline 
+// First place in [p, end) holding the lowercased needle, ignoring case, or NULL. One byte at a time,
+// used when there's no vector unit and for the last few bytes the vector loops can't load
+static const char *scanFindScalar(const char *p, const char *end, const char *folded, size_t length) {
+    for (; end - p >= (ptrdiff_t)length; p++)
+        if (tolower((unsigned char)*p) == (unsigned char)folded[0] && scanEqual(p + 1, folded + 1, length - 1)) return p;
+    return NULL;
+}
 
-            printf("New Address: ");
-            fgets(contacts[i].address, sizeof(contacts[i].address), stdin); // Read the new address
-            contacts[i].address[strcspn(contacts[i].address, "\n")] = 0; // Remove newline from the address
+#ifdef SCAN_X86
+// Lowercase A-Z in 16 bytes at once: shift them to -128..-103 so one signed compare picks them out.
+// The same bytes tolower() changes, as the program never leaves the "C" locale
+static inline __m128i scanFold16(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
 
-            printf("New Email: ");
-            fgets(contacts[i].email, sizeof(contacts[i].email), stdin); // Read the new email
-            contacts[i].email[strcspn(contacts[i].email, "\n")] = 0; // Remove newline from the email
-            printf("Contact updated successfully!\n");
-            return; // Exit the function after editing the contact
+// SSE2 scan, 16 start positions per step: a start is a candidate when both the needle's first and last
+// characters line up, and only candidates get the full compare. SSE2 is always there on x86-64
+static const char *scanFindSse2(const char *p, const char *end, const char *folded, size_t length) {
+    const __m128i first = _mm_set1_epi8(folded[0]);
+    const __m128i last = _mm_set1_epi8(folded[length - 1]);
+    for (; end - p >= (ptrdiff_t)(length - 1 + 16); p += 16) {
+        __m128i a = scanFold16(_mm_loadu_si128((const __m128i *)p));
+        __m128i b = scanFold16(_mm_loadu_si128((const __m128i *)(p + length - 1)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *at = p + __builtin_ctz(mask);
+            if (length <= 2 || scanEqual(at + 1, folded + 1, length - 2)) return at;
         }
     }
-    printf("No contact found with the name '%s'.\n", name); // Contact not found message
+    return scanFindScalar(p, end, folded, length);
 }
 
-// Delete a contact from the list
-void deleteContact(struct Contact contacts[], int *count) {
-    char name[MAX_NAME_LEN]; // Array to store the name of the contact to delete
-    printf("Enter the name of the contact to delete: ");
-    getchar(); // Clear any leftover characters in the input buffer
-    fgets(name, sizeof(name), stdin); // Read the name from the user
-    name[strcspn(name, "\n")] = 0; // Remove newline from the name
-
-    // Find and delete the contact 
-    for (int i = 0; i < *count; i++) {
-        // If the contact is found (case-insensitive comparision)
-        if (strcasecmp(contacts[i].name, name) == 0) {
-            // Shift the remaining contacts to remove the deleted one, which moves all subsequent contacts one position up
-            for (int j = i; j < *count - 1; j++) {
-                contacts[j] = contacts[j + 1];
-            }
-            (*count)--; // Decrement the contact count as there is one less contact now
-            printf("Contact deleted successfully.\n");
-            return; // Exit the function after deleting the contact
+__attribute__((target("avx2")))
+static inline __m256i scanFold32(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+// The same scan 32 start positions at a time
+__attribute__((target("avx2")))
+static const char *scanFindAvx2(const char *p, const char *end, const char *folded, size_t length) {
+    const __m256i first = _mm256_set1_epi8(folded[0]);
+    const __m256i last = _mm256_set1_epi8(folded[length - 1]);
+    for (; end - p >= (ptrdiff_t)(length - 1 + 32); p += 32) {
+        __m256i a = scanFold32(_mm256_loadu_si256((const __m256i *)p));
+        __m256i b = scanFold32(_mm256_loadu_si256((const __m256i *)(p + length - 1)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *at = p + __builtin_ctz(mask);
+            if (length <= 2 || scanEqual(at + 1, folded + 1, length - 2)) return at;
         }
     }
-    printf("No contact found with the name '%s'.\n", name); // Contact not found message
+    return scanFindSse2(p, end, folded, length);
 }
+#endif
 
-// Save all contacts to a file; this function is called when the user exits the program
-void saveContactsToFile(struct Contact contacts[], int count) {
-    FILE *fp = fopen("contacts.txt", "w"); // Open the file in write mode ("w")
-    // Check if the file was opened successfully
-    if (!fp) {
-        printf("Failed to open file for saving contacts.\n");
-        return; // Exit the function if the file could not be opened
+typedef const char *ScanFind(const char *p, const char *end, const char *folded, size_t length);
+
+// The widest scan this CPU can run, picked on first use. Server threads may race to pick it, but they all
+// pick the same one
+static ScanFind *scanFind(void) {
+#ifdef SCAN_X86
+    static ScanFind *best = NULL;
+    ScanFind *find = __atomic_load_n(&best, __ATOMIC_RELAXED);
+    if (!find) {
+        find = __builtin_cpu_supports("avx2") ? scanFindAvx2 : scanFindSse2;
+        __atomic_store_n(&best, find, __ATOMIC_RELAXED);
+    }
+    return find;
+#else
+    return scanFindScalar;
+#endif
+}
+
+// Push every record in [first, last) whose field contains the lowercased needle. Their strings must sit in the
+// heap in record order, so the span from the first string to the end of the last is scanned as one buffer and
+// each hit is mapped back to the record it falls in. A hit can't span two strings since the needle has no NUL,
+// but it can land in garbage or in another record's string between them, which the length check throws out
+static int scanRun(const struct StringColumn *column, size_t first, size_t last, const char *folded, size_t length,
+                   ScanFind *find, struct ContactMatches *matches) {
+    const char *heap = column->heap, *p = heap + column->offsets[first], *hit;
+    const char *end = heap + column->offsets[last - 1];
+    end += strlen(end);
+    size_t i = first;
+    int status = 0;
+    while (status == 0 && (hit = find(p, end, folded, length))) {
+        size_t at = (size_t)(hit - heap);
+        while (i + 1 < last && column->offsets[i + 1] <= at) i++; // Last record starting at or before the hit
+        size_t size = strlen(heap + column->offsets[i]);
+        if (at + length <= column->offsets[i] + size) {
+            status = matchesPush(matches, i);
+            p = heap + column->offsets[i] + size + 1; // One match per record is enough
+        } else {
+            p = hit + 1;
+        }
     }
+    return status;
+}
 
-    // Loop through all contacts and write their details to the file
-    for (int i = 0; i < count; i++) {
-        fprintf(fp, "%s\n%s\n%s\n%s\n", contacts[i].name, contacts[i].phone, contacts[i].address, contacts[i].email); // Write each field on a new line
+// Push every record whose field contains the lowercased needle, in record order. Appends, deletes and compaction
+// keep a column's strings in record order, so the heap is normally scanned in one go; an edited record's string
+// moves to the end of the heap and splits the scan into runs either side of it. A run also ends at a big jump
+// forward, or it would read through everything in between. Deleted records keep their strings until their slot
+// is reused, so they're scanned along with the rest and dropped from the matches afterwards
+static int scanColumn(const struct ContactStore *store, enum ContactField field, const char *folded, size_t length,
+                      struct ContactMatches *matches) {
+    const struct StringColumn *column = &store->columns[field];
+    int status = 0;
+    size_t before = matches->count;
+    if (length == 0) { // Every string contains the empty needle
+        for (size_t i = 0; i < store->slots && status == 0; i++) status = matchesPush(matches, i);
+    } else {
+        ScanFind *find = scanFind();
+        for (size_t first = 0; first < store->slots && status == 0;) {
+            size_t last = first + 1;
+            while (last < store->slots && column->offsets[last - 1] < column->offsets[last] &&
+                   column->offsets[last] - column->offsets[last - 1] <= SCAN_MAX_GAP) last++;
+            status = scanRun(column, first, last, folded, length, find, matches);
+            first = last;
+        }
     }
-    fclose(fp); // Close the file
-    printf("Contacts saved to file.\n");
+    if (store->count < store->slots) {
+        size_t kept = before;
+        for (size_t i = before; i < matches->count; i++)
+            if (!storeIsDeleted(store, matches->positions[i])) matches->positions[kept++] = matches->positions[i];
+        matches->count = kept;
+    }
+    return status;
 }
 
-// Load contacts from a file into the array; this function is called when the program first starts
-void loadContactsFromFile(struct Contact contacts[], int *count) {
-    FILE *fp = fopen("contacts.txt", "r"); // Open the file in read mode ("r")
-    // Check if the file exists or can be opened
-    if (!fp) {
-        printf("No previous contacts file found. Starting fresh.\n");
-        return; // No file found, just exit the function
+// Find every contact whose field contains the needle, ignoring case, by scanning the whole column
+int storeScanField(const struct ContactStore *store, enum ContactField field, const char *needle, struct ContactMatches *matches) {
+    STATS_TIMER(started);
+    matches->count = 0;
+    size_t length = strlen(needle);
+    char *folded = malloc(length + 1);
+    if (!folded) return -1;
+    for (size_t i = 0; i <= length; i++)
+        folded[i] = (char)tolower((unsigned char)needle[i]);
+    int status = scanColumn(store, field, folded, length, matches);
+    free(folded);
+    STATS_COUNT(STAT_SCAN_SEARCHES);
+    STATS_ADD(STAT_SEARCH_MATCHES, matches->count);
+    STATS_RECORD(STAT_OP_SEARCH, started);
+    return status;
+}
+
+// Find every contact whose name contains the needle, ignoring case. Needles of three or more characters
+// only check the names listed under the needle's rarest trigram; shorter ones scan every name
+static int searchName(const struct ContactStore *store, const char *needle, struct ContactMatches *matches) {
+    matches->count = 0;
+    // Names are matched against the folded column, so the needle only has to be lowercased once
+    size_t length = strlen(needle);
+    char *folded = malloc(length + 1);
+    if (!folded) return -1;
+    for (size_t i = 0; i <= length; i++)
+        folded[i] = (char)tolower((unsigned char)needle[i]);
+    int status = 0;
+
+    if (length < 3) {
+        status = scanColumn(store, FIELD_FOLDED_NAME, folded, length, matches);
+        free(folded);
+        STATS_COUNT(STAT_SCAN_SEARCHES);
+        return status;
+    }
+
+    STATS_COUNT(STAT_TRIGRAM_SEARCHES);
+
+    // Every match contains all of the needle's trigrams, so the shortest posting list bounds the candidates
+    const struct TrigramPosting *rarest = NULL;
+    for (size_t i = 0; folded[i + 2]; i++) {
+        const struct TrigramPosting *posting = trigramFind(&store->nameTrigrams, trigramAt(folded + i));
+        if (!posting || posting->count == 0) { // Some trigram appears in no name at all
+            free(folded);
+            return 0;
+        }
+        if (!rarest || posting->count < rarest->count) rarest = posting;
+    }
+    STATS_ADD(STAT_TRIGRAM_CANDIDATES, rarest->count);
+    for (uint32_t i = 0; i < rarest->count && status == 0; i++) {
+        size_t pos = rarest->positions[i];
+        if (!storeIsDeleted(store, pos) && strstr(storeField(store, pos, FIELD_FOLDED_NAME), folded)) status = matchesPush(matches, pos);
+    }
+    free(folded);
+    return status;
+}
+
+int storeSearchName(const struct ContactStore *store, const char *needle, struct ContactMatches *matches) {
+    STATS_TIMER(started);
+    int status = searchName(store, needle, matches);
+    STATS_ADD(STAT_SEARCH_MATCHES, matches->count);
+    STATS_RECORD(STAT_OP_SEARCH, started);
+    return status;
+}
+
+static int compareFuzzyMatches(const void *a, const void *b) {
+    const struct FuzzyMatch *matchA = a, *matchB = b;
+    if (matchA->pos != matchB->pos) return matchA->pos < matchB->pos ? -1 : 1;
+    return (matchA->distance > matchB->distance) - (matchA->distance < matchB->distance);
+}
+
+// Find every name with a word within maxDistance of `word`: walk the BK-tree from the root, only going into children
+// whose distance to their parent could put them in reach, then sort what was found by store position, keeping each
+// contact once at its closest distance. Deleted records are still listed until their slot is reused and are
+// skipped. Fills *matches (free it) and *count, 0 on success or -1 if out of memory
+static int fuzzyCollect(const struct ContactStore *store, const char *word, size_t length, unsigned maxDistance,
+                        struct FuzzyMatch **matches, size_t *count) {
+    const struct FuzzyIndex *index = &store->nameWords;
+    size_t cap = 0, depth = 0, stackCap = 16, visited = 0;
+    uint32_t *stack = malloc(stackCap * sizeof(*stack));
+    *matches = NULL;
+    *count = 0;
+    if (!stack) return -1;
+    if (index->count > 0) stack[depth++] = 0;
+    while (depth > 0) {
+        const struct FuzzyNode *node = &index->nodes[stack[--depth]];
+        unsigned distance = fuzzyDistance(word, length, index->words + node->word, node->length);
+        visited++;
+        if (distance <= maxDistance && node->count > 0) {
+            if (*count + node->count > cap) {
+                size_t newCap = cap ? cap : 64;
+                while (newCap < *count + node->count) newCap *= 2;
+                struct FuzzyMatch *grown = realloc(*matches, newCap * sizeof(*grown));
+                if (!grown) goto fail;
+                *matches = grown;
+                cap = newCap;
+            }
+            for (uint32_t i = 0; i < node->count; i++) {
+                if (storeIsDeleted(store, node->positions[i])) continue;
+                (*matches)[*count].pos = node->positions[i];
+                (*matches)[*count].distance = distance;
+                (*count)++;
+            }
+        }
+        for (uint32_t child = node->child; child != FUZZY_NO_NODE; child = index->nodes[child].sibling) {
+            unsigned edge = index->nodes[child].distance;
+            if (edge + maxDistance < distance || edge > distance + maxDistance) continue; // Nothing below is in reach
+            if (depth == stackCap) {
+                uint32_t *grown = realloc(stack, stackCap * 2 * sizeof(*stack));
+                if (!grown) goto fail;
+                stack = grown;
+                stackCap *= 2;
+            }
+            stack[depth++] = child;
+        }
     }
+    free(stack);
+    STATS_ADD(STAT_FUZZY_VISITS, visited);
 
-    // Read contacts from the file until the end of the file is reached
-    while (fscanf(fp, "%[^\n]\n%[^\n]\n%[^\n]\n%[^\n]\n", contacts[*count].name, contacts[*count].phone, contacts[*count].address, contacts[*count].email) != EOF) {
-        (*count)++; // Increment the contact count for each contact read
+    if (*count > 1) qsort(*matches, *count, sizeof(**matches), compareFuzzyMatches);
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (kept > 0 && (*matches)[kept - 1].pos == (*matches)[i].pos) continue; // Another of the name's words, further off
+        (*matches)[kept++] = (*matches)[i];
     }
-    fclose(fp); // Close the file~
+    *count = kept;
+    return 0;
+
+fail:
+    free(stack);
+    free(*matches);
+    *matches = NULL;
+    *count = 0;
+    return -1;
 }
 
+// Find the contacts whose names have, for every word of the query, a word within maxDistance of it (a negative
+// maxDistance allows 1 for words of up to four letters and 2 for longer ones), ignoring case. Each match's distance
+// is the sum of its words' distances. Builds the word index the first time. Fills *matches in store position order
+// (free it) and *count, 0 on success or -1 if out of memory
+int storeFuzzySearch(struct ContactStore *store, const char *query, int maxDistance, struct FuzzyMatch **matches, size_t *count) {
+    STATS_TIMER(started);
+    struct FuzzyIndex *index = &store->nameWords;
+    *matches = NULL;
+    *count = 0;
+    if (!index->built) {
+        for (size_t pos = 0; pos < store->slots; pos++) {
+            if (storeIsDeleted(store, pos)) continue;
+            if (fuzzyIndexInsert(index, pos, storeField(store, pos, FIELD_FOLDED_NAME)) != 0) {
+                fuzzyIndexFree(index);
+                return -1;
+            }
+        }
+        index->built = 1;
+    }
+
+    // Lowercase the query and split it into words the same way names are split
+    size_t length = strlen(query);
+    char *folded = malloc(length + 1);
+    if (!folded) return -1;
+    for (size_t i = 0; i <= length; i++)
+        folded[i] = (char)tolower((unsigned char)query[i]);
+    char words[FUZZY_MAX_QUERY_WORDS][FUZZY_MAX_WORD + 1];
+    size_t lengths[FUZZY_MAX_QUERY_WORDS];
+    int wordCount = 0;
+    for (const char *p = folded; wordCount < FUZZY_MAX_QUERY_WORDS && (p = fuzzyNextWord(p, words[wordCount], &lengths[wordCount]));)
+        wordCount++;
+    free(folded);
 
+    // Each word's matches, then only the contacts every word found, starting from the word with the fewest
+    struct FuzzyMatch *found[FUZZY_MAX_QUERY_WORDS];
+    size_t foundCount[FUZZY_MAX_QUERY_WORDS];
+    int status = 0, collected = 0, fewest = 0;
+    for (; collected < wordCount && status == 0; collected++) {
+        unsigned reach = maxDistance >= 0 ? (unsigned)maxDistance : lengths[collected] <= 4 ? 1 : 2;
+        status = fuzzyCollect(store, words[collected], lengths[collected], reach, &found[collected], &foundCount[collected]);
+        if (status == 0 && foundCount[collected] < foundCount[fewest]) fewest = collected;
+    }
+    if (status != 0) collected--; // The one that failed has nothing to free
+    if (status == 0 && wordCount > 0) {
+        struct FuzzyMatch *result = found[fewest];
+        size_t kept = foundCount[fewest];
+        for (int w = 0; w < wordCount; w++) {
+            if (w == fewest) continue;
+            size_t next = 0, j = 0;
+            for (size_t i = 0; i < kept; i++) { // Both lists are in position order, so this is a merge
+                while (j < foundCount[w] && found[w][j].pos < result[i].pos) j++;
+                if (j == foundCount[w]) break;
+                if (found[w][j].pos != result[i].pos) continue;
+                result[next] = result[i];
+                result[next++].distance += found[w][j].distance;
+            }
+            kept = next;
+        }
+        *matches = result;
+        *count = kept;
+        found[fewest] = NULL;
+    }
+    for (int w = 0; w < collected; w++)
+        free(found[w]);
+    STATS_ADD(STAT_SEARCH_MATCHES, *count);
+    STATS_RECORD(STAT_OP_FUZZY, started);
+    return status;
+}
 
+// Fill in the phone trie from every contact, unless that's already been done; from then on it's kept up to date.
+// Returns 0, or -1 if out of memory with the trie left unbuilt
+int storeBuildPhoneTrie(struct ContactStore *store) {
+    struct PhoneTrie *trie = &store->phoneTrie;
+    if (trie->built) return 0;
+    for (size_t pos = 0; pos < store->slots; pos++) {
+        if (storeIsDeleted(store, pos)) continue;
+        if (phoneTrieInsert(trie, storeField(store, pos, FIELD_PHONE), pos) != 0) {
+            phoneTrieFree(trie);
+            return -1;
+        }
+    }
+    trie->built = 1;
+    return 0;
+}
 
+// Fill `positions` with up to `limit` contacts whose phone keys start with the digits of `prefix`, in digit
+// order, by walking the subtree under the prefix. The trie must have been built. Returns how many were found
+size_t storeCompletePhone(const struct ContactStore *store, const char *prefix, size_t *positions, size_t limit) {
+    STATS_TIMER(started);
+    const struct PhoneTrie *trie = &store->phoneTrie;
+    char key[PHONE_TRIE_MAX_KEY + 1];
+    size_t length = phoneTrieQuery(prefix, key), count = 0;
+    uint32_t longest;
+    int partial;
+    // No key in the trie is longer than PHONE_TRIE_MAX_KEY, so a longer prefix can't start any of them
+    uint32_t top = length <= PHONE_TRIE_MAX_KEY ? phoneTrieWalk(trie, key, length, &longest, &partial) : PHONE_TRIE_NONE;
+    // Each node before its children, the children in order; the parent links lead back out of a finished subtree
+    for (uint32_t node = top; node != PHONE_TRIE_NONE && count < limit;) {
+        const struct PhoneTrieNode *visit = &trie->nodes[node];
+        if (visit->pos != 0) positions[count++] = visit->pos - 1;
+        if (visit->child != PHONE_TRIE_NONE) {
+            node = visit->child;
+            continue;
+        }
+        while (node != top && trie->nodes[node].sibling == PHONE_TRIE_NONE) node = trie->nodes[node].parent;
+        node = node == top ? PHONE_TRIE_NONE : trie->nodes[node].sibling;
+    }
+    STATS_RECORD(STAT_OP_COMPLETE, started);
+    return count;
+}
+
+// Caller ID: the contact whose phone key is the number's, or failing that the one with the longest phone key the
+// number starts with, such as a switchboard for a direct line. *exact says which it was. An exact match is looked
+// up in the phone index first, which also has the numbers too long for the trie. The trie must have been built.
+// Returns the contact's position or CONTACT_NOT_FOUND
+size_t storeFindCaller(const struct ContactStore *store, const char *number, int *exact) {
+    STATS_TIMER(started);
+    size_t pos = hashIndexFind(&store->phoneIndex, store, number);
+    *exact = pos != CONTACT_NOT_FOUND;
+    if (!*exact) {
+        const struct PhoneTrie *trie = &store->phoneTrie;
+        char key[PHONE_TRIE_MAX_KEY + 1];
+        size_t length = phoneTrieQuery(number, key);
+        uint32_t longest;
+        int partial;
+        // A number too long for the trie still finds its prefixes among the first PHONE_TRIE_MAX_KEY digits
+        uint32_t node = phoneTrieWalk(trie, key, length < PHONE_TRIE_MAX_KEY ? length : PHONE_TRIE_MAX_KEY, &longest, &partial);
+        *exact = node != PHONE_TRIE_NONE && node == longest && length <= PHONE_TRIE_MAX_KEY;
+        if (longest != PHONE_TRIE_NONE) pos = trie->nodes[longest].pos - 1;
+    }
+    STATS_RECORD(STAT_OP_CALLER, started);
+    return pos;
+}
+
+// Order of a contact relative to a (name, position) key: by case-folded name, then by position so ties stay stable
+static int orderCompare(const struct ContactStore *store, uint32_t pos, const char *name, uint32_t namePos) {
+    int cmp = strcasecmp(storeField(store, pos, FIELD_FOLDED_NAME), name);
+    if (cmp != 0) return cmp;
+    return (pos > namePos) - (pos < namePos);
+}
+
+// First block whose last entry is >= the key, or blockCount if the key is past every entry
+static size_t orderFindBlock(const struct ContactStore *store, const char *name, uint32_t namePos) {
+    const struct OrderIndex *order = &store->order;
+    size_t lo = 0, hi = order->blockCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct OrderBlock *block = order->blocks[mid];
+        if (orderCompare(store, block->positions[block->count - 1], name, namePos) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// First entry in a block that is >= the key
+static uint32_t orderFindInBlock(const struct ContactStore *store, const struct OrderBlock *block, const char *name, uint32_t namePos) {
+    uint32_t lo = 0, hi = block->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (orderCompare(store, block->positions[mid], name, namePos) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Make sure the blocks array has room for one more block pointer
+static int orderGrowBlocks(struct OrderIndex *order) {
+    if (order->blockCount < order->blockCap) return 0;
+    size_t newCap = order->blockCap ? order->blockCap * 2 : 16;
+    struct OrderBlock **blocks = realloc(order->blocks, newCap * sizeof(*blocks));
+    if (!blocks) return -1;
+    order->blocks = blocks;
+    order->blockCap = newCap;
+    return 0;
+}
+
+// Make room for one more block pointer at a given slot of the blocks array
+static int orderInsertBlock(struct OrderIndex *order, size_t at, struct OrderBlock *block) {
+    if (orderGrowBlocks(order) != 0) return -1;
+    memmove(&order->blocks[at + 1], &order->blocks[at], (order->blockCount - at) * sizeof(*order->blocks));
+    order->blocks[at] = block;
+    order->blockCount++;
+    return 0;
+}
+
+// Set up an empty ordered index
+static void orderIndexInit(struct OrderIndex *order) {
+    order->blocks = NULL;
+    order->blockCount = 0;
+    order->blockCap = 0;
+    order->spare = NULL;
+}
+
+// Release every block of the ordered index
+static void orderIndexFree(struct OrderIndex *order) {
+    for (size_t i = 0; i < order->blockCount; i++)
+        free(order->blocks[i]);
+    free(order->blocks);
+    free(order->spare);
+    orderIndexInit(order);
+}
+
+// Set aside everything the next insert can need, so it can't run out of memory: a block to start the index or
+// split into, and room in the blocks array for it
+static int orderIndexReserve(struct OrderIndex *order) {
+    if (!order->spare && !(order->spare = malloc(sizeof(*order->spare)))) return -1;
+    return orderGrowBlocks(order);
+}
+
+// A block for the index to take on, the one set aside by orderIndexReserve if there is one
+static struct OrderBlock *orderNewBlock(struct OrderIndex *order) {
+    struct OrderBlock *block = order->spare;
+    order->spare = NULL;
+    return block ? block : malloc(sizeof(*block));
+}
+
+// Put a store position into the ordered index; a full block is split in half first
+static int orderIndexInsert(struct ContactStore *store, size_t pos) {
+    struct OrderIndex *order = &store->order;
+    const char *name = storeField(store, pos, FIELD_FOLDED_NAME);
+
+    if (order->blockCount == 0) {
+        // First contact; start the index with a one-entry block
+        struct OrderBlock *block = orderNewBlock(order);
+        if (!block) return -1;
+        block->count = 1;
+        block->positions[0] = (uint32_t)pos;
+        if (orderInsertBlock(order, 0, block) != 0) {
+            free(block);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t b = orderFindBlock(store, name, (uint32_t)pos);
+    if (b == order->blockCount) b--; // Past the end, so it goes at the end of the last block
+    struct OrderBlock *block = order->blocks[b];
+
+    if (block->count == ORDER_BLOCK_CAP) {
+        struct OrderBlock *upper = orderNewBlock(order);
+        if (!upper) return -1;
+        upper->count = ORDER_BLOCK_CAP / 2;
+        memcpy(upper->positions, &block->positions[ORDER_BLOCK_CAP / 2], upper->count * sizeof(uint32_t));
+        if (orderInsertBlock(order, b + 1, upper) != 0) {
+            free(upper);
+            return -1;
+        }
+        block->count = ORDER_BLOCK_CAP / 2;
+        if (orderCompare(store, block->positions[block->count - 1], name, (uint32_t)pos) < 0) block = upper;
+    }
+
+    uint32_t at = orderFindInBlock(store, block, name, (uint32_t)pos);
+    memmove(&block->positions[at + 1], &block->positions[at], (block->count - at) * sizeof(uint32_t));
+    block->positions[at] = (uint32_t)pos;
+    block->count++;
+    return 0;
+}
+
+// Take a store position out of the ordered index; empty blocks are released
+static void orderIndexRemove(struct ContactStore *store, size_t pos) {
+    struct OrderIndex *order = &store->order;
+    const char *name = storeField(store, pos, FIELD_FOLDED_NAME);
+    size_t b = orderFindBlock(store, name, (uint32_t)pos);
+    if (b == order->blockCount) return; // Not indexed
+    struct OrderBlock *block = order->blocks[b];
+    uint32_t at = orderFindInBlock(store, block, name, (uint32_t)pos);
+    if (at == block->count || block->positions[at] != (uint32_t)pos) return;
+
+    memmove(&block->positions[at], &block->positions[at + 1], (block->count - at - 1) * sizeof(uint32_t));
+    if (--block->count == 0) {
+        free(block);
+        memmove(&order->blocks[b], &order->blocks[b + 1], (order->blockCount - b - 1) * sizeof(*order->blocks));
+        order->blockCount--;
+    }
+}
+
+// Point a cursor at the first contact whose name is >= the given one, ignoring case; "" starts at the beginning
+void storeOrderSeek(const struct ContactStore *store, const char *name, struct OrderCursor *cursor) {
+    cursor->block = orderFindBlock(store, name, 0);
+    cursor->offset = cursor->block < store->order.blockCount
+                         ? orderFindInBlock(store, store->order.blocks[cursor->block], name, 0)
+                         : 0;
+}
+
+// Return the store position under the cursor and step past it, or CONTACT_NOT_FOUND once every contact was visited
+size_t storeOrderNext(const struct ContactStore *store, struct OrderCursor *cursor) {
+    while (cursor->block < store->order.blockCount) {
+        const struct OrderBlock *block = store->order.blocks[cursor->block];
+        if (cursor->offset < block->count) return block->positions[cursor->offset++];
+        cursor->block++;
+        cursor->offset = 0;
+    }
+    return CONTACT_NOT_FOUND;
+}
+
+// Step over n contacts a whole block at a time where possible, so paging deep into a listing costs n / ORDER_BLOCK_CAP
+size_t storeOrderSkip(const struct ContactStore *store, struct OrderCursor *cursor, size_t n) {
+    size_t skipped = 0;
+    while (skipped < n && cursor->block < store->order.blockCount) {
+        size_t left = store->order.blocks[cursor->block]->count - cursor->offset;
+        if (n - skipped < left) {
+            cursor->offset += n - skipped;
+            return n;
+        }
+        skipped += left;
+        cursor->block++;
+        cursor->offset = 0;
+    }
+    return skipped;
+}
+
+// Fill `positions` with up to `limit` contacts in name order whose names start with `prefix`, ignoring case. The
+// ordered index is already sorted on the folded names, so this is a seek to the prefix and a walk from there.
+// Returns how many were found
+size_t storeCompleteName(const struct ContactStore *store, const char *prefix, size_t *positions, size_t limit) {
+    STATS_TIMER(started);
+    struct OrderCursor cursor;
+    storeOrderSeek(store, prefix, &cursor);
+    size_t length = strlen(prefix), count = 0, pos;
+    while (count < limit && (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND &&
+           strncasecmp(storeField(store, pos, FIELD_FOLDED_NAME), prefix, length) == 0)
+        positions[count++] = pos;
+    STATS_RECORD(STAT_OP_COMPLETE, started);
+    return count;
+}
+
+// Set up an empty column; the heap and offsets are allocated as contacts arrive
+static void columnInit(struct StringColumn *column) {
+    column->offsets = NULL;
+    column->heap = NULL;
+    column->heapSize = 0;
+    column->heapCap = 0;
+    column->garbage = 0;
+}
+
+// Copy a string and its NUL onto the end of a column's heap, doubling the heap when it's full.
+// The string may already be in this heap (one record copied onto another), so it's found again after a move
+static int columnAppend(struct StringColumn *column, const char *s, uint32_t *offset) {
+    size_t size = strlen(s) + 1;
+    if (column->heapSize + size > column->heapCap) {
+        if (column->heapSize + size > COLUMN_MAX_HEAP) return -1;
+        size_t newCap = column->heapCap ? column->heapCap : COLUMN_MIN_HEAP;
+        while (newCap < column->heapSize + size) newCap *= 2;
+        if (newCap > COLUMN_MAX_HEAP) newCap = COLUMN_MAX_HEAP;
+        uintptr_t at = (uintptr_t)s - (uintptr_t)column->heap;
+        int inHeap = column->heap && at < column->heapSize;
+        char *heap = realloc(column->heap, newCap);
+        if (!heap) return -1;
+        column->heap = heap;
+        column->heapCap = newCap;
+        if (inHeap) s = heap + at;
+    }
+    memcpy(column->heap + column->heapSize, s, size);
+    *offset = (uint32_t)column->heapSize;
+    column->heapSize += size;
+    return 0;
+}
+
+// Give back a string no record points at any more; at the end of the heap it's simply cut off,
+// anywhere else it's counted as garbage for the next compaction
+static void columnRelease(struct StringColumn *column, uint32_t offset) {
+    size_t size = strlen(column->heap + offset) + 1;
+    if (offset + size == column->heapSize) column->heapSize = offset;
+    else column->garbage += size;
+}
+
+// Rewrite a column's heap with just the strings of the first `count` records, in record order
+static void columnCompact(struct StringColumn *column, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+        size += strlen(column->heap + column->offsets[i]) + 1;
+    char *heap = malloc(size ? size : 1);
+    if (!heap) return; // Not fatal, the garbage just stays a while longer
+    size_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *s = column->heap + column->offsets[i];
+        size_t length = strlen(s) + 1;
+        memcpy(heap + at, s, length);
+        column->offsets[i] = (uint32_t)at;
+        at += length;
+    }
+    free(column->heap);
+    column->heap = heap;
+    column->heapSize = size;
+    column->heapCap = size ? size : 1;
+    column->garbage = 0;
+}
+
+// Compact every column that is at least half garbage
+static void storeCompactColumns(struct ContactStore *store) {
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        struct StringColumn *column = &store->columns[f];
+        if (column->garbage >= COLUMN_COMPACT_MIN && column->garbage * 2 > column->heapSize) {
+            columnCompact(column, store->slots);
+            STATS_COUNT(STAT_COMPACTIONS);
+        }
+    }
+}
+
+// Set up an empty store; no memory is allocated until the first contact is appended
+void storeInit(struct ContactStore *store) {
+    for (int f = 0; f < FIELD_COUNT; f++)
+        columnInit(&store->columns[f]);
+    store->count = 0;
+    store->slots = 0;
+    store->cap = 0;
+    store->deleted = NULL;
+    store->freeSlots = NULL;
+    hashIndexInit(&store->nameIndex, INDEX_BY_NAME);
+    hashIndexInit(&store->phoneIndex, INDEX_BY_PHONE);
+    trigramIndexInit(&store->nameTrigrams);
+    fuzzyIndexInit(&store->nameWords);
+    phoneTrieInit(&store->phoneTrie);
+    orderIndexInit(&store->order);
+    store->journal = NULL;
+    store->lsn = 0;
+    store->threads = 1;
+}
+
+// Release every column and the indexes
+void storeFree(struct ContactStore *store) {
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        free(store->columns[f].offsets);
+        free(store->columns[f].heap);
+    }
+    free(store->deleted);
+    free(store->freeSlots);
+    hashIndexFree(&store->nameIndex);
+    hashIndexFree(&store->phoneIndex);
+    trigramIndexFree(&store->nameTrigrams);
+    fuzzyIndexFree(&store->nameWords);
+    phoneTrieFree(&store->phoneTrie);
+    orderIndexFree(&store->order);
+    int threads = store->threads;
+    storeInit(store); // Leave the store empty but usable
+    store->threads = threads; // A setting rather than contents, so it's kept
+}
+
+// One field of the record at a position, straight out of its column's heap
+const char *storeField(const struct ContactStore *store, size_t index, enum ContactField field) {
+    const struct StringColumn *column = &store->columns[field];
+    return column->heap + column->offsets[index];
+}
+
+// Whether the record at a position has been deleted and its slot not reused yet
+int storeIsDeleted(const struct ContactStore *store, size_t index) {
+    return store->deleted && store->deleted[index];
+}
+
+// Get the record at a position; the fields point into the store and stay valid until it next changes
+struct Contact storeGet(const struct ContactStore *store, size_t index) {
+    struct Contact contact = {
+        storeField(store, index, FIELD_NAME),
+        storeField(store, index, FIELD_PHONE),
+        storeField(store, index, FIELD_ADDRESS),
+        storeField(store, index, FIELD_EMAIL),
+    };
+    return contact;
+}
+
+// Make sure every column's offsets array, and the deleted flags and free list once there are any, have room for
+// one more record, doubling them when full
+static int storeReserve(struct ContactStore *store) {
+    if (store->slots < store->cap) return 0;
+    size_t newCap = store->cap ? store->cap * 2 : 1024;
+    if (newCap > UINT32_MAX) return -1; // Positions are 32-bit in the indexes
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        uint32_t *offsets = realloc(store->columns[f].offsets, newCap * sizeof(*offsets));
+        if (!offsets) return -1; // Columns grown so far just keep their extra room
+        store->columns[f].offsets = offsets;
+    }
+    if (store->deleted) {
+        unsigned char *deleted = realloc(store->deleted, newCap);
+        if (!deleted) return -1;
+        memset(deleted + store->cap, 0, newCap - store->cap);
+        store->deleted = deleted;
+        uint32_t *freeSlots = realloc(store->freeSlots, newCap * sizeof(*freeSlots));
+        if (!freeSlots) return -1;
+        store->freeSlots = freeSlots;
+    }
+    store->cap = newCap;
+    return 0;
+}
+
+// Copy a contact's strings into the columns and point the record at a position at them. The old strings are
+// not released. On failure the record is left as it was
+static int storeWrite(struct ContactStore *store, size_t index, const struct Contact *contact) {
+    const char *fields[FIELD_COUNT] = { contact->name, contact->phone, contact->address, contact->email, NULL };
+    uint32_t offsets[FIELD_COUNT];
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        // The folded name is copied from the name just stored, which can't have moved since
+        const char *s = f == FIELD_FOLDED_NAME ? store->columns[FIELD_NAME].heap + offsets[FIELD_NAME] : fields[f];
+        if (columnAppend(&store->columns[f], s, &offsets[f]) != 0) {
+            while (f-- > 0) store->columns[f].heapSize = offsets[f]; // Drop the strings appended so far
+            return -1;
+        }
+    }
+    for (char *c = store->columns[FIELD_FOLDED_NAME].heap + offsets[FIELD_FOLDED_NAME]; *c; c++)
+        *c = (char)tolower((unsigned char)*c);
+    for (int f = 0; f < FIELD_COUNT; f++)
+        store->columns[f].offsets[index] = offsets[f];
+    return 0;
+}
+
+// Copy a contact onto the end of the store without indexing it; returns its position or CONTACT_NOT_FOUND
+static size_t storeAppend(struct ContactStore *store, const struct Contact *contact) {
+    if (storeReserve(store) != 0 || storeWrite(store, store->slots, contact) != 0) return CONTACT_NOT_FOUND;
+    store->count++;
+    return store->slots++;
+}
+
+// Give the trailing record back along with its strings
+static void storeDropLast(struct ContactStore *store) {
+    store->count--;
+    store->slots--;
+    for (int f = 0; f < FIELD_COUNT; f++)
+        columnRelease(&store->columns[f], store->columns[f].offsets[store->slots]);
+}
+
+// Add a contact to every index; on failure the indexes are left as they were
+static int storeIndexAdd(struct ContactStore *store, size_t index) {
+    const char *folded = storeField(store, index, FIELD_FOLDED_NAME);
+    if (hashIndexInsert(&store->nameIndex, store, index) != 0) return -1;
+    if (hashIndexInsert(&store->phoneIndex, store, index) != 0) {
+        hashIndexRemove(&store->nameIndex, store, index);
+        return -1;
+    }
+    if (trigramIndexInsert(&store->nameTrigrams, index, folded) != 0) {
+        hashIndexRemove(&store->nameIndex, store, index);
+        hashIndexRemove(&store->phoneIndex, store, index);
+        return -1;
+    }
+    if (orderIndexInsert(store, index) != 0) {
+        hashIndexRemove(&store->nameIndex, store, index);
+        hashIndexRemove(&store->phoneIndex, store, index);
+        trigramIndexRemove(&store->nameTrigrams, index, folded);
+        return -1;
+    }
+    if (store->nameWords.built && fuzzyIndexInsert(&store->nameWords, index, folded) != 0) {
+        hashIndexRemove(&store->nameIndex, store, index);
+        hashIndexRemove(&store->phoneIndex, store, index);
+        trigramIndexRemove(&store->nameTrigrams, index, folded);
+        orderIndexRemove(store, index);
+        return -1;
+    }
+    if (store->phoneTrie.built && phoneTrieInsert(&store->phoneTrie, storeField(store, index, FIELD_PHONE), index) != 0) {
+        hashIndexRemove(&store->nameIndex, store, index);
+        hashIndexRemove(&store->phoneIndex, store, index);
+        trigramIndexRemove(&store->nameTrigrams, index, folded);
+        orderIndexRemove(store, index);
+        if (store->nameWords.built) fuzzyIndexRemove(&store->nameWords, index, folded);
+        return -1;
+    }
+    return 0;
+}
+
+// Take a contact's number out of the phone trie, if it's built, once it's out of the phone index; a contact left
+// in the phone index with the same number takes the key over
+static void storeTrieRemove(struct ContactStore *store, size_t index) {
+    if (!store->phoneTrie.built) return;
+    const char *phone = storeField(store, index, FIELD_PHONE);
+    phoneTrieRemove(&store->phoneTrie, phone, index, hashIndexFind(&store->phoneIndex, store, phone));
+}
+
+// Set aside what putting a contact's entries back after storeIndexRemove can need beyond what the removal leaves,
+// so a rollback can't run out of memory. The hash, trigram and word indexes keep their room when entries go, but
+// the ordered index frees blocks that empty and the phone trie prunes and merges nodes, so the next ordered
+// insert gets its block and the trie the nodes for a root, a split and the longest key.
+// Returns 0, or -1 if out of memory with nothing changed that matters
+static int storeIndexReserve(struct ContactStore *store) {
+    if (orderIndexReserve(&store->order) != 0) return -1;
+    size_t nodes = 2 + (PHONE_TRIE_MAX_KEY + PHONE_TRIE_LABEL - 1) / PHONE_TRIE_LABEL;
+    return store->phoneTrie.built ? phoneTrieReserve(&store->phoneTrie, nodes) : 0;
+}
+
+// Remove a contact from every index; must run before the record changes
+static void storeIndexRemove(struct ContactStore *store, size_t index) {
+    hashIndexRemove(&store->nameIndex, store, index);
+    hashIndexRemove(&store->phoneIndex, store, index);
+    trigramIndexRemove(&store->nameTrigrams, index, storeField(store, index, FIELD_FOLDED_NAME));
+    orderIndexRemove(store, index);
+    if (store->nameWords.built) fuzzyIndexRemove(&store->nameWords, index, storeField(store, index, FIELD_FOLDED_NAME));
+    storeTrieRemove(store, index);
+}
+
+// Copy a contact into the slot of the most recently deleted record and index it. The trigram and word index
+// entries the deleted record left behind are cleared out first, then its strings released. Returns the position,
+// or CONTACT_NOT_FOUND with the slot still deleted
+static size_t storeReuse(struct ContactStore *store, const struct Contact *contact) {
+    size_t pos = store->freeSlots[store->slots - store->count - 1];
+    uint32_t old[FIELD_COUNT];
+    for (int f = 0; f < FIELD_COUNT; f++)
+        old[f] = store->columns[f].offsets[pos];
+    if (storeWrite(store, pos, contact) != 0) return CONTACT_NOT_FOUND;
+    const char *oldFolded = store->columns[FIELD_FOLDED_NAME].heap + old[FIELD_FOLDED_NAME];
+    trigramIndexRemove(&store->nameTrigrams, pos, oldFolded);
+    if (store->nameWords.built) fuzzyIndexRemove(&store->nameWords, pos, oldFolded);
+    int failed = storeIndexAdd(store, pos) != 0;
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        struct StringColumn *column = &store->columns[f];
+        if (failed) { // Back to the deleted record's strings, which no index lists any more
+            columnRelease(column, column->offsets[pos]);
+            column->offsets[pos] = old[f];
+        } else {
+            columnRelease(column, old[f]);
+        }
+    }
+    if (failed) return CONTACT_NOT_FOUND;
+    store->deleted[pos] = 0;
+    store->count++;
+    STATS_COUNT(STAT_SLOTS_REUSED);
+    return pos;
+}
+
+// Store a contact in the slot of the most recently deleted record, or on the end if there isn't one, and index it
+size_t storeInsert(struct ContactStore *store, const struct Contact *contact) {
+    STATS_TIMER(started);
+    size_t pos;
+    if (store->count < store->slots) {
+        pos = storeReuse(store, contact);
+        if (pos == CONTACT_NOT_FOUND) return CONTACT_NOT_FOUND;
+    } else {
+        pos = storeAppend(store, contact);
+        if (pos == CONTACT_NOT_FOUND) return CONTACT_NOT_FOUND;
+        if (storeIndexAdd(store, pos) != 0) {
+            storeDropLast(store); // Undo the append so the store and indexes agree
+            return CONTACT_NOT_FOUND;
+        }
+    }
+    struct Contact added = storeGet(store, pos); // `contact` may have pointed into a heap that has since moved
+    journalLog(store, JOURNAL_ADD, NULL, &added);
+    STATS_RECORD(STAT_OP_ADD, started);
+    return pos;
+}
+
+// Overwrite the contact at a position, keeping the indexes in step. Returns 0, -1 if out of memory with the old
+// contact left in place, or -2 if its index entries couldn't be put back either, which storeIndexReserve rules out
+int storeUpdate(struct ContactStore *store, size_t index, const struct Contact *contact) {
+    STATS_TIMER(started);
+    uint32_t old[FIELD_COUNT]; // The old strings stay in the heaps until the update has gone through
+    for (int f = 0; f < FIELD_COUNT; f++)
+        old[f] = store->columns[f].offsets[index];
+    // Re-adding the old contact's entries on the way out needs memory too, so that's set aside first
+    if (storeIndexReserve(store) != 0) return -1;
+    storeIndexRemove(store, index);
+    int failed = storeWrite(store, index, contact) != 0;
+    if (!failed && storeIndexAdd(store, index) != 0) {
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            columnRelease(&store->columns[f], store->columns[f].offsets[index]);
+            store->columns[f].offsets[index] = old[f];
+        }
+        failed = 1;
+    }
+    if (failed) {
+        // Still or again the old contact; storeIndexReserve made room for its entries, but check anyway so the
+        // indexes can't silently lose it
+        return storeIndexAdd(store, index) != 0 ? -2 : -1;
+    }
+    struct Contact updated = storeGet(store, index);
+    journalLog(store, JOURNAL_EDIT, store->columns[FIELD_NAME].heap + old[FIELD_NAME], &updated);
+    for (int f = 0; f < FIELD_COUNT; f++)
+        columnRelease(&store->columns[f], old[f]);
+    storeCompactColumns(store);
+    STATS_RECORD(STAT_OP_EDIT, started);
+    return 0;
+}
+
+// Delete the record at a position. It's only flagged as deleted and its slot put on the free list for the next
+// insert, so no other record moves. The name, phone and ordered indexes and the phone trie let go of it straight
+// away; its strings and its trigram and word index entries stay until the slot is reused, and searches skip it.
+// Every other position stays valid: compacting is left to callers holding none, see storeCompactDue.
+// Returns 0, or -1 if out of memory with the record left as it was
+int storeRemove(struct ContactStore *store, size_t index) {
+    STATS_TIMER(started);
+    if (!store->deleted) {
+        store->deleted = calloc(store->cap, 1);
+        store->freeSlots = malloc(store->cap * sizeof(*store->freeSlots));
+        if (!store->deleted || !store->freeSlots) {
+            free(store->deleted);
+            free(store->freeSlots);
+            store->deleted = NULL;
+            store->freeSlots = NULL;
+            return -1;
+        }
+    }
+    journalLog(store, JOURNAL_DELETE, storeField(store, index, FIELD_NAME), NULL);
+    hashIndexRemove(&store->nameIndex, store, index);
+    hashIndexRemove(&store->phoneIndex, store, index);
+    orderIndexRemove(store, index);
+    storeTrieRemove(store, index);
+    store->deleted[index] = 1;
+    store->freeSlots[store->slots - store->count] = (uint32_t)index;
+    store->count--;
+    STATS_RECORD(STAT_OP_DELETE, started);
+    return 0;
+}
+
+// Whether enough records are deleted for storeCompact to be worth running: at least STORE_COMPACT_MIN and more
+// than a quarter of the slots
+int storeCompactDue(const struct ContactStore *store) {
+    size_t deleted = store->slots - store->count;
+    return deleted >= STORE_COMPACT_MIN && deleted * 4 > store->slots;
+}
+
+// Where each record ends up once the deleted ones are squeezed out and the rest move down in order, UINT32_MAX
+// for the deleted ones. NULL if out of memory
+static uint32_t *storeRemap(const struct ContactStore *store) {
+    uint32_t *remap = malloc((store->slots ? store->slots : 1) * sizeof(*remap));
+    if (!remap) return NULL;
+    uint32_t next = 0;
+    for (size_t pos = 0; pos < store->slots; pos++)
+        remap[pos] = storeIsDeleted(store, pos) ? UINT32_MAX : next++;
+    return remap;
+}
+
+// Renumber a sorted list of positions, dropping the deleted ones; the order is kept so it stays sorted
+static uint32_t remapPositions(uint32_t *positions, uint32_t count, const uint32_t *remap) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++)
+        if (remap[positions[i]] != UINT32_MAX) positions[kept++] = remap[positions[i]];
+    return kept;
+}
+
+// Squeeze out the deleted records. The rest move down in order, which only copies their offsets, and every index
+// is renumbered in place rather than rebuilt; the deleted records' strings become garbage for the column
+// compaction. Positions held from before are meaningless afterwards. If out of memory nothing changes
+void storeCompact(struct ContactStore *store) {
+    if (store->count == store->slots) return;
+    uint32_t *remap = storeRemap(store);
+    if (!remap) return;
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        struct StringColumn *column = &store->columns[f];
+        for (size_t pos = 0; pos < store->slots; pos++) {
+            if (remap[pos] == UINT32_MAX) column->garbage += strlen(column->heap + column->offsets[pos]) + 1;
+            else column->offsets[remap[pos]] = column->offsets[pos];
+        }
+    }
+    struct HashIndex *hashes[2] = { &store->nameIndex, &store->phoneIndex };
+    for (int h = 0; h < 2; h++) {
+        for (size_t i = 0; i < hashes[h]->cap; i++)
+            if (hashes[h]->slots[i] != 0) hashes[h]->slots[i] = remap[hashes[h]->slots[i] - 1] + 1;
+    }
+    for (size_t i = 0; i < store->nameTrigrams.cap; i++) {
+        struct TrigramPosting *posting = &store->nameTrigrams.table[i];
+        if (posting->key != 0) posting->count = remapPositions(posting->positions, posting->count, remap);
+    }
+    for (size_t i = 0; i < store->nameWords.count; i++) {
+        struct FuzzyNode *node = &store->nameWords.nodes[i];
+        node->count = remapPositions(node->positions, node->count, remap);
+    }
+    for (size_t b = 0; b < store->order.blockCount; b++) {
+        struct OrderBlock *block = store->order.blocks[b];
+        for (uint32_t i = 0; i < block->count; i++) block->positions[i] = remap[block->positions[i]];
+    }
+    for (size_t i = 0; i < store->phoneTrie.count; i++) {
+        struct PhoneTrieNode *node = &store->phoneTrie.nodes[i];
+        if (node->pos != 0) node->pos = remap[node->pos - 1] + 1;
+    }
+    free(remap);
+    memset(store->deleted, 0, store->slots);
+    store->slots = store->count;
+    storeCompactColumns(store);
+    STATS_COUNT(STAT_STORE_COMPACTIONS);
+}
+
+// Case-insensitive exact name lookup through the name index
+size_t storeFindByName(const struct ContactStore *store, const char *name) {
+    size_t pos = hashIndexFind(&store->nameIndex, store, name);
+    STATS_COUNT(pos != CONTACT_NOT_FOUND ? STAT_NAME_HITS : STAT_NAME_MISSES);
+    return pos;
+}
+
+// Phone lookup through the phone index; "+44..." and "0044..." find the same contact
+size_t storeFindByPhone(const struct ContactStore *store, const char *phone) {
+    size_t pos = hashIndexFind(&store->phoneIndex, store, phone);
+    STATS_COUNT(pos != CONTACT_NOT_FOUND ? STAT_PHONE_HITS : STAT_PHONE_MISSES);
+    return pos;
+}
+
+// Fill an empty store with a copy of another one's contacts and index them. The copy has no journal.
+// Returns 0 on success or -1 if out of memory, leaving the copy empty
+int storeCopy(struct ContactStore *copy, const struct ContactStore *store) {
+    copy->threads = store->threads;
+    copy->lsn = store->lsn;
+    if (store->slots == 0) return 0;
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        const struct StringColumn *from = &store->columns[f];
+        struct StringColumn *to = &copy->columns[f];
+        to->offsets = malloc(store->slots * sizeof(*to->offsets));
+        to->heap = malloc(from->heapSize);
+        if (!to->offsets || !to->heap) {
+            storeFree(copy);
+            return -1;
+        }
+        memcpy(to->offsets, from->offsets, store->slots * sizeof(*to->offsets));
+        memcpy(to->heap, from->heap, from->heapSize);
+        to->heapSize = to->heapCap = from->heapSize;
+        to->garbage = from->garbage;
+    }
+    if (store->deleted) { // Same deleted records and free list, so both stores reuse the same slots
+        copy->deleted = malloc(store->slots);
+        copy->freeSlots = malloc(store->slots * sizeof(*copy->freeSlots));
+        if (!copy->deleted || !copy->freeSlots) {
+            storeFree(copy);
+            return -1;
+        }
+        memcpy(copy->deleted, store->deleted, store->slots);
+        memcpy(copy->freeSlots, store->freeSlots, (store->slots - store->count) * sizeof(*copy->freeSlots));
+    }
+    copy->count = store->count;
+    copy->slots = copy->cap = store->slots;
+    for (size_t pos = 0; pos < store->slots; pos++) {
+        if (storeIsDeleted(copy, pos)) continue;
+        if (storeIndexAdd(copy, pos) != 0) {
+            storeFree(copy);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// substring search that is case insensitive and useful for our searchContact() function
+// It compares characters in place, so unlike lowercasing copies of both strings it never allocates
+char *caseInsensitiveStrStr(const char *haystack, const char *needle) {
+    // If the needle (substring we're looking for) is empty, then the entire haystack is a match
+    if (!*needle) return (char *)haystack;
+
+    int first = tolower((unsigned char)needle[0]); // First needle character, lowercased once
+    for (; *haystack; haystack++) {
+        if (tolower((unsigned char)*haystack) != first) continue; // Cheap check before comparing the rest
+
+        // Compare the rest of the needle character by character, ignoring case
+        size_t i = 1;
+        while (needle[i] && tolower((unsigned char)haystack[i]) == tolower((unsigned char)needle[i])) i++;
+        if (!needle[i]) return (char *)haystack; // Reached the end of the needle, so it's a match
+        if (!haystack[i]) break; // Ran off the end of the haystack, no later start can match either
+    }
+    return NULL; // No match
+}
+
+int main(int argc, char *argv[]) {
+    struct ContactStore store;  // Growable store holding every contact
+    storeInit(&store);          // Start with an empty store
+
+    // Bulk imports use one thread per CPU unless -j/--threads says otherwise
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    store.threads = cpus < 1 ? 1 : cpus > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : (int)cpus;
+    int arg = 1;
+    int statsOnExit = 0; // --stats-on-exit prints the statistics to stderr just before the program ends
+    while (arg < argc) {
+        if (argc > arg + 1 && (strcmp(argv[arg], "-j") == 0 || strcmp(argv[arg], "--threads") == 0)) {
+            int threads = atoi(argv[arg + 1]);
+            if (threads < 1 || threads > IMPORT_MAX_THREADS) {
+                fprintf(stderr, "The thread count must be between 1 and %d.\n", IMPORT_MAX_THREADS);
+                return 2;
+            }
+            store.threads = threads;
+            arg += 2;
+        } else if (strcmp(argv[arg], "--stats-on-exit") == 0) {
+            statsOnExit = 1;
+            arg++;
+        } else {
+            break;
+        }
+    }
+    // bench and loadgen never touch the book, and loadgen runs next to a server that has it open
+    int usesBook = argc <= arg || (strcmp(argv[arg], "bench") != 0 && strcmp(argv[arg], "loadgen") != 0);
+    if (usesBook) loadContactsFromFile(&store); // Load existing contacts from a file
+
+    // Anything on the command line is run as a command instead of showing the menu
+    if (argc > arg) {
+        int status = runCommand(&store, argc - arg, argv + arg);
+        journalClose(&store); // Commits whatever the command changed
+        if (statsOnExit) statsPrint(stderr);
+        storeFree(&store);
+        return status;
+    }
+
+    int choice;  // Variable to store user's menu choice
+    while (1) { // Keep looping until the user decides to exit
+        displayMenu();  // Display the menu options
+        printf("Enter your choice: ");
+        // Validate input to make sure the user enters a valid number
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {
+            choice = 0; // Input closed; exit the same way as option 0 so nothing is lost
+        } else if (scanned != 1) {
+            printf("Invalid input! Please enter a number.\n");
+            clearLine(); // Clear the input buffer to avoid infinite loop
+            continue; // Go back to the beginning of the loop and try again
+        }
+
+        // Handle menu choices with a switch statement 
+        switch (choice) {
+            case 1: addContact(&store); break;  // Add a new contact; calls the addContact function
+            case 2: listContacts(&store); break;  // List all contacts; calls the listContacts function
+            case 3: searchContact(&store); break;  // Search for a contact; calls the searchContact function
+            case 4: editContact(&store); break;   // Edit a contact's details; calls the editContact function
+            case 5: deleteContact(&store); break;   // Delete a contact; calls the deleteContact function
+            case 6: listContactRange(&store); break;   // List a range of names; calls the listContactRange function
+            case 7: statsPrint(stdout); break;   // Show the counters and timings; calls the statsPrint function
+            case 8: fuzzySearchContact(&store); break;   // Search allowing for typos; calls the fuzzySearchContact function
+            case 0: // User wants to exit
+                printf("Exiting the program. Goodbye!\n");
+                saveContactsToFile(&store);  // Save contacts to a file before exiting
+                journalClose(&store);        // Wait for any background compaction and close the journal
+                if (statsOnExit) statsPrint(stderr);
+                storeFree(&store);           // Release the store's memory
+                return 0;  // Exit the program 
+            default: 
+                printf("Invalid choice! Please enter a valid option.\n");   // Invalid menu choice
+        }
+        journalCommit(&store); // Make the change durable; one fsync covers everything the action changed
+    }
+}
+
+// Display the main menu with options for the user
+void displayMenu() {
+    printf("\n\t\t***** Contact Management System *****\n"); // Menu Title
+    printf("\t\t=====================================\n"); // Title seperator
+    printf("\t\t[1] Add a New Contact\n"); // Option 1; add a contact
+    printf("\t\t[2] List All Contacts\n"); // Option 2; list all contacts
+    printf("\t\t[3] Search for a Contact\n"); // Option 3; search for a contact
+    printf("\t\t[4] Edit a Contact\n"); // Option 4; edit a contact
+    printf("\t\t[5] Delete a Contact\n"); // Option 5; delete a contact
+    printf("\t\t[6] List Contacts in a Name Range\n"); // Option 6; list names between two values
+    printf("\t\t[7] Show Statistics\n"); // Option 7; counters and timings since the program started
+    printf("\t\t[8] Search Allowing for Typos\n"); // Option 8; fuzzy search on name words
+    printf("\t\t[0] Exit\n"); // Option 0; exit the program
+    printf("\t\t=====================================\n"); // Another seperator
+}
+
+#if CM_ENABLE_STATS
+// Time as a short label for the histogram: 512ns, 1us, 33ms and so on
+static void statsFormatTime(char *buffer, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(buffer, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buffer, size, "%.0fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buffer, size, "%.0fms", ns / 1e6);
+    else snprintf(buffer, size, "%.0fs", ns / 1e9);
+}
+
+// Estimate a percentile from a histogram: the top of the bucket it falls in, or the slowest call if that's lower
+static uint64_t statsPercentile(const struct StatHistogram *histogram, int percent) {
+    uint64_t rank = (histogram->calls * (uint64_t)percent + 99) / 100, seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = b + 1 < 64 ? (uint64_t)1 << (b + 1) : UINT64_MAX;
+            return top < histogram->maxNs ? top : histogram->maxNs;
+        }
+    }
+    return histogram->maxNs;
+}
+#endif
+
+// Print what every thread has counted since the program started: a row for every operation that has run, with its
+// histogram underneath (each bucket is labelled with its lower bound and twice as wide as the one before),
+// then the counters
+void statsPrint(FILE *fp) {
+#if CM_ENABLE_STATS
+    static const char *const operationNames[STAT_OPERATION_COUNT] = {
+        "add", "search", "sort", "list", "edit", "delete", "load", "save", "commit", "import", "fuzzy", "complete",
+        "caller",
+    };
+    static const char *const counterNames[STAT_COUNTER_COUNT] = {
+        "name lookups found", "name lookups missed", "phone lookups found", "phone lookups missed",
+        "hash slots probed", "duplicates refused", "trigram searches", "trigram candidates checked",
+        "scanning searches", "search matches", "column compactions", "store compactions",
+        "deleted slots reused", "journal bytes written", "fuzzy words compared",
+    };
+    struct Stats stats = {0}; // Every thread's numbers added up
+    pthread_mutex_lock(&statsLock);
+    statsMerge(&stats, &statsFinished);
+    for (const struct StatsBlock *block = statsBlocks; block; block = block->next) statsMerge(&stats, &block->stats);
+    pthread_mutex_unlock(&statsLock);
+
+    fprintf(fp, "%-8s %10s %12s %10s %10s %10s %10s\n", "op", "calls", "total ms", "mean us", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+        const struct StatHistogram *histogram = &stats.operations[op];
+        if (histogram->calls == 0) continue;
+        fprintf(fp, "%-8s %10llu %12.3f %10.2f %10.2f %10.2f %10.2f\n", operationNames[op],
+                (unsigned long long)histogram->calls, histogram->totalNs / 1e6, histogram->totalNs / 1e3 / histogram->calls,
+                statsPercentile(histogram, 50) / 1e3, statsPercentile(histogram, 99) / 1e3, histogram->maxNs / 1e3);
+        fprintf(fp, "        ");
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            if (histogram->buckets[b] == 0) continue;
+            char label[16];
+            statsFormatTime(label, sizeof(label), (uint64_t)1 << b);
+            fprintf(fp, " %s:%llu", label, (unsigned long long)histogram->buckets[b]);
+        }
+        fprintf(fp, "\n");
+    }
+    for (int c = 0; c < STAT_COUNTER_COUNT; c++)
+        fprintf(fp, "%-28s %llu\n", counterNames[c], (unsigned long long)stats.counters[c]);
+#else
+    fprintf(fp, "Statistics were compiled out of this build (CM_ENABLE_STATS=0).\n");
+#endif
+}
+
+// Check a name is present and not used by another contact; with no store only the format is checked
+enum ContactError validateName(const struct ContactStore *store, const char *name, size_t self) {
+    if (name[0] == '\0') return CONTACT_EMPTY_NAME;
+    if (!store) return CONTACT_OK;
+    size_t other = storeFindByName(store, name); // The name index compares case-insensitively
+    if (other != CONTACT_NOT_FOUND && other != self) {
+        STATS_COUNT(STAT_DUPLICATES);
+        return CONTACT_DUPLICATE_NAME;
+    }
+    return CONTACT_OK;
+}
+
+// Check a phone number is +XXXX, 00XXXX or XXXX and not used by another contact
+enum ContactError validatePhone(const struct ContactStore *store, const char *phone, size_t self) {
+    if (phone[0] == '\0') return CONTACT_EMPTY_PHONE;
+    // Check for allowed characters: digits after an optional '+' or leading '00'
+    for (const char *digit = phoneKey(phone); *digit; digit++) {
+        if (!isdigit((unsigned char)*digit)) return CONTACT_INVALID_PHONE;
+    }
+    if (!store) return CONTACT_OK;
+    size_t other = storeFindByPhone(store, phone);
+    if (other != CONTACT_NOT_FOUND && other != self) {
+        STATS_COUNT(STAT_DUPLICATES);
+        return CONTACT_DUPLICATE_PHONE;
+    }
+    return CONTACT_OK;
+}
+
+// Simple check to ensure an email is present and has both '@' and '.'
+enum ContactError validateEmail(const char *email) {
+    if (email[0] == '\0') return CONTACT_EMPTY_EMAIL;
+    if (!strchr(email, '@') || !strchr(email, '.')) return CONTACT_INVALID_EMAIL;
+    return CONTACT_OK;
+}
+
+// Run every check addContact does, returning the first problem found. Fields have no length limit of
+// their own, but a contact as a whole must fit in CONTACT_MAX_BYTES
+enum ContactError validateContact(const struct ContactStore *store, const struct Contact *contact, size_t self) {
+    size_t size = strlen(contact->name) + strlen(contact->phone) + strlen(contact->address) + strlen(contact->email);
+    if (size > CONTACT_MAX_BYTES) return CONTACT_TOO_LONG;
+    enum ContactError error = validateName(store, contact->name, self);
+    if (error == CONTACT_OK) error = validatePhone(store, contact->phone, self);
+    if (error == CONTACT_OK) error = validateEmail(contact->email);
+    return error;
+}
+
+// Short description of a validation error for batch reports
+const char *contactErrorMessage(enum ContactError error) {
+    switch (error) {
+        case CONTACT_OK: return "ok";
+        case CONTACT_EMPTY_NAME: return "name is empty";
+        case CONTACT_DUPLICATE_NAME: return "name already exists";
+        case CONTACT_EMPTY_PHONE: return "phone is empty";
+        case CONTACT_INVALID_PHONE: return "phone has invalid characters";
+        case CONTACT_DUPLICATE_PHONE: return "phone already exists";
+        case CONTACT_EMPTY_EMAIL: return "email is empty";
+        case CONTACT_INVALID_EMAIL: return "email must contain '@' and '.'";
+        case CONTACT_TOO_LONG: return "contact is too long";
+        default: return "unknown error";
+    }
+}
+
+// Buffered writer for listings, search results and exports. Records are formatted straight into one large block
+// that goes to stdio in a single fwrite, rather than a printf or putc per field
+struct OutBuf {
+    FILE *fp;      // Where full blocks are written
+    char *data;    // Block being filled; NULL if it couldn't be allocated, and then everything is written directly
+    size_t length; // Bytes of the block in use
+    int failed;    // Set once a write fails
+};
+
+static void outInit(struct OutBuf *out, FILE *fp) {
+    out->fp = fp;
+    out->data = malloc(OUTPUT_BUFFER_SIZE);
+    out->length = 0;
+    out->failed = 0;
+}
+
+static void outFlush(struct OutBuf *out) {
+    if (out->length > 0 && fwrite(out->data, 1, out->length, out->fp) != out->length) out->failed = 1;
+    out->length = 0;
+}
+
+// Write out what's buffered and release the block; 0 if every write succeeded
+static int outClose(struct OutBuf *out) {
+    outFlush(out);
+    free(out->data);
+    out->data = NULL;
+    if (fflush(out->fp) != 0) out->failed = 1;
+    return out->failed ? -1 : 0;
+}
+
+static void outWrite(struct OutBuf *out, const char *s, size_t size) {
+    if (!out->data || out->length + size > OUTPUT_BUFFER_SIZE) {
+        outFlush(out);
+        if (!out->data || size >= OUTPUT_BUFFER_SIZE) { // Too big to be worth copying
+            if (size > 0 && fwrite(s, 1, size, out->fp) != size) out->failed = 1;
+            return;
+        }
+    }
+    memcpy(out->data + out->length, s, size);
+    out->length += size;
+}
+
+static inline void outChar(struct OutBuf *out, char c) {
+    if (out->data && out->length < OUTPUT_BUFFER_SIZE) out->data[out->length++] = c;
+    else outWrite(out, &c, 1);
+}
+
+static void outString(struct OutBuf *out, const char *s) {
+    outWrite(out, s, strlen(s));
+}
+
+// A string padded with spaces to at least `width` bytes, like printf's %-30s
+static void outPadded(struct OutBuf *out, const char *s, size_t width) {
+    size_t length = strlen(s);
+    outWrite(out, s, length);
+    for (; length < width; length++) outChar(out, ' ');
+}
+
+// Bytes a field can't simply be copied past: OUT_QUOTE for the ones that make a CSV/TSV field need quoting (besides
+// the delimiter), OUT_ESCAPE for the ones a JSON string must escape. The terminating NUL stops both. A table is
+// much quicker than strcspn here, which sets up a table of its own on every call
+enum {
+    OUT_QUOTE = 1,
+    OUT_ESCAPE = 2
+};
+#define E OUT_ESCAPE
+#define QE (OUT_QUOTE | OUT_ESCAPE)
+static const unsigned char outSpecial[256] = {
+    QE, E, E, E, E, E, E, E, E, E, QE, E, E, QE, E, E, // Control characters 0 to 15; NUL, '\n' and '\r' need quoting too
+    E, E, E, E, E, E, E, E, E, E, E, E, E, E, E, E,     // 16 to 31
+    ['"'] = QE, ['\\'] = E,
+};
+#undef E
+#undef QE
+
+// One CSV/TSV field, quoted if it holds the delimiter, a quote or a line break
+static void outDelimitedField(struct OutBuf *out, const char *field, char delimiter) {
+    const char *end = field;
+    while (!(outSpecial[(unsigned char)*end] & OUT_QUOTE) && *end != delimiter) end++;
+    if (*end == '\0') {
+        outWrite(out, field, (size_t)(end - field));
+        return;
+    }
+    outChar(out, '"');
+    for (const char *quote; (quote = strchr(field, '"')); field = quote + 1) {
+        outWrite(out, field, (size_t)(quote - field) + 1);
+        outChar(out, '"'); // Quotes inside a quoted field are doubled
+    }
+    outString(out, field);
+    outChar(out, '"');
+}
+
+// A contact as one CSV/TSV record: name, phone, address, email
+static void outDelimitedRecord(struct OutBuf *out, const struct Contact *contact, char delimiter) {
+    outDelimitedField(out, contact->name, delimiter);
+    outChar(out, delimiter);
+    outDelimitedField(out, contact->phone, delimiter);
+    outChar(out, delimiter);
+    outDelimitedField(out, contact->address, delimiter);
+    outChar(out, delimiter);
+    outDelimitedField(out, contact->email, delimiter);
+    outChar(out, '\n');
+}
+
+// A JSON string. Quotes, backslashes and control characters are escaped; every other byte is copied as it is,
+// so names that are valid UTF-8 come out as valid JSON
+static void outJsonString(struct OutBuf *out, const char *s) {
+    outChar(out, '"');
+    for (;;) {
+        const char *run = s;
+        while (!(outSpecial[(unsigned char)*s] & OUT_ESCAPE)) s++;
+        outWrite(out, run, (size_t)(s - run));
+        if (*s == '\0') break;
+        char escape[8];
+        switch (*s) {
+            case '"': outWrite(out, "\\\"", 2); break;
+            case '\\': outWrite(out, "\\\\", 2); break;
+            case '\n': outWrite(out, "\\n", 2); break;
+            case '\r': outWrite(out, "\\r", 2); break;
+            case '\t': outWrite(out, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*s);
+                outString(out, escape);
+        }
+        s++;
+    }
+    outChar(out, '"');
+}
+
+// One contact in the given format, ending with a newline
+static void outContact(struct OutBuf *out, const struct Contact *contact, enum OutputFormat format) {
+    switch (format) {
+        case OUTPUT_TABLE:
+            outPadded(out, contact->name, 30);
+            outChar(out, ' ');
+            outPadded(out, contact->phone, 20);
+            outChar(out, ' ');
+            outPadded(out, contact->address, 30);
+            outChar(out, ' ');
+            outString(out, contact->email);
+            outChar(out, '\n');
+            break;
+        case OUTPUT_JSONL:
+            outWrite(out, "{\"name\":", 8);
+            outJsonString(out, contact->name);
+            outWrite(out, ",\"phone\":", 9);
+            outJsonString(out, contact->phone);
+            outWrite(out, ",\"address\":", 11);
+            outJsonString(out, contact->address);
+            outWrite(out, ",\"email\":", 9);
+            outJsonString(out, contact->email);
+            outWrite(out, "}\n", 2);
+            break;
+        default:
+            outDelimitedRecord(out, contact, '\t');
+    }
+}
+
+#define LIST_PREFETCH 16 // How many contacts ahead a listing starts loading fields
+
+// One contact the way the menu shows it, a field per line and a blank line after
+static void outContactCard(struct OutBuf *out, const struct Contact *contact) {
+    outString(out, "Name: ");
+    outString(out, contact->name);
+    outString(out, "\nPhone: ");
+    outString(out, contact->phone);
+    outString(out, "\nAddress: ");
+    outString(out, contact->address);
+    outString(out, "\nEmail: ");
+    outString(out, contact->email);
+    outString(out, "\n\n");
+}
+
+// Write the contacts from `from` up to, but not including, `to` in name order (empty bounds mean the start and end of
+// the book), paged as `page` says. Contacts are formatted straight from the ordered index without collecting them
+// first. Returns how many were written; *last is the last one's position if the limit cut the listing short, so
+// the caller can say where the next page starts, and CONTACT_NOT_FOUND otherwise
+static size_t writeContactList(const struct ContactStore *store, const char *from, const char *to, const struct OutputPage *page,
+                               enum OutputFormat format, struct OutBuf *out, size_t *last) {
+    STATS_TIMER(started);
+    const char *after = page->after ? page->after : "";
+    struct OrderCursor cursor;
+    storeOrderSeek(store, strcasecmp(after, from) > 0 ? after : from, &cursor);
+    if (after[0]) { // Names are unique ignoring case, so at most one contact sits on the boundary
+        struct OrderCursor peek = cursor;
+        size_t pos = storeOrderNext(store, &peek);
+        if (pos != CONTACT_NOT_FOUND && strcasecmp(storeField(store, pos, FIELD_NAME), after) == 0) cursor = peek;
+    }
+    storeOrderSkip(store, &cursor, page->offset);
+
+    size_t written = 0, previous = CONTACT_NOT_FOUND;
+    *last = CONTACT_NOT_FOUND;
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND;) {
+        // Name order jumps around the columns, so start fetching the fields of contacts a little way ahead: the
+        // offsets of the one LIST_PREFETCH on, and the strings of the one half that far on, whose offsets are in
+        const struct OrderBlock *block = cursor.block < store->order.blockCount ? store->order.blocks[cursor.block] : NULL;
+        if (block && cursor.offset + LIST_PREFETCH < block->count) {
+            for (int field = 0; field < FIELD_FOLDED_NAME; field++)
+                __builtin_prefetch(&store->columns[field].offsets[block->positions[cursor.offset + LIST_PREFETCH]]);
+        }
+        if (block && cursor.offset + LIST_PREFETCH / 2 < block->count) {
+            for (int field = 0; field < FIELD_FOLDED_NAME; field++)
+                __builtin_prefetch(storeField(store, block->positions[cursor.offset + LIST_PREFETCH / 2], field));
+        }
+        struct Contact contact = storeGet(store, pos);
+        if (to[0] && strcasecmp(contact.name, to) >= 0) break;
+        if (page->limit && written == page->limit) { // There's more, so say where this page ended
+            *last = previous;
+            break;
+        }
+        outContact(out, &contact, format);
+        written++;
+        previous = pos;
+    }
+    STATS_RECORD(STAT_OP_LIST, started);
+    return written;
+}
+
+// A search result and what it's ranked by: fuzzy results by distance first, then everything by case-folded name
+struct SearchHit {
+    unsigned distance; // 0 for substring searches
+    const char *key;   // Case-folded name
+    size_t pos;
+};
+
+static int compareSearchHits(const void *a, const void *b) {
+    const struct SearchHit *hitA = a, *hitB = b;
+    if (hitA->distance != hitB->distance) return hitA->distance < hitB->distance ? -1 : 1;
+    int cmp = strcmp(hitA->key, hitB->key);
+    return cmp != 0 ? cmp : (hitA->pos > hitB->pos) - (hitA->pos < hitB->pos);
+}
+
+// Move a hit up a max-heap until its parent is larger
+static void searchHeapUp(struct SearchHit *heap, size_t at) {
+    while (at > 0) {
+        size_t parent = (at - 1) / 2;
+        if (compareSearchHits(&heap[at], &heap[parent]) <= 0) return;
+        struct SearchHit swap = heap[at];
+        heap[at] = heap[parent];
+        heap[parent] = swap;
+        at = parent;
+    }
+}
+
+// Move a hit down a max-heap of `count` hits until both its children are smaller
+static void searchHeapDown(struct SearchHit *heap, size_t count, size_t at) {
+    for (;;) {
+        size_t largest = at, left = 2 * at + 1, right = left + 1;
+        if (left < count && compareSearchHits(&heap[left], &heap[largest]) > 0) largest = left;
+        if (right < count && compareSearchHits(&heap[right], &heap[largest]) > 0) largest = right;
+        if (largest == at) return;
+        struct SearchHit swap = heap[at];
+        heap[at] = heap[largest];
+        heap[largest] = swap;
+        at = largest;
+    }
+}
+
+// Picks the hits up to the end of an OutputPage out of a search's results as they're offered, in rank order.
+// Without a limit every hit is kept and sorted. With one only the best offset + limit are kept, in a bounded
+// max-heap, so the top few results of a search that matches most of the book cost O(n log k) rather than a full sort
+struct HitPage {
+    struct SearchHit *hits; // Hits kept; a max-heap until hitPageSort while fewer are kept than offered
+    size_t count;           // Hits kept
+    size_t keep;            // Most hits kept
+    int bounded;            // Set when more hits may be offered than kept
+    int more;               // Set once a hit was dropped for being past the page
+    const char *after;      // Hits whose name isn't past this one are skipped, "" to keep them all
+};
+
+// Get ready for up to `candidates` hits; 0 on success, -1 if out of memory
+static int hitPageInit(struct HitPage *hitPage, const struct OutputPage *page, size_t candidates) {
+    size_t keep = candidates;
+    if (page->limit && page->limit < keep && page->offset < keep - page->limit) keep = page->offset + page->limit;
+    hitPage->hits = keep > 0 ? malloc(keep * sizeof(*hitPage->hits)) : NULL;
+    hitPage->count = 0;
+    hitPage->keep = keep;
+    hitPage->bounded = keep < candidates;
+    hitPage->more = 0;
+    hitPage->after = page->after ? page->after : "";
+    return keep > 0 && !hitPage->hits ? -1 : 0;
+}
+
+static void hitPageOffer(struct HitPage *hitPage, struct SearchHit hit) {
+    if (hitPage->after[0] && strcasecmp(hit.key, hitPage->after) <= 0) return;
+    if (hitPage->count < hitPage->keep) {
+        hitPage->hits[hitPage->count] = hit;
+        if (hitPage->bounded) searchHeapUp(hitPage->hits, hitPage->count);
+        hitPage->count++;
+        return;
+    }
+    hitPage->more = 1;
+    if (hitPage->count > 0 && compareSearchHits(&hit, &hitPage->hits[0]) < 0) { // Beats the worst hit kept so far
+        hitPage->hits[0] = hit;
+        searchHeapDown(hitPage->hits, hitPage->count, 0);
+    }
+}
+
+// Put the hits kept in rank order
+static void hitPageSort(struct HitPage *hitPage) {
+    STATS_TIMER(sortStarted);
+    if (hitPage->count > 1) qsort(hitPage->hits, hitPage->count, sizeof(*hitPage->hits), compareSearchHits);
+    STATS_RECORD(STAT_OP_SORT, sortStarted);
+}
+
+// Substring search on one field, keeping the results up to the end of `page` in name order; the caller skips
+// page->offset of them. Fills in hitPage (free its hits), 0 on success or -1 if out of memory
+static int searchPage(const struct ContactStore *store, const char *needle, enum ContactField field,
+                      const struct OutputPage *page, struct HitPage *hitPage) {
+    struct ContactMatches matches;
+    matchesInit(&matches);
+    int status = field == FIELD_NAME ? storeSearchName(store, needle, &matches) : storeScanField(store, field, needle, &matches);
+    if (status != 0 || hitPageInit(hitPage, page, matches.count) != 0) {
+        matchesFree(&matches);
+        return -1;
+    }
+    for (size_t i = 0; i < matches.count; i++) {
+        struct SearchHit hit = {0, storeField(store, matches.positions[i], FIELD_FOLDED_NAME), matches.positions[i]};
+        hitPageOffer(hitPage, hit);
+    }
+    hitPageSort(hitPage);
+    matchesFree(&matches);
+    return 0;
+}
+
+// Typo-tolerant name search, keeping the results up to the end of `page` ranked closest first and then by name.
+// Works like searchPage; a page can't start after a name here, as the results aren't in name order
+static int fuzzyPage(struct ContactStore *store, const char *query, int maxDistance, const struct OutputPage *page,
+                     struct HitPage *hitPage) {
+    struct FuzzyMatch *matches;
+    size_t count;
+    struct OutputPage ranked = *page;
+    ranked.after = NULL;
+    if (storeFuzzySearch(store, query, maxDistance, &matches, &count) != 0) return -1;
+    if (hitPageInit(hitPage, &ranked, count) != 0) {
+        free(matches);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct SearchHit hit = {matches[i].distance, storeField(store, matches[i].pos, FIELD_FOLDED_NAME), matches[i].pos};
+        hitPageOffer(hitPage, hit);
+    }
+    hitPageSort(hitPage);
+    free(matches);
+    return 0;
+}
+
+// Write the hits of a page past page->offset; *last is set as writeContactList sets it. Frees the hits
+static long writeHitPage(const struct ContactStore *store, struct HitPage *hitPage, const struct OutputPage *page,
+                         enum OutputFormat format, struct OutBuf *out, size_t *last) {
+    long written = 0;
+    for (size_t i = page->offset; i < hitPage->count; i++, written++) {
+        struct Contact contact = storeGet(store, hitPage->hits[i].pos);
+        outContact(out, &contact, format);
+    }
+    *last = hitPage->more && written > 0 ? hitPage->hits[hitPage->count - 1].pos : CONTACT_NOT_FOUND;
+    free(hitPage->hits);
+    hitPage->hits = NULL;
+    return written;
+}
+
+// Write the page of contacts whose field contains `needle`, in name order. Names go through the trigram index, the
+// other fields are scanned. Returns the number written or -1 if out of memory; *last is set as writeContactList sets it
+static long writeSearchResults(const struct ContactStore *store, const char *needle, enum ContactField field,
+                               const struct OutputPage *page, enum OutputFormat format, struct OutBuf *out, size_t *last) {
+    struct HitPage hitPage;
+    if (searchPage(store, needle, field, page, &hitPage) != 0) return -1;
+    return writeHitPage(store, &hitPage, page, format, out, last);
+}
+
+// Read a whole line of any length from the user into a getline buffer, without its newline.
+// Returns NULL at the end of input, so prompts that repeat until they get a valid answer can give up
+static const char *readLine(char **line, size_t *cap) {
+    if (getline(line, cap, stdin) == -1) return NULL;
+    (*line)[strcspn(*line, "\n")] = 0; // Remove the newline
+    return *line;
+}
+
+// Skip the rest of the current input line, stopping at the end of input
+void clearLine(void) {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
+
+// Add a new contact to the contact list
+void addContact(struct ContactStore *store) {
+    clearLine(); // Clear any leftover characters in the input buffer
+
+    // Get contact details from the user; they are only copied into the store once everything is valid
+    struct Contact newContact;
+    struct Contact *contact = &newContact;
+    char *lines[4] = { NULL, NULL, NULL, NULL }; // Line buffers for the name, phone, address and email
+    size_t caps[4] = { 0, 0, 0, 0 };
+    int checkDuplicate = 0; // initialize variable to check if a duplicate name was added as we don't want duplicate names
+
+    // Loop until we get a valid name
+    do {
+        printf("Enter contact name: ");
+        contact->name = readLine(&lines[0], &caps[0]); // Read the name from input
+        if (!contact->name) goto endOfInput;
+
+        enum ContactError error = validateName(store, contact->name, CONTACT_NOT_FOUND);
+        // Check if the entered name is empty
+        if (error == CONTACT_EMPTY_NAME) {
+            printf("Name cannot be empty. Please enter a valid name.\n");
+            continue; // Go back to the beginning of the loop and try again
+        }
+
+        checkDuplicate = 0; // Reset the duplicate flag
+        // Check if the entered name already exists
+        if (error == CONTACT_DUPLICATE_NAME) {
+            printf("A contact with this name already exists. Please Enter a New Name:\n");
+            checkDuplicate = 1; // Set the duplicate flag
+        }
+    } while (strlen(contact->name) == 0 || checkDuplicate == 1); // Keep looping if the name is empty or a duplicate
+
+    int validNumber = 0; // Set up a validity checker; we want a valid phone number
+
+    while (!validNumber) {
+        printf("Enter phone number: ");
+        validNumber = 1; // Assume the number is valid until proven otherwise
+
+        contact->phone = readLine(&lines[1], &caps[1]);  // Read phone number as string
+        if (!contact->phone) goto endOfInput;
+
+        switch (validatePhone(store, contact->phone, CONTACT_NOT_FOUND)) {
+            case CONTACT_EMPTY_PHONE: // Check if the phone number is empty
+                printf("Phone number cannot be empty.\n");
+                validNumber = 0;
+                break;
+            case CONTACT_INVALID_PHONE: // Only digits, '+', and leading '00' are allowed
+                printf("Invalid characters in phone number. Please enter number in the format +XXXXXXXXXXXX or 00XXXXXXXXXXXX or XXXXXXXXXXXX\n");
+                validNumber = 0;
+                break;
+            case CONTACT_DUPLICATE_PHONE: // Duplicate phone number
+                printf("This phone number already exists please try again:\n");
+                validNumber = 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    printf("Enter address: ");
+    contact->address = readLine(&lines[2], &caps[2]); // Read the address from input
+    if (!contact->address) goto endOfInput;
+
+    int validEmail = 0; // Check validity of email
+    // Loop until we get a valid email
+    while (!validEmail) {
+        printf("Enter email: ");
+        contact->email = readLine(&lines[3], &caps[3]); // Takes input 
+        if (!contact->email) goto endOfInput;
+
+        enum ContactError error = validateEmail(contact->email);
+        // Check if the entered email is empty
+        if (error == CONTACT_EMPTY_EMAIL) {
+            printf("Email cannot be empty!\n");
+            continue; // Go back to the beginning of the loop and try again
+        }
+
+        // Simple check to ensure both '@' and '.' are present in the email
+        if (error == CONTACT_OK) {
+            validEmail = 1; // Email is valid 
+        } else {
+            printf("Invalid email! Email must contain both '@' and '.'.\n");
+        }
+    }
+
+    // Copy the new contact into the store and its indexes
+    if (validateContact(store, contact, CONTACT_NOT_FOUND) == CONTACT_TOO_LONG) {
+        printf("This contact is too long to be saved.\n");
+    } else if (storeInsert(store, &newContact) == CONTACT_NOT_FOUND) {
+        printf("Out of memory. Cannot add more contacts.\n");
+    } else {
+        printf("Contact added successfully!\n");
+    }
+    for (int i = 0; i < 4; i++) free(lines[i]);
+    return;
+
+endOfInput: // Input closed part-way through; there's nobody left to ask, so the contact is dropped
+    printf("\nNo more input. Contact not added.\n");
+    for (int i = 0; i < 4; i++) free(lines[i]);
+}
+
+// List all contacts in the address book 
+void listContacts(struct ContactStore *store) {
+    // Check if there are any contacts to display
+    if (store->count == 0) {
+        printf("No contacts to display.\n");
+        return; // Exits the function
+    }
+
+    // Display the contact details in a formatted manner
+    printf("\n\t\t*** List of Contacts ***\n");
+    printf("=====================================================================\n");
+    printf("Name\t\t\tPhone\t\t\tAddress\t\t\tEmail\n"); // This is the header row
+    printf("=====================================================================\n");
+
+    // The ordered index already keeps the contacts alphabetical, so this is a plain in-order walk
+    struct OutBuf out;
+    struct OutputPage page = {0, 0, NULL};
+    size_t last;
+    outInit(&out, stdout);
+    writeContactList(store, "", "", &page, OUTPUT_TABLE, &out, &last);
+    outClose(&out);
+}
+
+// List the contacts whose names fall in a range, e.g. from "M" to "N" lists every name starting with M
+void listContactRange(struct ContactStore *store) {
+    char *lines[2] = { NULL, NULL };
+    size_t caps[2] = { 0, 0 };
+    getchar(); // Clear any leftover characters in the input buffer
+    printf("List names from: ");
+    const char *from = readLine(&lines[0], &caps[0]); // Start of the range (inclusive)
+    printf("Up to (not including, leave empty for no limit): ");
+    const char *to = readLine(&lines[1], &caps[1]);   // End of the range (exclusive), empty for no end
+    if (!from) from = ""; // The end of input counts as an empty answer
+    if (!to) to = "";
+
+    // Seek straight to the first name in range and stop at the first one past it
+    struct OrderCursor cursor;
+    storeOrderSeek(store, from, &cursor);
+    size_t first = storeOrderNext(store, &cursor);
+    if (first == CONTACT_NOT_FOUND || (to[0] && strcasecmp(storeField(store, first, FIELD_NAME), to) >= 0)) {
+        printf("No contacts in that range.\n");
+    } else {
+        struct OutBuf out;
+        struct OutputPage page = {0, 0, NULL};
+        size_t last;
+        printf("\n%-30s %-20s %-30s %s\n", "Name", "Phone", "Address", "Email"); // Header row before the matches
+        outInit(&out, stdout);
+        writeContactList(store, from, to, &page, OUTPUT_TABLE, &out, &last);
+        outClose(&out);
+    }
+    free(lines[0]);
+    free(lines[1]);
+}
+
+// Search for a contact by name, or partial substring search
+void searchContact(struct ContactStore *store) {
+    // Check if there are any contacts to search
+    if (store->count == 0) {
+        printf("No contacts to search.\n");
+        return; // Nothing to search so it exits the function
+    }
+
+    // reads the name and does a substring search; prompt the user to enter the name (or part of the name) to search for
+    getchar(); // Clear any leftover characters in the input buffer
+    char *line = NULL; // Buffer for the user's input
+    size_t lineCap = 0;
+    printf("Please enter the contact's name: ");
+    const char *input = readLine(&line, &lineCap); // Read the input from the user
+
+    // Check if the user entered anything
+    if (!input || strlen(input) == 0) {
+        printf("No input provided. Returning.\n");
+        free(line);
+        return; // Nothing to search so it exits the function
+    }
+
+    // partial substring search to find every contact whose name contains the input (case-insensitive),
+    // sorted alphabetically; only the matches are sorted
+    struct HitPage hitPage;
+    struct OutputPage page = {0, 0, NULL};
+    if (searchPage(store, input, FIELD_NAME, &page, &hitPage) != 0) {
+        printf("Out of memory. Cannot search contacts.\n");
+        free(line);
+        return;
+    }
+
+    int found = hitPage.count > 0; // Flag to indicate if any matching contacts were found
+    if (found) {
+        printf("\nContacts matching '%s':\n", input); // Header before the matches
+    }
+    struct OutBuf out;
+    outInit(&out, stdout);
+    for (size_t i = 0; i < hitPage.count; i++) {
+        struct Contact contact = storeGet(store, hitPage.hits[i].pos);
+        outContactCard(&out, &contact); // Print the contact's details
+    }
+    outClose(&out);
+    free(hitPage.hits);
+
+    // If no matching contacts were found
+    if (!found) {
+        printf("No contact found containing '%s'.\n", input);
+    }
+    free(line);
+}
+
+// Typo-tolerant search: names with a word close to each word typed, closest first, so "Jonh Smtih" still finds John Smith
+void fuzzySearchContact(struct ContactStore *store) {
+    if (store->count == 0) {
+        printf("No contacts to search.\n");
+        return;
+    }
+    getchar(); // Clear any leftover characters in the input buffer
+    char *line = NULL;
+    size_t lineCap = 0;
+    printf("Please enter the name, typos and all: ");
+    const char *input = readLine(&line, &lineCap);
+    if (!input || strlen(input) == 0) {
+        printf("No input provided. Returning.\n");
+        free(line);
+        return;
+    }
+
+    // Only the closest few are worth showing; the rest are still counted as more
+    struct HitPage hitPage;
+    struct OutputPage page = {0, FUZZY_MENU_RESULTS, NULL};
+    if (fuzzyPage(store, input, -1, &page, &hitPage) != 0) {
+        printf("Out of memory. Cannot search contacts.\n");
+        free(line);
+        return;
+    }
+    if (hitPage.count == 0) {
+        printf("No contact found close to '%s'.\n", input);
+    } else {
+        printf("\nContacts close to '%s', closest first:\n", input);
+        struct OutBuf out;
+        outInit(&out, stdout);
+        for (size_t i = 0; i < hitPage.count; i++) {
+            struct Contact contact = storeGet(store, hitPage.hits[i].pos);
+            char distance[48];
+            snprintf(distance, sizeof(distance), "Differences: %u\n", hitPage.hits[i].distance);
+            outString(&out, distance);
+            outContactCard(&out, &contact);
+        }
+        outClose(&out);
+        if (hitPage.more) printf("Only the %d closest are shown.\n", FUZZY_MENU_RESULTS);
+    }
+    free(hitPage.hits);
+    free(line);
+}
+
+// Edit an existing contact
+void editContact(struct ContactStore *store) {
+    char *lines[5] = { NULL, NULL, NULL, NULL, NULL }; // Line buffers for the name to edit and the four new fields
+    size_t caps[5] = { 0, 0, 0, 0, 0 };
+    printf("Enter the name of the contact to edit: ");
+    getchar(); // Clear any leftover characters in the input buffer
+    const char *name = readLine(&lines[0], &caps[0]); // Read the name from the user
+    if (!name) {
+        free(lines[0]);
+        return;
+    }
+
+    // Look the contact up in the name index (case-insensitive comparison)
+    size_t i = storeFindByName(store, name);
+    if (i == CONTACT_NOT_FOUND) {
+        printf("No contact found with the name '%s'.\n", name); // Contact not found message
+        free(lines[0]);
+        return;
+    }
+
+    // Read the new details first so the indexes can be updated in one go
+    struct Contact edited;
+    struct Contact *contact = &edited;
+    printf("Editing contact '%s'\n", storeGet(store, i).name);
+    // Get new contact details from the user
+    printf("New Name: ");
+    contact->name = readLine(&lines[1], &caps[1]); // Read the new name
+
+    printf("New Phone: ");
+    contact->phone = readLine(&lines[2], &caps[2]); // Read new phone as string 
+
+    printf("New Address: ");
+    contact->address = readLine(&lines[3], &caps[3]); // Read the new address
+
+    printf("New Email: ");
+    contact->email = readLine(&lines[4], &caps[4]); // Read the new email
+
+    if (!contact->name || !contact->phone || !contact->address || !contact->email) {
+        printf("\nNo more input. Contact not updated.\n");
+        for (int line = 0; line < 5; line++) free(lines[line]);
+        return;
+    }
+
+    // The same checks as the edit command, but every problem is reported so they can all be fixed in one go.
+    // validateContact stops at the first one, so the fields are checked one by one instead, each lookup once so
+    // the stats count it once; without a store, validateContact only does the length check and the lookup-free ones
+    enum ContactError errors[4] = {
+        validateContact(NULL, contact, i) == CONTACT_TOO_LONG ? CONTACT_TOO_LONG : CONTACT_OK,
+        validateName(store, contact->name, i),
+        validatePhone(store, contact->phone, i),
+        validateEmail(contact->email),
+    };
+    int invalid = 0;
+    for (int e = 0; e < 4; e++) {
+        if (errors[e] == CONTACT_OK) continue;
+        printf("Invalid contact: %s.\n", contactErrorMessage(errors[e]));
+        invalid = 1;
+    }
+    if (invalid) {
+        printf("Contact not updated.\n");
+    } else if (storeUpdate(store, i, contact) != 0) {
+        printf("Out of memory. Contact not updated.\n");
+    } else {
+        printf("Contact updated successfully!\n");
+    }
+    for (int line = 0; line < 5; line++) free(lines[line]);
+}
+
+// Delete a contact from the list
+void deleteContact(struct ContactStore *store) {
+    char *line = NULL; // Buffer for the name of the contact to delete
+    size_t lineCap = 0;
+    printf("Enter the name of the contact to delete: ");
+    getchar(); // Clear any leftover characters in the input buffer
+    const char *name = readLine(&line, &lineCap); // Read the name from the user
+    if (!name) {
+        free(line);
+        return;
+    }
+
+    // Find the contact through the name index (case-insensitive comparision) and delete it
+    size_t i = storeFindByName(store, name);
+    if (i != CONTACT_NOT_FOUND) {
+        // Only flags the record as deleted, nothing else has to move
+        if (storeRemove(store, i) == 0) printf("Contact deleted successfully.\n");
+        else printf("Out of memory. Contact not deleted.\n");
+        if (storeCompactDue(store)) storeCompact(store); // The menu holds no positions between choices
+    } else {
+        printf("No contact found with the name '%s'.\n", name); // Contact not found message
+    }
+    free(line);
+}
+
+// Running checksum of a snapshot section: four FNV-style lanes over its 8-byte words in native byte order,
+// taken a 32-byte block at a time
+struct SectionChecksum {
+    uint64_t lanes[4];
+    unsigned char block[32]; // Bytes of a block that's not complete yet
+    size_t blockBytes;
+};
+
+// Keeps track of how many bytes of a snapshot have been written so section offsets can be recorded, and the
+// checksum of the section being written
+struct SnapshotWriter {
+    FILE *fp;               // Temporary snapshot file
+    uint64_t offset;        // Bytes written so far
+    int failed;             // Set once any write fails
+    int section;            // Section being written, -1 between sections
+    struct SectionChecksum checksum; // Its checksum so far
+};
+
+// One step of the section checksum. Each step is a bijection of hash ^ word, so changing any one word of a
+// section always changes its checksum
+static uint64_t checksumMix(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    return hash ^ (hash >> 29);
+}
+
+static void checksumStart(struct SectionChecksum *sum) {
+    for (int lane = 0; lane < 4; lane++) sum->lanes[lane] = 0xcbf29ce484222325ULL + (uint64_t)lane;
+    sum->blockBytes = 0;
+}
+
+// Mix one 32-byte block in, a word per lane; the lanes don't wait on each other, so the multiplies overlap
+static void checksumBlock(struct SectionChecksum *sum, const unsigned char *block) {
+    for (int lane = 0; lane < 4; lane++) {
+        uint64_t word;
+        memcpy(&word, block + 8 * lane, 8);
+        sum->lanes[lane] = checksumMix(sum->lanes[lane], word);
+    }
+}
+
+// Add bytes to a checksum; they can come in pieces of any size and give the same result as all at once
+static void checksumAdd(struct SectionChecksum *sum, const unsigned char *data, size_t size) {
+    while (size > 0) {
+        if (sum->blockBytes == 0 && size >= sizeof(sum->block)) { // The usual case: whole blocks straight from the data
+            for (; size >= sizeof(sum->block); data += sizeof(sum->block), size -= sizeof(sum->block)) checksumBlock(sum, data);
+            continue;
+        }
+        size_t take = sizeof(sum->block) - sum->blockBytes < size ? sizeof(sum->block) - sum->blockBytes : size;
+        memcpy(sum->block + sum->blockBytes, data, take);
+        sum->blockBytes += take;
+        data += take;
+        size -= take;
+        if (sum->blockBytes == sizeof(sum->block)) {
+            checksumBlock(sum, sum->block);
+            sum->blockBytes = 0;
+        }
+    }
+}
+
+// Finish a checksum: the last part-block padded with zeros, its length and then the lanes folded into one
+static uint64_t checksumEnd(struct SectionChecksum *sum) {
+    uint64_t tail = sum->blockBytes;
+    if (tail > 0) {
+        memset(sum->block + tail, 0, sizeof(sum->block) - tail);
+        checksumBlock(sum, sum->block);
+    }
+    uint64_t hash = checksumMix(0xcbf29ce484222325ULL, tail);
+    for (int lane = 0; lane < 4; lane++) hash = checksumMix(hash, sum->lanes[lane]);
+    return hash;
+}
+
+// Checksum of a whole section as it lies in a mapped snapshot
+static uint64_t snapshotChecksum(const unsigned char *data, uint64_t size) {
+    struct SectionChecksum sum;
+    checksumStart(&sum);
+    checksumAdd(&sum, data, size);
+    return checksumEnd(&sum);
+}
+
+// Append bytes to the snapshot, remembering any failure until the end, and add them to the section's checksum
+static void snapshotWrite(struct SnapshotWriter *writer, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, writer->fp) != size) writer->failed = 1;
+    writer->offset += size;
+    if (writer->section >= 0) checksumAdd(&writer->checksum, data, size);
+}
+
+// Pad to the next 8-byte boundary so the arrays in every section can be read straight out of the mapping
+static void snapshotAlign(struct SnapshotWriter *writer) {
+    static const char zeros[8];
+    snapshotWrite(writer, zeros, (8 - writer->offset % 8) % 8);
+}
+
+// Start a section where the writer is, which is always on an 8-byte boundary
+static void snapshotBegin(struct SnapshotWriter *writer, struct SnapshotHeader *header, int section) {
+    header->sections[section].offset = writer->offset;
+    writer->section = section;
+    checksumStart(&writer->checksum);
+}
+
+// Record the size and checksum of the section just written, then pad to the next section
+static void snapshotEnd(struct SnapshotWriter *writer, struct SnapshotHeader *header) {
+    int section = writer->section;
+    header->sections[section].size = writer->offset - header->sections[section].offset;
+    header->checksums[section] = checksumEnd(&writer->checksum);
+    writer->section = -1;
+    snapshotAlign(writer);
+}
+
+// Write a hash index section: capacity, slots, cached hashes. With a remap the slots are renumbered on the way
+static void snapshotWriteHash(struct SnapshotWriter *writer, const struct HashIndex *index, const uint32_t *remap) {
+    uint64_t cap = index->cap;
+    snapshotWrite(writer, &cap, sizeof(cap));
+    if (!remap) {
+        snapshotWrite(writer, index->slots, index->cap * sizeof(uint32_t));
+    } else {
+        for (size_t i = 0; i < index->cap; i++) {
+            uint32_t slot = index->slots[i] ? remap[index->slots[i] - 1] + 1 : 0;
+            snapshotWrite(writer, &slot, sizeof(slot));
+        }
+    }
+    snapshotWrite(writer, index->hashes, index->cap * sizeof(uint32_t));
+}
+
+// Live entries of a trigram posting list, which may still list deleted records
+static uint32_t snapshotPostingCount(const struct TrigramPosting *posting, const uint32_t *remap) {
+    if (!remap) return posting->count;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < posting->count; i++) count += remap[posting->positions[i]] != UINT32_MAX;
+    return count;
+}
+
+// Write the contacts and their indexes to a temporary file, fsync it, then rename it over the old snapshot
+// so a crash part-way through never leaves a half-written book behind. Deleted records are left out and the
+// positions after them renumbered, so the snapshot is of the compacted store and a load starts without holes
+int saveSnapshot(const struct ContactStore *store, const char *path) {
+    STATS_TIMER(started);
+    uint32_t *remap = NULL; // Each record's position in the file, when deleted records move the others down
+    if (store->count < store->slots && !(remap = storeRemap(store))) return -1;
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        free(remap);
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20); // Large buffer; the file is written front to back
+
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.sectionCount = SNAP_SECTION_COUNT;
+    header.count = store->count;
+    header.lsn = store->lsn;
+
+    struct SnapshotWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.fp = fp;
+    writer.section = -1;
+    snapshotWrite(&writer, &header, sizeof(header)); // Placeholder, rewritten once the section table is known
+    snapshotAlign(&writer);
+
+    // Columns: each field's heap, then its offsets. A heap without garbage or deleted records is written as it
+    // is; otherwise the live strings are written in record order and the offsets worked out as they go
+    for (int field = 0; field < FIELD_COUNT; field++) {
+        const struct StringColumn *column = &store->columns[field];
+        int offsetsSection = SNAP_COLUMNS + 2 * field, heapSection = offsetsSection + 1;
+        uint32_t *offsets = column->offsets;
+        snapshotBegin(&writer, &header, heapSection);
+        if (column->garbage == 0 && !remap) {
+            snapshotWrite(&writer, column->heap, column->heapSize);
+        } else {
+            offsets = malloc((store->count ? store->count : 1) * sizeof(*offsets));
+            if (!offsets) {
+                writer.failed = 1;
+                break;
+            }
+            uint64_t heapSize = 0;
+            size_t written = 0;
+            for (size_t i = 0; i < store->slots; i++) {
+                if (storeIsDeleted(store, i)) continue;
+                const char *s = column->heap + column->offsets[i];
+                size_t size = strlen(s) + 1;
+                offsets[written++] = (uint32_t)heapSize;
+                snapshotWrite(&writer, s, size);
+                heapSize += size;
+            }
+        }
+        snapshotEnd(&writer, &header);
+        snapshotBegin(&writer, &header, offsetsSection);
+        snapshotWrite(&writer, offsets, store->count * sizeof(*offsets));
+        snapshotEnd(&writer, &header);
+        if (offsets != column->offsets) free(offsets);
+    }
+
+    // Name order, straight from the ordered index
+    snapshotBegin(&writer, &header, SNAP_ORDER);
+    struct OrderCursor cursor;
+    storeOrderSeek(store, "", &cursor);
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND;) {
+        uint32_t position = remap ? remap[pos] : (uint32_t)pos;
+        snapshotWrite(&writer, &position, sizeof(position));
+    }
+    snapshotEnd(&writer, &header);
+
+    // Name and phone hash tables, copied as they are
+    snapshotBegin(&writer, &header, SNAP_NAME_HASH);
+    snapshotWriteHash(&writer, &store->nameIndex, remap);
+    snapshotEnd(&writer, &header);
+    snapshotBegin(&writer, &header, SNAP_PHONE_HASH);
+    snapshotWriteHash(&writer, &store->phoneIndex, remap);
+    snapshotEnd(&writer, &header);
+
+    // Trigram posting lists: a directory of (key, count) pairs followed by all the positions
+    snapshotBegin(&writer, &header, SNAP_TRIGRAMS);
+    const struct TrigramIndex *trigrams = &store->nameTrigrams;
+    uint64_t lists = 0;
+    for (size_t i = 0; i < trigrams->cap; i++)
+        if (trigrams->table[i].key != 0 && snapshotPostingCount(&trigrams->table[i], remap) > 0) lists++;
+    snapshotWrite(&writer, &lists, sizeof(lists));
+    for (size_t i = 0; i < trigrams->cap; i++) {
+        const struct TrigramPosting *posting = &trigrams->table[i];
+        uint32_t entry[2] = { posting->key, posting->key ? snapshotPostingCount(posting, remap) : 0 };
+        if (entry[1] > 0) snapshotWrite(&writer, entry, sizeof(entry));
+    }
+    for (size_t i = 0; i < trigrams->cap; i++) {
+        const struct TrigramPosting *posting = &trigrams->table[i];
+        if (posting->key == 0 || posting->count == 0) continue;
+        if (!remap) {
+            snapshotWrite(&writer, posting->positions, posting->count * sizeof(uint32_t));
+            continue;
+        }
+        for (uint32_t j = 0; j < posting->count; j++) {
+            uint32_t position = remap[posting->positions[j]];
+            if (position != UINT32_MAX) snapshotWrite(&writer, &position, sizeof(position));
+        }
+    }
+    snapshotEnd(&writer, &header);
+
+    // Now that every section is placed, fill in the real header
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1) writer.failed = 1;
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) writer.failed = 1;
+    if (fclose(fp) != 0) writer.failed = 1;
+    free(remap);
+    if (writer.failed || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return -1;
+    }
+    STATS_RECORD(STAT_OP_SAVE, started);
+    return 0;
+}
+
+// Load a hash index section in place of rebuilding the table; returns -1 if the section doesn't fit this book
+static int snapshotLoadHash(struct HashIndex *index, const unsigned char *data, uint64_t size, size_t count) {
+    uint64_t cap;
+    if (size < sizeof(cap)) return -1;
+    memcpy(&cap, data, sizeof(cap));
+    if (cap == 0 || (cap & (cap - 1)) != 0 || size != sizeof(cap) + cap * 2 * sizeof(uint32_t)) return -1;
+
+    const uint32_t *slots = (const uint32_t *)(data + sizeof(cap));
+    size_t used = 0;
+    for (uint64_t i = 0; i < cap; i++) {
+        if (slots[i] > count) return -1; // Points past the last contact
+        if (slots[i] != 0) used++;
+    }
+    if (used != count) return -1;
+
+    uint32_t *newSlots = malloc(cap * sizeof(uint32_t));
+    uint32_t *newHashes = malloc(cap * sizeof(uint32_t));
+    if (!newSlots || !newHashes) {
+        free(newSlots);
+        free(newHashes);
+        return -1;
+    }
+    memcpy(newSlots, slots, cap * sizeof(uint32_t));
+    memcpy(newHashes, slots + cap, cap * sizeof(uint32_t));
+    hashIndexFree(index);
+    index->slots = newSlots;
+    index->hashes = newHashes;
+    index->cap = cap;
+    index->used = used;
+    return 0;
+}
+
+// Load the trigram posting lists; returns -1 if the section is malformed
+static int snapshotLoadTrigrams(struct TrigramIndex *index, const unsigned char *data, uint64_t size, size_t count) {
+    uint64_t lists;
+    if (size < sizeof(lists)) return -1;
+    memcpy(&lists, data, sizeof(lists));
+    if (lists > (size - sizeof(lists)) / (2 * sizeof(uint32_t))) return -1;
+    const uint32_t *directory = (const uint32_t *)(data + sizeof(lists));
+    const uint32_t *positions = directory + 2 * lists;
+    uint64_t available = (size - sizeof(lists) - lists * 2 * sizeof(uint32_t)) / sizeof(uint32_t);
+
+    size_t cap = HASH_INDEX_MIN_CAP;
+    while (lists * HASH_INDEX_LOAD_DEN > cap * HASH_INDEX_LOAD_NUM) cap *= 2;
+    index->table = calloc(cap, sizeof(*index->table));
+    if (!index->table) return -1;
+    index->cap = cap;
+
+    uint64_t next = 0; // Next unread position
+    for (uint64_t l = 0; l < lists; l++) {
+        uint32_t key = directory[2 * l], listCount = directory[2 * l + 1];
+        if (key == 0 || key > 0xFFFFFF || listCount > available - next || trigramFind(index, key)) goto fail;
+        struct TrigramPosting *posting = trigramGet(index, key); // Never grows, the table was sized up front
+        posting->positions = malloc(listCount * sizeof(uint32_t));
+        if (!posting->positions) goto fail;
+        for (uint32_t i = 0; i < listCount; i++) {
+            if (positions[next + i] >= count) goto fail;
+        }
+        memcpy(posting->positions, positions + next, listCount * sizeof(uint32_t));
+        posting->count = posting->cap = listCount;
+        next += listCount;
+    }
+    return 0;
+
+fail:
+    trigramIndexFree(index);
+    return -1;
+}
+
+// Build the ordered index straight from a sorted position list, filling blocks three-quarters full
+static int snapshotLoadOrder(struct OrderIndex *order, const unsigned char *data, uint64_t size, size_t count) {
+    if (size != count * sizeof(uint32_t)) return -1;
+    const uint32_t *positions = (const uint32_t *)data;
+    const size_t perBlock = ORDER_BLOCK_CAP * 3 / 4;
+    for (size_t i = 0; i < count; i += perBlock) {
+        struct OrderBlock *block = malloc(sizeof(*block));
+        if (!block) goto fail;
+        block->count = (uint32_t)(count - i < perBlock ? count - i : perBlock);
+        for (uint32_t j = 0; j < block->count; j++) {
+            if (positions[i + j] >= count) {
+                free(block);
+                goto fail;
+            }
+            block->positions[j] = positions[i + j];
+        }
+        if (orderInsertBlock(order, order->blockCount, block) != 0) {
+            free(block);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    orderIndexFree(order);
+    return -1;
+}
+
+// Map a snapshot and load it into an empty store. Columns and the pre-built indexes are copied in as they
+// are, so nothing is parsed. They're copied out of the mapping rather than used in place on purpose: every
+// section is read through for its checksum anyway, and the store reallocs and frees its columns and tables
+// as it grows, which memory it doesn't own can't take part in; the mapping is gone once this returns.
+// The bounds checks only keep a bad section from being read past its end, so an index is only taken if its
+// checksum matches, and is rebuilt from the records otherwise.
+// Returns 0 on success, 1 if it loaded but should be rewritten because an index had to be rebuilt,
+// -1 if there is no snapshot, -2 if it is unusable
+int loadSnapshot(struct ContactStore *store, const char *path) {
+    const size_t fixedSize = offsetof(struct SnapshotHeader, sections); // Header up to the section table
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < fixedSize || store->count != 0) {
+        close(fd);
+        return -2;
+    }
+    size_t fileSize = (size_t)st.st_size;
+    const unsigned char *base = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid after the descriptor is closed
+    if (base == MAP_FAILED) return -2;
+
+    // The fixed part is checked first so the section count is known to match before the rest is read
+    struct SnapshotHeader header;
+    memcpy(&header, base, fixedSize);
+    int ok = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 && header.count <= UINT32_MAX &&
+             header.version == SNAPSHOT_VERSION && header.sectionCount == SNAP_SECTION_COUNT && fileSize >= sizeof(header);
+    if (ok) memcpy(&header, base, sizeof(header));
+    for (int s = 0; ok && s < SNAP_SECTION_COUNT; s++) {
+        // Every section must lie inside the file and start on an 8-byte boundary
+        ok = header.sections[s].offset % 8 == 0 && header.sections[s].offset <= fileSize &&
+             header.sections[s].size <= fileSize - header.sections[s].offset;
+    }
+    // Which sections can be trusted past their bounds checks
+    int intact[SNAP_SECTION_COUNT], rebuilt = 0;
+    for (int s = 0; ok && s < SNAP_SECTION_COUNT; s++)
+        intact[s] = snapshotChecksum(base + header.sections[s].offset, header.sections[s].size) == header.checksums[s];
+    for (int s = SNAP_COLUMNS; ok && s < SNAP_SECTION_COUNT; s++)
+        ok = intact[s]; // A damaged column can't be rebuilt from anything
+    if (!ok) {
+        munmap((void *)base, fileSize);
+        return -2;
+    }
+
+    if (header.count > 0) {
+        // Columns are copied as they are, after checking every offset lands inside its heap
+        store->cap = header.count;
+        for (int field = 0; field < FIELD_COUNT && ok; field++) {
+            int offsetsSection = SNAP_COLUMNS + 2 * field, heapSection = offsetsSection + 1;
+            const uint32_t *offsets = (const uint32_t *)(base + header.sections[offsetsSection].offset);
+            const char *heap = (const char *)base + header.sections[heapSection].offset;
+            uint64_t heapSize = header.sections[heapSection].size;
+            ok = header.sections[offsetsSection].size == header.count * sizeof(uint32_t) &&
+                 heapSize > 0 && heapSize <= COLUMN_MAX_HEAP && heap[heapSize - 1] == '\0';
+            for (uint64_t i = 0; i < header.count && ok; i++) ok = offsets[i] < heapSize;
+
+            struct StringColumn *column = &store->columns[field];
+            column->offsets = ok ? malloc(header.count * sizeof(uint32_t)) : NULL;
+            column->heap = ok ? malloc(heapSize) : NULL;
+            ok = column->offsets && column->heap;
+            if (!ok) break;
+            memcpy(column->offsets, offsets, header.count * sizeof(uint32_t));
+            memcpy(column->heap, heap, heapSize);
+            column->heapSize = column->heapCap = heapSize;
+        }
+        if (ok) store->count = store->slots = header.count;
+    }
+
+    // Take the pre-built indexes, falling back to rebuilding any that can't be used
+    size_t count = store->count;
+    const unsigned char *section[SNAP_SECTION_COUNT]; // Start of each section inside the mapping
+    for (int s = 0; s < SNAP_SECTION_COUNT; s++)
+        section[s] = base + header.sections[s].offset;
+    for (int s = SNAP_ORDER; s <= SNAP_TRIGRAMS; s++)
+        if (!intact[s] && header.sections[s].size > 0) rebuilt = 1;
+    if (ok && (!intact[SNAP_NAME_HASH] ||
+               snapshotLoadHash(&store->nameIndex, section[SNAP_NAME_HASH], header.sections[SNAP_NAME_HASH].size, count) != 0)) {
+        for (size_t i = 0; i < count && ok; i++) ok = hashIndexInsert(&store->nameIndex, store, i) == 0;
+    }
+    if (ok && (!intact[SNAP_PHONE_HASH] ||
+               snapshotLoadHash(&store->phoneIndex, section[SNAP_PHONE_HASH], header.sections[SNAP_PHONE_HASH].size, count) != 0)) {
+        for (size_t i = 0; i < count && ok; i++) ok = hashIndexInsert(&store->phoneIndex, store, i) == 0;
+    }
+    if (ok && (!intact[SNAP_TRIGRAMS] ||
+               snapshotLoadTrigrams(&store->nameTrigrams, section[SNAP_TRIGRAMS], header.sections[SNAP_TRIGRAMS].size, count) != 0)) {
+        for (size_t i = 0; i < count && ok; i++) ok = trigramIndexInsert(&store->nameTrigrams, i, storeField(store, i, FIELD_FOLDED_NAME)) == 0;
+    }
+    if (ok && (!intact[SNAP_ORDER] ||
+               snapshotLoadOrder(&store->order, section[SNAP_ORDER], header.sections[SNAP_ORDER].size, count) != 0)) {
+        for (size_t i = 0; i < count && ok; i++) ok = orderIndexInsert(store, i) == 0;
+    }
+
+    munmap((void *)base, fileSize);
+    if (!ok) {
+        storeFree(store); // Don't leave a half-loaded book behind
+        return -2;
+    }
+    store->lsn = header.lsn;
+    return rebuilt;
+}
+
+// FNV-1a hash over a block of bytes, used as the journal record checksum
+static uint32_t hashBuffer(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Write a whole buffer, carrying on after partial writes
+static int writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) return -1;
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+// Write the buffered records with a single fsync. Returns 0, or -1 if they couldn't be written
+static int journalWrite(struct Journal *journal) {
+    int status = 0;
+    if (journal->length > 0) {
+        STATS_TIMER(started);
+        STATS_ADD(STAT_JOURNAL_BYTES, journal->length);
+        if (writeAll(journal->fd, journal->buffer, journal->length) != 0 || fdatasync(journal->fd) != 0) {
+            if (!journal->failed) printf("Warning: could not write to %s; recent changes may be lost.\n", JOURNAL_FILE);
+            journal->failed = 1;
+            status = -1;
+            if (ftruncate(journal->fd, (off_t)journal->fileSize) != 0) journal->failed = 1; // Drop any torn record so later ones stay readable
+        } else {
+            journal->fileSize += journal->length;
+        }
+        journal->length = 0;
+        STATS_RECORD(STAT_OP_COMMIT, started);
+    }
+    return status;
+}
+
+// Append a change to the journal buffer. Each record is a uint32 body size and a uint32 checksum of the
+// body, followed by the body itself; nothing reaches the disk until the next commit
+static void journalLog(struct ContactStore *store, enum JournalOp op, const char *key, const struct Contact *contact) {
+    struct Journal *journal = store->journal;
+    if (!journal) return; // Loading or replaying; nothing to record
+
+    const char *fields[5];
+    int fieldCount = 0;
+    if (key) fields[fieldCount++] = key;
+    if (contact) {
+        fields[fieldCount++] = contact->name;
+        fields[fieldCount++] = contact->phone;
+        fields[fieldCount++] = contact->address;
+        fields[fieldCount++] = contact->email;
+    }
+    size_t bodySize = sizeof(uint64_t) + 1;
+    for (int i = 0; i < fieldCount; i++)
+        bodySize += strlen(fields[i]) + 1;
+    if (bodySize > JOURNAL_MAX_RECORD) {
+        // Only contacts that skipped validation can get here; replay would stop at a record this big
+        fprintf(stderr, "A change is too large for %s and was not logged.\n", JOURNAL_FILE);
+        return;
+    }
+    // A full buffer is only written out here, never compacted: an add or edit is already in the store but has no
+    // LSN yet, so a snapshot taken now would hold it under the LSN before it and replay would apply it twice
+    if (journal->length + 2 * sizeof(uint32_t) + bodySize > JOURNAL_BUFFER_SIZE) journalWrite(journal);
+
+    char *record = journal->buffer + journal->length;
+    char *body = record + 2 * sizeof(uint32_t);
+    char *at = body;
+    uint64_t lsn = ++store->lsn;
+    memcpy(at, &lsn, sizeof(lsn));
+    at += sizeof(lsn);
+    *at++ = (char)op;
+    for (int i = 0; i < fieldCount; i++) {
+        size_t length = strlen(fields[i]) + 1;
+        memcpy(at, fields[i], length);
+        at += length;
+    }
+    uint32_t head[2] = { (uint32_t)bodySize, hashBuffer(body, bodySize) };
+    memcpy(record, head, sizeof(head));
+    journal->length += sizeof(head) + bodySize;
+}
+
+// Re-apply one journal record to the store. An add whose name is already there is skipped rather than stored twice
+static void journalApply(struct ContactStore *store, int op, const char *data, size_t size) {
+    const char *fields[5];
+    int fieldCount = 0;
+    for (size_t at = 0; at < size && fieldCount < 5; at += strlen(data + at) + 1)
+        fields[fieldCount++] = data + at;
+
+    struct Contact contact;
+    int hasKey = op != JOURNAL_ADD; // Edits and deletes name the contact they change first
+    if (op == JOURNAL_ADD || op == JOURNAL_EDIT) {
+        if (fieldCount != hasKey + 4) return;
+        contact.name = fields[hasKey];
+        contact.phone = fields[hasKey + 1];
+        contact.address = fields[hasKey + 2];
+        contact.email = fields[hasKey + 3];
+    }
+    size_t pos = hasKey && fieldCount > 0 ? storeFindByName(store, fields[0]) : CONTACT_NOT_FOUND;
+
+    switch (op) {
+        case JOURNAL_ADD: if (storeFindByName(store, contact.name) == CONTACT_NOT_FOUND) storeInsert(store, &contact); break;
+        case JOURNAL_EDIT: if (pos != CONTACT_NOT_FOUND) storeUpdate(store, pos, &contact); break;
+        case JOURNAL_DELETE: if (pos != CONTACT_NOT_FOUND) storeRemove(store, pos); break;
+    }
+}
+
+// Cut everything before `offset` off the front of the journal by copying the rest to a new file and renaming it over
+static int journalDropFront(struct Journal *journal, const char *path, uint64_t offset) {
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int readFd = open(path, O_RDONLY);
+    int ok = fd >= 0 && readFd >= 0;
+
+    char chunk[1 << 16];
+    for (uint64_t at = offset; ok && at < journal->fileSize;) {
+        ssize_t got = pread(readFd, chunk, sizeof(chunk), (off_t)at);
+        ok = got > 0 && writeAll(fd, chunk, (size_t)got) == 0;
+        at += got > 0 ? (uint64_t)got : 0;
+    }
+    ok = ok && fdatasync(fd) == 0;
+    if (readFd >= 0) close(readFd);
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return -1;
+    }
+
+    // Keep appending to the new file
+    close(journal->fd);
+    journal->fd = open(path, O_WRONLY | O_APPEND);
+    journal->fileSize -= offset;
+    return journal->fd >= 0 ? 0 : -1;
+}
+
+// Check on the compaction child; once its snapshot is in place the journal records it covers are dropped
+static void journalFinishCompaction(struct ContactStore *store, int wait) {
+    struct Journal *journal = store->journal;
+    if (journal->compactor == 0) return;
+    int status;
+    pid_t pid = waitpid(journal->compactor, &status, wait ? 0 : WNOHANG);
+    if (pid == 0) return; // Still writing
+    journal->compactor = 0;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return; // No new snapshot; keep the whole journal
+    journalDropFront(journal, JOURNAL_FILE, journal->compactOffset);
+}
+
+// Fork a child that writes a fresh snapshot from its copy-on-write view of the store while the parent carries on
+static void journalStartCompaction(struct ContactStore *store) {
+    struct Journal *journal = store->journal;
+    fflush(stdout); // Don't let the child inherit half-printed output
+    pid_t pid = fork();
+    if (pid < 0) return; // Try again after the next commit
+    if (pid == 0) _exit(saveSnapshot(store, SNAPSHOT_FILE) == 0 ? 0 : 1);
+    journal->compactor = pid;
+    journal->compactOffset = journal->fileSize; // Everything committed so far is in the child's snapshot
+}
+
+// Write a snapshot of the store and empty the journal it now covers. Returns 0, or -1 if the snapshot failed
+static int journalSnapshotNow(struct ContactStore *store) {
+    struct Journal *journal = store->journal;
+    if (saveSnapshot(store, SNAPSHOT_FILE) != 0) return -1;
+    if (journal && ftruncate(journal->fd, 0) == 0 && fsync(journal->fd) == 0) journal->fileSize = 0;
+    return 0;
+}
+
+// Write the buffered records with a single fsync, so a batch of changes costs one disk flush, then start a
+// compaction if the journal has grown enough. Callers commit between changes, when every change in the store
+// has its LSN, so a snapshot is always stamped with the last change it holds
+int journalCommit(struct ContactStore *store) {
+    struct Journal *journal = store->journal;
+    if (!journal) return 0;
+
+    int status = journalWrite(journal);
+    journalFinishCompaction(store, 0);
+    if (journal->inlineCompaction) {
+        // fork() isn't safe with other threads running, so the snapshot is written here, by the caller. After a
+        // failure compactOffset holds off the next try until as much again has been written
+        if (journal->fileSize > journal->compactOffset + JOURNAL_COMPACT_BYTES)
+            journal->compactOffset = journalSnapshotNow(store) == 0 ? 0 : journal->fileSize;
+    } else if (journal->compactor == 0 && journal->fileSize > JOURNAL_COMPACT_BYTES) {
+        journalStartCompaction(store);
+    }
+    return status;
+}
+
+// Replay every journal record newer than the snapshot, then keep the journal open for new changes.
+// Replay stops at the first torn or corrupt record (a crash mid-write) and the file is cut back to there
+int journalOpen(struct ContactStore *store, const char *path) {
+    uint64_t valid = 0; // Bytes of intact records
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        char *body = malloc(JOURNAL_MAX_RECORD);
+        uint32_t head[2]; // Body size and checksum
+        while (body && fread(head, sizeof(head), 1, fp) == 1) {
+            if (head[0] <= sizeof(uint64_t) + 1 || head[0] > JOURNAL_MAX_RECORD ||
+                fread(body, 1, head[0], fp) != head[0] || hashBuffer(body, head[0]) != head[1] || body[head[0] - 1] != '\0')
+                break;
+            valid += sizeof(head) + head[0];
+
+            uint64_t lsn;
+            memcpy(&lsn, body, sizeof(lsn));
+            if (lsn <= store->lsn) continue; // Already part of the snapshot
+            journalApply(store, (unsigned char)body[sizeof(lsn)], body + sizeof(lsn) + 1, head[0] - sizeof(lsn) - 1);
+            store->lsn = lsn;
+        }
+        free(body);
+        fclose(fp);
+        if (storeCompactDue(store)) storeCompact(store); // Nothing holds a position yet
+    }
+
+    struct Journal *journal = malloc(sizeof(*journal));
+    char *buffer = malloc(JOURNAL_BUFFER_SIZE);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (!journal || !buffer || fd < 0 || ftruncate(fd, (off_t)valid) != 0) {
+        free(journal);
+        free(buffer);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    journal->fd = fd;
+    journal->buffer = buffer;
+    journal->length = 0;
+    journal->fileSize = valid;
+    journal->failed = 0;
+    journal->compactor = 0;
+    journal->compactOffset = 0;
+    journal->inlineCompaction = 0;
+    store->journal = journal;
+    return 0;
+}
+
+// Write a snapshot of the whole store right away and empty the journal, e.g. after a bulk import
+int journalCheckpoint(struct ContactStore *store) {
+    struct Journal *journal = store->journal;
+    journalCommit(store);
+    if (journal) journalFinishCompaction(store, 1); // Don't race a child writing the same file
+    return journalSnapshotNow(store);
+}
+
+// Commit what's left, let a running compaction finish and close the journal
+void journalClose(struct ContactStore *store) {
+    struct Journal *journal = store->journal;
+    if (!journal) return;
+    journalCommit(store);
+    journalFinishCompaction(store, 1);
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal);
+    store->journal = NULL;
+}
+
+// Export every contact, in name order, to the legacy text format: name, phone, address and email on their own lines
+int exportTextFile(const struct ContactStore *store, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    struct OutBuf out;
+    outInit(&out, fp);
+    struct OrderCursor cursor;
+    storeOrderSeek(store, "", &cursor);
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND;) {
+        struct Contact contact = storeGet(store, pos);
+        const char *fields[4] = {contact.name, contact.phone, contact.address, contact.email};
+        for (int i = 0; i < 4; i++) { // Write each field on a new line
+            outString(&out, fields[i]);
+            outChar(&out, '\n');
+        }
+    }
+    int failed = outClose(&out);
+    return fclose(fp) == 0 && !failed ? 0 : -1;
+}
+
+// Save all contacts to the snapshot file; this function is called when the user exits the program
+// Every change is already in the journal, so saving only has to commit what is still buffered
+void saveContactsToFile(struct ContactStore *store) {
+    if (journalCommit(store) != 0) {
+        printf("Failed to save contacts to %s.\n", JOURNAL_FILE);
+        return;
+    }
+    printf("Contacts saved to file.\n");
+}
+
+// Load contacts into the store; this function is called when the program first starts. The binary snapshot
+// is used when there is one, otherwise an old contacts.txt is imported; then the journal of later changes is
+// replayed on top and kept open so every change from now on is logged
+void loadContactsFromFile(struct ContactStore *store) {
+    STATS_TIMER(started);
+    int status = loadSnapshot(store, SNAPSHOT_FILE);
+    if (status == 1) {
+        // Rewrite a snapshot whose damaged indexes were rebuilt; it keeps its LSN so the journal still applies on top
+        if (saveSnapshot(store, SNAPSHOT_FILE) != 0) fprintf(stderr, "Failed to save contacts to %s.\n", SNAPSHOT_FILE);
+        status = 0;
+    }
+    if (status == -2) {
+        // Move it aside rather than overwrite it later, so it can still be recovered by hand
+        rename(SNAPSHOT_FILE, SNAPSHOT_FILE ".damaged");
+        fprintf(stderr, "%s is damaged or from an incompatible version; moved it to %s.damaged.\n", SNAPSHOT_FILE, SNAPSHOT_FILE);
+    }
+
+    if (status != 0) {
+        if (importLegacyTextFile(store, LEGACY_TEXT_FILE) < 0) {
+            fprintf(stderr, "No previous contacts file found. Starting fresh.\n");
+        } else if (saveSnapshot(store, SNAPSHOT_FILE) != 0) { // Anchor the imported book so the journal applies on top of it
+            fprintf(stderr, "Failed to save contacts to %s.\n", SNAPSHOT_FILE);
+        }
+    }
+
+    if (journalOpen(store, JOURNAL_FILE) != 0) {
+        fprintf(stderr, "Could not open %s; changes will not be saved.\n", JOURNAL_FILE);
+    }
+    STATS_RECORD(STAT_OP_LOAD, started);
+}
+
+
+
+
+
+// Growable buffer the import parsers copy field text into
+struct TextBuffer {
+    char *data;
+    size_t size;
+    size_t cap;
+    int failed; // Set once memory runs out; later bytes are dropped
+};
+
+// Grow a text buffer so it has room for `extra` more bytes
+static int textReserve(struct TextBuffer *text, size_t extra) {
+    if (text->size + extra <= text->cap) return 0;
+    size_t newCap = text->cap ? text->cap * 2 : 4096;
+    while (newCap < text->size + extra) newCap *= 2;
+    char *data = realloc(text->data, newCap);
+    if (!data) {
+        text->failed = 1;
+        return -1;
+    }
+    text->data = data;
+    text->cap = newCap;
+    return 0;
+}
+
+// Append one byte to a text buffer
+static void textPush(struct TextBuffer *text, char c) {
+    if (text->size < text->cap || textReserve(text, 1) == 0) text->data[text->size++] = c;
+}
+
+// Parse one CSV/TSV record starting at `p`, appending its fields to `text` as NUL-terminated strings whose
+// offsets go in `fields`, and return where the next record starts. Fields may be wrapped in double quotes
+// (a doubled quote inside is a literal one) so they can hold the delimiter or line breaks. Carriage returns
+// outside quotes are dropped. Missing fields are left empty and `fieldCount` says how many there really were
+static const char *parseDelimitedRecord(const char *p, const char *end, char delimiter, struct TextBuffer *text,
+                                        size_t fields[4], int *fieldCount) {
+    int field = 0;        // Which field is being filled
+    int atStart = 1;      // Nothing read for this field yet, so a quote opens it
+    int quoted = 0;       // Inside a quoted field
+    fields[0] = text->size;
+
+    for (; p < end; p++) {
+        char c = *p;
+        if (quoted) {
+            if (c == '"') {
+                if (p + 1 < end && p[1] == '"') p++; // Doubled quote, keep one
+                else { quoted = 0; continue; }      // Closing quote
+            }
+        } else if (c == '"' && atStart) {
+            quoted = 1;
+            atStart = 0;
+            continue;
+        } else if (c == delimiter) {
+            if (field < 4) textPush(text, '\0'); // End the field just read
+            if (++field < 4) fields[field] = text->size;
+            atStart = 1;
+            continue;
+        } else if (c == '\n') {
+            p++; // The next record starts after the line break
+            break;
+        } else if (c == '\r') {
+            continue;
+        }
+        atStart = 0;
+        if (field < 4) textPush(text, c);
+    }
+    *fieldCount = field + 1;
+    if (field < 4) textPush(text, '\0');
+    for (int missing = field + 1; missing < 4; missing++) {
+        fields[missing] = text->size;
+        textPush(text, '\0');
+    }
+    return p;
+}
+
+// A record parsed by an import worker, waiting for the merge. The format checks and the hashes the
+// duplicate checks need are done by the worker; only the duplicate checks themselves are left for the merge
+struct ImportRecord {
+    size_t fields[4];   // Offsets of the name, phone, address and email in the chunk's text
+    uint32_t nameHash;  // Name index hash of contact.name
+    uint32_t phoneHash; // Phone index hash of contact.phone
+    int error;          // First format error, CONTACT_ERROR_COUNT if the record didn't have four fields
+    long record;        // Record number within the chunk, for error messages
+};
+
+// A slice of the import file. Chunks are cut just after a line break, which is a record boundary unless a
+// quoted field spans lines; the merge notices when it wasn't and parses the chunk again from the right place
+struct ImportChunk {
+    const char *start, *end;        // Records starting in [start, end) belong to this chunk
+    const char *parsedEnd;          // Where parsing of the chunk's last record stopped
+    struct ImportRecord *records;   // Parsed records, in file order
+    size_t count, cap;
+    struct TextBuffer text;         // The records' field strings
+    long recordCount;               // Records in the chunk, blank ones included
+    long lineBreaks;                // Text format: line breaks between this chunk's raw offset and the next
+    int done;                       // Parsed and ready to merge; guarded by the job's lock
+    int failed;                     // Ran out of memory while parsing
+};
+
+// State shared by the import workers and the merge
+struct ImportJob {
+    struct ContactStore *store;
+    const char *path;              // For error messages
+    const char *data, *dataEnd;    // The mapped file
+    enum FileFormat format;
+    char delimiter;
+    int validate;                  // Off only for the first load of the legacy contacts.txt, which is taken as-is
+    struct ImportChunk *chunks;
+    size_t chunkCount;
+    size_t nextChunk;              // Next chunk for a worker to take
+    size_t mergedChunks;           // Chunks merged so far; workers stay less than `window` chunks ahead
+    size_t window;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;        // Signalled when a chunk is parsed or merged
+    struct ImportReport *report;
+    long recordBase;               // Records in the chunks merged so far
+    long reported;                 // Rejected records printed so far
+    size_t first;                  // Store position of the first imported contact
+    int indexFailed[2];            // Set by the index builders if they run out of memory
+};
+
+// Signature of work that runParallel splits across threads
+typedef void ParallelWork(void *arg, size_t part, size_t parts);
+
+// One thread's share of a runParallel call
+struct ParallelPart {
+    ParallelWork *work;
+    void *arg;
+    size_t part, parts;
+};
+
+static void *parallelPartMain(void *arg) {
+    struct ParallelPart *part = arg;
+    part->work(part->arg, part->part, part->parts);
+    return NULL;
+}
+
+// Run work(arg, part, parts) for every part on its own thread, the calling thread taking part 0.
+// A part whose thread can't be started is run on the calling thread instead
+static void runParallel(ParallelWork *work, void *arg, size_t parts) {
+    struct ParallelPart *list = malloc(parts * sizeof(*list));
+    pthread_t *threads = malloc(parts * sizeof(*threads));
+    char *started = calloc(parts, 1);
+    if (!list || !threads || !started) {
+        for (size_t i = 0; i < parts; i++) work(arg, i, parts);
+    } else {
+        for (size_t i = 1; i < parts; i++) {
+            list[i] = (struct ParallelPart){work, arg, i, parts};
+            started[i] = pthread_create(&threads[i], NULL, parallelPartMain, &list[i]) == 0;
+        }
+        work(arg, 0, parts);
+        for (size_t i = 1; i < parts; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+            else work(arg, i, parts);
+        }
+    }
+    free(list);
+    free(threads);
+    free(started);
+}
+
+// Add a parsed record to a chunk, growing its array by doubling
+static struct ImportRecord *importChunkPush(struct ImportChunk *chunk) {
+    if (chunk->count == chunk->cap) {
+        size_t newCap = chunk->cap ? chunk->cap * 2 : 1024;
+        struct ImportRecord *records = realloc(chunk->records, newCap * sizeof(*records));
+        if (!records) return NULL;
+        chunk->records = records;
+        chunk->cap = newCap;
+    }
+    return &chunk->records[chunk->count++];
+}
+
+// Parse one line of a legacy text file into a field, appending it to `text`; like reading the line with
+// getline, the field stops at the line ending. Returns where the next line starts
+static const char *parseTextLine(const char *p, const char *end, struct TextBuffer *text, size_t *field) {
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    if (!eol) eol = end;
+    size_t len = 0;
+    while (p + len < eol && p[len] != '\r' && p[len] != '\0') len++;
+    *field = text->size;
+    if (textReserve(text, len + 1) == 0) {
+        memcpy(text->data + text->size, p, len);
+        text->data[text->size + len] = '\0';
+        text->size += len + 1;
+    }
+    return eol < end ? eol + 1 : end;
+}
+
+// Point a contact at a parsed record's fields
+static struct Contact importRecordContact(const struct ImportChunk *chunk, const struct ImportRecord *record) {
+    const char *text = chunk->text.data;
+    struct Contact contact = { text + record->fields[0], text + record->fields[1], text + record->fields[2], text + record->fields[3] };
+    return contact;
+}
+
+// Parse every record starting in [chunk->start, chunk->end); the last one may run on past the chunk's end
+static void importParseChunk(struct ImportJob *job, struct ImportChunk *chunk) {
+    const char *p = chunk->start;
+    chunk->count = 0;
+    chunk->recordCount = 0;
+    chunk->text.size = 0;
+    chunk->text.failed = 0;
+    while (p < chunk->end && !chunk->text.failed) {
+        struct ImportRecord *record = importChunkPush(chunk);
+        if (!record) {
+            chunk->failed = 1;
+            break;
+        }
+        int fieldCount = 4;
+        if (job->format == FORMAT_TEXT) {
+            p = parseTextLine(p, job->dataEnd, &chunk->text, &record->fields[0]);
+            if (p < job->dataEnd) p = parseTextLine(p, job->dataEnd, &chunk->text, &record->fields[1]);
+            if (p < job->dataEnd) p = parseTextLine(p, job->dataEnd, &chunk->text, &record->fields[2]);
+            if (p == job->dataEnd) { // A contact cut short at the end of the file is dropped
+                chunk->count--;
+                break;
+            }
+            p = parseTextLine(p, job->dataEnd, &chunk->text, &record->fields[3]);
+        } else {
+            p = parseDelimitedRecord(p, job->dataEnd, job->delimiter, &chunk->text, record->fields, &fieldCount);
+        }
+        if (chunk->text.failed) break;
+        record->record = ++chunk->recordCount;
+
+        struct Contact contact = importRecordContact(chunk, record);
+        if (job->validate) {
+            if ((fieldCount == 1 && contact.name[0] == '\0') || // Blank line
+                (chunk == job->chunks && record->record == 1 && strcasecmp(contact.name, "name") == 0 &&
+                 strcasecmp(contact.phone, "phone") == 0)) { // Header row
+                chunk->count--;
+                continue;
+            }
+        }
+        record->error = fieldCount != 4 ? CONTACT_ERROR_COUNT : job->validate ? validateContact(NULL, &contact, CONTACT_NOT_FOUND) : CONTACT_OK;
+        record->nameHash = hashFolded(contact.name);
+        record->phoneHash = hashBytes(phoneKey(contact.phone));
+    }
+    if (chunk->text.failed) chunk->failed = 1;
+    chunk->parsedEnd = p;
+}
+
+// Worker thread: parse chunks in order, staying no more than a window ahead of the merge
+static void *importWorker(void *arg) {
+    struct ImportJob *job = arg;
+    pthread_mutex_lock(&job->lock);
+    while (job->nextChunk < job->chunkCount) {
+        if (job->nextChunk >= job->mergedChunks + job->window) {
+            pthread_cond_wait(&job->changed, &job->lock);
+            continue;
+        }
+        struct ImportChunk *chunk = &job->chunks[job->nextChunk++];
+        pthread_mutex_unlock(&job->lock);
+        importParseChunk(job, chunk);
+        pthread_mutex_lock(&job->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Count line breaks in each chunk's raw byte range, so text chunks can be cut between contacts
+static void importCountLineBreaks(void *arg, size_t part, size_t parts) {
+    struct ImportJob *job = arg;
+    for (size_t i = part; i < job->chunkCount; i += parts) {
+        const char *p = job->data + i * IMPORT_CHUNK_BYTES;
+        const char *end = i + 1 < job->chunkCount ? p + IMPORT_CHUNK_BYTES : job->dataEnd;
+        long count = 0;
+        while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            count++;
+            p++;
+        }
+        job->chunks[i].lineBreaks = count;
+    }
+}
+
+// Cut the file into chunks. CSV and TSV chunks start after the first line break past each IMPORT_CHUNK_BYTES
+// offset; text chunks after the first line break that ends a contact, found from the line break counts
+static void importSplitChunks(struct ImportJob *job, size_t threads) {
+    struct ImportChunk *chunks = job->chunks;
+    if (job->format == FORMAT_TEXT)
+        runParallel(importCountLineBreaks, job, threads < job->chunkCount ? threads : job->chunkCount);
+
+    const char *p = job->data;
+    long lines = 0; // Line breaks before p
+    long rawLines = 0; // Line breaks before the current raw offset
+    chunks[0].start = job->data;
+    for (size_t i = 1; i < job->chunkCount; i++) {
+        const char *raw = job->data + i * IMPORT_CHUNK_BYTES;
+        rawLines += chunks[i - 1].lineBreaks;
+        if (p < raw) {
+            p = raw;
+            lines = rawLines;
+        }
+        while (p < job->dataEnd) {
+            const char *eol = memchr(p, '\n', (size_t)(job->dataEnd - p));
+            p = eol ? eol + 1 : job->dataEnd;
+            if (++lines % 4 == 0 || job->format != FORMAT_TEXT) break;
+        }
+        chunks[i - 1].end = chunks[i].start = p;
+    }
+    chunks[job->chunkCount - 1].end = job->dataEnd;
+}
+
+// Merge one parsed chunk into the store in file order, running the duplicate checks against everything
+// merged before it so the outcome is the same as a serial import. Returns -1 if out of memory
+static int importMergeChunk(struct ImportJob *job, struct ImportChunk *chunk) {
+    struct ContactStore *store = job->store;
+    for (size_t i = 0; i < chunk->count; i++) {
+        struct ImportRecord *record = &chunk->records[i];
+        struct Contact contact = importRecordContact(chunk, record);
+        int error = record->error;
+        if (job->validate && error != CONTACT_ERROR_COUNT && error != CONTACT_TOO_LONG && error != CONTACT_EMPTY_NAME) {
+            // Same order of checks as validateContact
+            if (hashIndexFindHashed(&store->nameIndex, store, contact.name, record->nameHash) != CONTACT_NOT_FOUND)
+                error = CONTACT_DUPLICATE_NAME;
+            else if (error != CONTACT_EMPTY_PHONE && error != CONTACT_INVALID_PHONE &&
+                     hashIndexFindHashed(&store->phoneIndex, store, contact.phone, record->phoneHash) != CONTACT_NOT_FOUND)
+                error = CONTACT_DUPLICATE_PHONE;
+            if (error == CONTACT_DUPLICATE_NAME || error == CONTACT_DUPLICATE_PHONE) STATS_COUNT(STAT_DUPLICATES);
+        }
+        if (error != CONTACT_OK) {
+            if (error == CONTACT_ERROR_COUNT) job->report->malformed++;
+            else job->report->rejected[error]++;
+            if (job->reported++ < IMPORT_MAX_REPORTED)
+                fprintf(stderr, "%s: record %ld: %s\n", job->path, job->recordBase + record->record,
+                        error == CONTACT_ERROR_COUNT ? "expected 4 fields" : contactErrorMessage(error));
+            continue;
+        }
+
+        size_t pos = storeAppend(store, &contact);
+        if (pos == CONTACT_NOT_FOUND) return -1;
+        if (hashIndexInsertHashed(&store->nameIndex, record->nameHash, pos) != 0) {
+            storeDropLast(store);
+            return -1;
+        }
+        if (hashIndexInsertHashed(&store->phoneIndex, record->phoneHash, pos) != 0) {
+            hashIndexRemove(&store->nameIndex, store, pos);
+            storeDropLast(store);
+            return -1;
+        }
+        job->report->imported++;
+    }
+    job->recordBase += chunk->recordCount;
+    return 0;
+}
+
+// Index the merged contacts by trigram (part 1) and in name order (part 0); the two share nothing
+static void importBuildIndexes(void *arg, size_t part, size_t parts) {
+    struct ImportJob *job = arg;
+    struct ContactStore *store = job->store;
+    for (size_t which = part; which < 2; which += parts) {
+        for (size_t pos = job->first; pos < store->slots && !job->indexFailed[which]; pos++) {
+            job->indexFailed[which] = which == 0 ? orderIndexInsert(store, pos) != 0
+                                                 : trigramIndexInsert(&store->nameTrigrams, pos, storeField(store, pos, FIELD_FOLDED_NAME)) != 0;
+        }
+    }
+}
+
+// Import a mapped file through a pipeline: worker threads parse and check chunks of the file while this thread
+// merges finished chunks into the store in order, then the trigram and ordered indexes are filled in for all
+// the new contacts at once, on two threads. With one thread the same steps run one after another, so the
+// result doesn't depend on the thread count. If memory runs out the store is left as it was
+static long importMapped(struct ContactStore *store, const char *path, const char *data, size_t size,
+                         enum FileFormat format, char delimiter, int validate, struct ImportReport *report) {
+    struct ImportJob job;
+    memset(&job, 0, sizeof(job));
+    job.store = store;
+    job.path = path;
+    job.data = data;
+    job.dataEnd = data + size;
+    job.format = format;
+    job.delimiter = delimiter;
+    job.validate = validate;
+    job.report = report;
+    job.first = store->slots; // Imports always append, leaving any deleted slots for later inserts
+    job.chunkCount = (size + IMPORT_CHUNK_BYTES - 1) / IMPORT_CHUNK_BYTES;
+    fuzzyIndexFree(&store->nameWords); // Cheaper to build again on the next fuzzy search than to keep up with a bulk load
+    phoneTrieFree(&store->phoneTrie);  // Likewise on the next phone lookup
+    job.chunks = calloc(job.chunkCount, sizeof(*job.chunks));
+    if (!job.chunks) return -1;
+
+    size_t threads = store->threads > 1 ? (size_t)store->threads : 1;
+    size_t workers = threads > 1 && job.chunkCount > 1 ? threads - 1 : 0; // This thread does the merge
+    if (workers > job.chunkCount) workers = job.chunkCount;
+    job.window = 2 * (workers + 1);
+    importSplitChunks(&job, threads);
+
+    pthread_t *workerThreads = workers ? malloc(workers * sizeof(*workerThreads)) : NULL;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+    size_t started = 0;
+    while (workerThreads && started < workers && pthread_create(&workerThreads[started], NULL, importWorker, &job) == 0)
+        started++;
+
+    int failed = 0;
+    const char *expected = data; // Where the previous chunk's last record ended
+    for (size_t i = 0; i < job.chunkCount && !failed; i++) {
+        struct ImportChunk *chunk = &job.chunks[i];
+        if (started == 0) {
+            importParseChunk(&job, chunk); // No workers, so parse it here
+        } else {
+            pthread_mutex_lock(&job.lock);
+            while (!chunk->done) pthread_cond_wait(&job.changed, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+        }
+        if (chunk->start != expected) {
+            // The cut fell inside a record (a quoted line break); parse again from where that record ended
+            chunk->start = expected;
+            chunk->failed = 0;
+            importParseChunk(&job, chunk);
+        }
+        failed = chunk->failed || importMergeChunk(&job, chunk) != 0;
+        expected = chunk->parsedEnd;
+        free(chunk->records);
+        free(chunk->text.data);
+        chunk->records = NULL;
+        chunk->text.data = NULL;
+
+        pthread_mutex_lock(&job.lock);
+        job.mergedChunks++;
+        if (failed) job.nextChunk = job.chunkCount; // Tell the workers to stop
+        pthread_cond_broadcast(&job.changed);
+        pthread_mutex_unlock(&job.lock);
+    }
+    for (size_t i = 0; i < started; i++) pthread_join(workerThreads[i], NULL);
+    for (size_t i = 0; i < job.chunkCount; i++) { // Parsed but never merged
+        free(job.chunks[i].records);
+        free(job.chunks[i].text.data);
+    }
+    free(workerThreads);
+    free(job.chunks);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.changed);
+
+    if (!failed) {
+        runParallel(importBuildIndexes, &job, threads > 1 ? 2 : 1);
+        failed = job.indexFailed[0] || job.indexFailed[1];
+    }
+    if (failed) {
+        // Take every imported contact back out; removing an entry that was never indexed is harmless
+        while (store->slots > job.first) {
+            storeIndexRemove(store, store->slots - 1);
+            storeDropLast(store);
+        }
+        fprintf(stderr, "Out of memory while importing contacts.\n");
+        return -1;
+    }
+    for (size_t pos = job.first; pos < store->slots; pos++) {
+        struct Contact contact = storeGet(store, pos);
+        journalLog(store, JOURNAL_ADD, NULL, &contact);
+    }
+    return report->imported;
+}
+
+// Map a file and import it with importMapped; returns the number of contacts imported or -1
+static long importFile(struct ContactStore *store, const char *path, enum FileFormat format, char delimiter, int validate,
+                       struct ImportReport *report) {
+    memset(report, 0, sizeof(*report));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) { // Nothing to map
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid without the descriptor
+    if (data == MAP_FAILED) return -1;
+    madvise(data, size, MADV_SEQUENTIAL); // Read once front to back
+    STATS_TIMER(started);
+    long imported = importMapped(store, path, data, size, format, delimiter, validate, report);
+    STATS_RECORD(STAT_OP_IMPORT, started);
+    munmap(data, size);
+    return imported;
+}
+
+// Import a CSV or TSV file of name, phone, address and email records. Every record goes through the same
+// checks as addContact; bad ones are counted and the first few reported on stderr instead of stopping the
+// import. A first row naming the columns is skipped. Returns the number of contacts imported or -1 if the
+// file can't be read
+long importDelimitedFile(struct ContactStore *store, const char *path, char delimiter, struct ImportReport *report) {
+    return importFile(store, path, delimiter == '\t' ? FORMAT_TSV : FORMAT_CSV, delimiter, 1, report);
+}
+
+// Import the legacy text format. Lines are read whole, so empty fields keep their place, and anything
+// longer than a field is cut off instead of overflowing it. Records get the same checks as a CSV import.
+// Returns the number of contacts imported or -1 if the file can't be read
+long importTextFile(struct ContactStore *store, const char *path, struct ImportReport *report) {
+    return importFile(store, path, FORMAT_TEXT, 0, 1, report);
+}
+
+// Load an old contacts.txt the first time the program runs without a snapshot. Into an empty store it's taken
+// as it is, unchecked, since it is the user's existing book rather than new input; into anything else it gets
+// the usual checks. Returns contacts read or -1
+long importLegacyTextFile(struct ContactStore *store, const char *path) {
+    struct ImportReport report;
+    return importFile(store, path, FORMAT_TEXT, 0, store->count == 0 ? 0 : 1, &report);
+}
+
+// Export every contact, in name order, as CSV or TSV with a header row
+int exportDelimitedFile(const struct ContactStore *store, const char *path, char delimiter) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "name%cphone%caddress%cemail\n", delimiter, delimiter, delimiter);
+    struct OutBuf out;
+    outInit(&out, fp);
+    struct OrderCursor cursor;
+    storeOrderSeek(store, "", &cursor);
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND;) {
+        struct Contact contact = storeGet(store, pos);
+        outDelimitedRecord(&out, &contact, delimiter);
+    }
+    int failed = outClose(&out);
+    return fclose(fp) == 0 && !failed ? 0 : -1;
+}
+
+// Work out a file's format from --format or, failing that, from its extension; CSV if neither says
+static int parseFileFormat(const char *path, const char *name, enum FileFormat *format) {
+    if (!name) {
+        const char *dot = strrchr(path, '.');
+        name = dot ? dot + 1 : "csv";
+        if (strcasecmp(name, "tsv") != 0 && strcasecmp(name, "txt") != 0 && strcasecmp(name, "text") != 0) name = "csv";
+    }
+    if (strcasecmp(name, "csv") == 0) *format = FORMAT_CSV;
+    else if (strcasecmp(name, "tsv") == 0) *format = FORMAT_TSV;
+    else if (strcasecmp(name, "txt") == 0 || strcasecmp(name, "text") == 0) *format = FORMAT_TEXT;
+    else return -1;
+    return 0;
+}
+
+// Bulk import for command mode. The journal is set aside while importing and a fresh snapshot written at the
+// end instead, so a big import costs one snapshot rather than one journal record per contact
+static int commandImport(struct ContactStore *store, const char *path, enum FileFormat format) {
+    struct ImportReport report;
+    struct Journal *journal = store->journal;
+    store->journal = NULL;
+    long imported;
+    if (format == FORMAT_TEXT) imported = importTextFile(store, path, &report);
+    else imported = importDelimitedFile(store, path, format == FORMAT_TSV ? '\t' : ',', &report);
+    store->journal = journal;
+    if (imported < 0) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 1;
+    }
+
+    long rejected = report.malformed;
+    for (int i = 0; i < CONTACT_ERROR_COUNT; i++) rejected += report.rejected[i];
+    fprintf(stderr, "Imported %ld contacts from %s", imported, path);
+    if (rejected > 0) {
+        fprintf(stderr, "; rejected %ld (", rejected);
+        const char *separator = "";
+        for (int i = 0; i < CONTACT_ERROR_COUNT; i++) {
+            if (report.rejected[i] == 0) continue;
+            fprintf(stderr, "%s%ld %s", separator, report.rejected[i], contactErrorMessage(i));
+            separator = ", ";
+        }
+        if (report.malformed > 0) fprintf(stderr, "%s%ld malformed", separator, report.malformed);
+        fprintf(stderr, ")");
+    }
+    fprintf(stderr, ".\n");
+
+    if (imported > 0 && journalCheckpoint(store) != 0) {
+        fprintf(stderr, "Failed to save contacts to %s.\n", SNAPSHOT_FILE);
+        return 1;
+    }
+    return 0;
+}
+
+// Delete one contact by name for command mode
+static int commandDelete(struct ContactStore *store, const char *name) {
+    size_t pos = storeFindByName(store, name);
+    if (pos == CONTACT_NOT_FOUND) {
+        fprintf(stderr, "delete: no contact named '%s'\n", name);
+        return 1;
+    }
+    if (storeRemove(store, pos) != 0) {
+        fprintf(stderr, "Out of memory. Contact not deleted.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Delete every name listed in a file, one per line
+static int commandDeleteFrom(struct ContactStore *store, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 1;
+    }
+    char *line = NULL;
+    size_t lineCap = 0;
+    long deleted = 0, missing = 0;
+    int failed = 0;
+    while (getline(&line, &lineCap, fp) != -1) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0') continue;
+        size_t pos = storeFindByName(store, line);
+        if (pos == CONTACT_NOT_FOUND) {
+            missing++;
+            continue;
+        }
+        if (storeRemove(store, pos) != 0) {
+            fprintf(stderr, "Out of memory. Contact '%s' not deleted.\n", line);
+            failed = 1;
+            break;
+        }
+        deleted++;
+    }
+    free(line);
+    fclose(fp);
+    fprintf(stderr, "Deleted %ld contacts; %ld names not found.\n", deleted, missing);
+    return failed || missing > 0;
+}
+
+// After a limited page, tell whoever is reading stdout how to ask for the next one
+static void printNextPage(const struct ContactStore *store, size_t last) {
+    if (last != CONTACT_NOT_FOUND) fprintf(stderr, "More results follow; continue with --after '%s'\n", storeField(store, last, FIELD_NAME));
+}
+
+// Column headings of the table format; the other formats have none
+static void outTableHeader(struct OutBuf *out, enum OutputFormat format) {
+    if (format != OUTPUT_TABLE) return;
+    struct Contact heading = {"Name", "Phone", "Address", "Email"};
+    outContact(out, &heading, OUTPUT_TABLE);
+}
+
+// Print a page of search results on stdout
+static int commandSearch(const struct ContactStore *store, const char *needle, enum ContactField field,
+                         const struct OutputPage *page, enum OutputFormat format) {
+    struct OutBuf out;
+    size_t last;
+    outInit(&out, stdout);
+    outTableHeader(&out, format);
+    long count = writeSearchResults(store, needle, field, page, format, &out, &last);
+    if (outClose(&out) != 0) {
+        fprintf(stderr, "search: failed to write the results\n");
+        return 1;
+    }
+    if (count < 0) {
+        fprintf(stderr, "Out of memory. Cannot search contacts.\n");
+        return 1;
+    }
+    printNextPage(store, last);
+    return 0;
+}
+
+// Print a page of the contacts whose names are within an edit distance of the query, closest first
+static int commandFuzzy(struct ContactStore *store, const char *query, int maxDistance, const struct OutputPage *page,
+                        enum OutputFormat format) {
+    if (page->after) {
+        fprintf(stderr, "fuzzy: results are ranked by distance, so use --offset rather than --after\n");
+        return 1;
+    }
+    struct HitPage hitPage;
+    if (fuzzyPage(store, query, maxDistance, page, &hitPage) != 0) {
+        fprintf(stderr, "Out of memory. Cannot search contacts.\n");
+        return 1;
+    }
+    struct OutBuf out;
+    size_t last;
+    outInit(&out, stdout);
+    outTableHeader(&out, format);
+    long written = writeHitPage(store, &hitPage, page, format, &out, &last);
+    if (outClose(&out) != 0) {
+        fprintf(stderr, "fuzzy: failed to write the results\n");
+        return 1;
+    }
+    if (last != CONTACT_NOT_FOUND) fprintf(stderr, "More results follow; continue with --offset %zu\n", page->offset + (size_t)written);
+    return 0;
+}
+
+// Print the first contacts, COMPLETE_DEFAULT_LIMIT unless --limit says otherwise, whose name starts with the text,
+// or whose phone number does if the text starts with '+' or a digit
+static int commandComplete(struct ContactStore *store, const char *prefix, const struct OutputPage *page,
+                           enum OutputFormat format) {
+    if (page->offset || page->after) {
+        fprintf(stderr, "complete: only --limit and --format apply\n");
+        return 1;
+    }
+    size_t limit = page->limit ? page->limit : COMPLETE_DEFAULT_LIMIT;
+    if (limit > COMPLETE_MAX_LIMIT) limit = COMPLETE_MAX_LIMIT;
+    int byPhone = prefix[0] == '+' || isdigit((unsigned char)prefix[0]);
+    size_t *positions = malloc(limit * sizeof(*positions));
+    if (!positions || (byPhone && storeBuildPhoneTrie(store) != 0)) {
+        free(positions);
+        fprintf(stderr, "Out of memory. Cannot complete '%s'.\n", prefix);
+        return 1;
+    }
+    size_t count = byPhone ? storeCompletePhone(store, prefix, positions, limit)
+                           : storeCompleteName(store, prefix, positions, limit);
+    struct OutBuf out;
+    outInit(&out, stdout);
+    outTableHeader(&out, format);
+    for (size_t i = 0; i < count; i++) {
+        struct Contact contact = storeGet(store, positions[i]);
+        outContact(&out, &contact, format);
+    }
+    free(positions);
+    if (outClose(&out) != 0) {
+        fprintf(stderr, "complete: failed to write the results\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Print the contact an incoming number belongs to: the one with that phone number, or else the one whose number
+// is the longest the incoming one starts with
+static int commandCaller(struct ContactStore *store, const char *number, enum OutputFormat format) {
+    if (storeBuildPhoneTrie(store) != 0) {
+        fprintf(stderr, "Out of memory. Cannot look up '%s'.\n", number);
+        return 1;
+    }
+    int exact;
+    size_t pos = storeFindCaller(store, number, &exact);
+    if (pos == CONTACT_NOT_FOUND) {
+        fprintf(stderr, "caller: no contact for '%s'\n", number);
+        return 1;
+    }
+    struct Contact contact = storeGet(store, pos);
+    struct OutBuf out;
+    outInit(&out, stdout);
+    outTableHeader(&out, format);
+    outContact(&out, &contact, format);
+    if (outClose(&out) != 0) {
+        fprintf(stderr, "caller: failed to write the result\n");
+        return 1;
+    }
+    if (!exact) fprintf(stderr, "Matched on the start of the number, %s.\n", contact.phone);
+    return 0;
+}
+
+// Print a page of the contacts from `from` up to, but not including, `to`; empty bounds mean the start and end of the book
+static int commandList(const struct ContactStore *store, const char *from, const char *to, const struct OutputPage *page,
+                       enum OutputFormat format) {
+    struct OutBuf out;
+    size_t last;
+    outInit(&out, stdout);
+    outTableHeader(&out, format);
+    writeContactList(store, from, to, page, format, &out, &last);
+    if (outClose(&out) != 0) {
+        fprintf(stderr, "list: failed to write the contacts\n");
+        return 1;
+    }
+    printNextPage(store, last);
+    return 0;
+}
+
+// Take the options list and search share out of a command's arguments: --offset N, --limit N, --after NAME,
+// --format table|tsv|jsonl and, when `field` isn't NULL, --field name|phone|address|email. The other arguments
+// are moved up to fill the gaps. Returns how many arguments are left, or -1 after reporting a bad option
+static int parseOutputOptions(int argc, char *argv[], struct OutputPage *page, enum OutputFormat *format, enum ContactField *field) {
+    static const char *const formatNames[] = {"table", "tsv", "jsonl"};
+    static const char *const fieldNames[] = {"name", "phone", "address", "email"};
+    int left = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *option = argv[i];
+        if (strncmp(option, "--", 2) != 0) {
+            argv[left++] = argv[i];
+            continue;
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "%s: %s needs a value\n", argv[0], option);
+            return -1;
+        }
+        const char *value = argv[++i];
+        char *end = NULL;
+        if (strcmp(option, "--offset") == 0 || strcmp(option, "--limit") == 0) {
+            unsigned long long n = strtoull(value, &end, 10);
+            if (!isdigit((unsigned char)value[0]) || *end) {
+                fprintf(stderr, "%s: %s must be a number\n", argv[0], option);
+                return -1;
+            }
+            *(option[2] == 'o' ? &page->offset : &page->limit) = (size_t)n;
+        } else if (strcmp(option, "--after") == 0) {
+            page->after = value;
+        } else if (strcmp(option, "--format") == 0) {
+            int f = 0;
+            while (f < 3 && strcmp(value, formatNames[f]) != 0) f++;
+            if (f == 3) {
+                fprintf(stderr, "Unknown format '%s'.\n", value);
+                return -1;
+            }
+            *format = (enum OutputFormat)f;
+        } else if (strcmp(option, "--field") == 0 && field) {
+            int f = FIELD_NAME;
+            while (f <= FIELD_EMAIL && strcmp(value, fieldNames[f]) != 0) f++;
+            if (f > FIELD_EMAIL) {
+                fprintf(stderr, "Unknown field '%s'.\n", value);
+                return -1;
+            }
+            *field = (enum ContactField)f;
+        } else {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], option);
+            return -1;
+        }
+    }
+    return left;
+}
+
+// Fill a contact from four command arguments
+static void contactFromArgs(struct Contact *contact, char *argv[]) {
+    contact->name = argv[0];
+    contact->phone = argv[1];
+    contact->address = argv[2];
+    contact->email = argv[3];
+}
+
+// Print the commands understood by runCommand
+static void printUsage(void) {
+    fprintf(stderr,
+            "Usage: contactManagement [-j THREADS] [--stats-on-exit] [COMMAND ARGS...]\n"
+            "With no command the interactive menu is shown. -j sets the threads used by imports and --stats-on-exit\n"
+            "prints the statistics to stderr at the end. Commands:\n"
+            "  add NAME PHONE ADDRESS EMAIL\n"
+            "  edit NAME NEW_NAME PHONE ADDRESS EMAIL\n"
+            "  delete NAME...               delete --from FILE (one name per line)\n"
+            "  search TEXT [--field name|phone|address|email] [PAGE]  print matching contacts in name order\n"
+            "  list [FROM [TO]] [PAGE]      print contacts in name order\n"
+            "  fuzzy TEXT [DISTANCE] [PAGE] print contacts with a name word close to each word of TEXT, closest first;\n"
+            "                               DISTANCE is the edit distance allowed per word, 1 or 2 by word length if not given\n"
+            "  complete TEXT [--limit N] [--format F]  print the first contacts (10 by default) whose name starts with\n"
+            "                               TEXT, or whose phone number does if TEXT starts with '+' or a digit\n"
+            "  caller NUMBER [--format F]   print the contact with that phone number, or else the one whose number is\n"
+            "                               the longest that NUMBER starts with\n"
+            "    PAGE options: --offset N, --limit N, --after NAME (carry on after a page ended at NAME) and\n"
+            "    --format tsv|jsonl|table (TSV by default)\n"
+            "  import FILE [--format csv|tsv|text]\n"
+            "  export FILE [--format csv|tsv|text]\n"
+            "  batch                        read commands from stdin, one per line, arguments separated by tabs\n"
+            "  stats                        print operation counts, latency histograms and index counters so far\n"
+            "  serve                        answer requests from other programs on the socket " SERVE_SOCKET_FILE " until stopped\n"
+            "  loadgen [CLIENTS [REQUESTS [WRITE_PERCENT]]]  load test a running server and print its latencies\n"
+            "  bench [SIZE [SEED]]          time every operation on a generated book, results in " BENCH_OUTPUT_FILE "\n");
+}
+
+// Run one non-interactive command; argv[0] is the command name. Nothing is prompted for and only results are
+// written to stdout, so the output can be piped into other tools. Returns 0 on success, like an exit status
+int runCommand(struct ContactStore *store, int argc, char *argv[]) {
+    const char *command = argv[0];
+    struct Contact contact;
+
+    if (strcmp(command, "add") == 0 && argc == 5) {
+        contactFromArgs(&contact, argv + 1);
+        enum ContactError error = validateContact(store, &contact, CONTACT_NOT_FOUND);
+        if (error != CONTACT_OK) {
+            fprintf(stderr, "add: '%s': %s\n", contact.name, contactErrorMessage(error));
+            return 1;
+        }
+        if (storeInsert(store, &contact) == CONTACT_NOT_FOUND) {
+            fprintf(stderr, "Out of memory. Contact not added.\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (strcmp(command, "edit") == 0 && argc == 6) {
+        size_t pos = storeFindByName(store, argv[1]);
+        if (pos == CONTACT_NOT_FOUND) {
+            fprintf(stderr, "edit: no contact named '%s'\n", argv[1]);
+            return 1;
+        }
+        contactFromArgs(&contact, argv + 2);
+        enum ContactError error = validateContact(store, &contact, pos);
+        if (error != CONTACT_OK) {
+            fprintf(stderr, "edit: '%s': %s\n", argv[1], contactErrorMessage(error));
+            return 1;
+        }
+        if (storeUpdate(store, pos, &contact) != 0) {
+            fprintf(stderr, "Out of memory. Contact not updated.\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (strcmp(command, "delete") == 0 && argc >= 2) {
+        if (strcmp(argv[1], "--from") == 0) return argc == 3 ? commandDeleteFrom(store, argv[2]) : (printUsage(), 1);
+        int status = 0;
+        for (int i = 1; i < argc; i++) status |= commandDelete(store, argv[i]);
+        return status;
+    }
+    if (strcmp(command, "search") == 0 || strcmp(command, "list") == 0 || strcmp(command, "fuzzy") == 0 ||
+        strcmp(command, "complete") == 0 || strcmp(command, "caller") == 0) {
+        struct OutputPage page = {0, 0, NULL};
+        enum OutputFormat format = OUTPUT_TSV;
+        enum ContactField field = FIELD_NAME;
+        int isSearch = command[0] == 's';
+        argc = parseOutputOptions(argc, argv, &page, &format, isSearch ? &field : NULL);
+        if (argc < 0) return 1;
+        if (isSearch && argc == 2) return commandSearch(store, argv[1], field, &page, format);
+        if (strcmp(command, "complete") == 0 && argc == 2) return commandComplete(store, argv[1], &page, format);
+        if (strcmp(command, "caller") == 0 && argc == 2) return commandCaller(store, argv[1], format);
+        if (command[0] == 'l' && argc <= 3) return commandList(store, argc > 1 ? argv[1] : "", argc > 2 ? argv[2] : "", &page, format);
+        if (command[0] == 'f' && (argc == 2 || argc == 3)) {
+            int maxDistance = argc == 3 ? atoi(argv[2]) : -1;
+            if (argc == 3 && (!isdigit((unsigned char)argv[2][0]) || maxDistance > FUZZY_MAX_DISTANCE)) {
+                fprintf(stderr, "The distance must be between 0 and %d.\n", FUZZY_MAX_DISTANCE);
+                return 1;
+            }
+            return commandFuzzy(store, argv[1], maxDistance, &page, format);
+        }
+    }
+
+    // The old --import-text/--export-text options are kept as shorthands for the text format
+    int isImport = strcmp(command, "import") == 0 || strcmp(command, "--import-text") == 0;
+    int isExport = strcmp(command, "export") == 0 || strcmp(command, "--export-text") == 0;
+    if ((isImport || isExport) && (argc == 2 || (argc == 4 && strcmp(argv[2], "--format") == 0))) {
+        enum FileFormat format;
+        const char *formatName = command[0] == '-' ? "text" : argc == 4 ? argv[3] : NULL;
+        if (parseFileFormat(argv[1], formatName, &format) != 0) {
+            fprintf(stderr, "Unknown format '%s'.\n", formatName);
+            return 1;
+        }
+        if (isImport) return commandImport(store, argv[1], format);
+
+        int status = format == FORMAT_TEXT ? exportTextFile(store, argv[1])
+                                           : exportDelimitedFile(store, argv[1], format == FORMAT_TSV ? '\t' : ',');
+        if (status != 0) {
+            fprintf(stderr, "Failed to export contacts to %s.\n", argv[1]);
+            return 1;
+        }
+        fprintf(stderr, "Exported %zu contacts to %s.\n", store->count, argv[1]);
+        return 0;
+    }
+    if (strcmp(command, "batch") == 0 && argc == 1) return runBatch(store, stdin);
+    if (strcmp(command, "stats") == 0 && argc == 1) {
+        statsPrint(stdout);
+        return 0;
+    }
+    if (strcmp(command, "serve") == 0 && argc == 1) return runServer(store, SERVE_SOCKET_FILE);
+    if (strcmp(command, "loadgen") == 0 && argc <= 4) {
+        int clients = argc > 1 ? atoi(argv[1]) : LOADGEN_DEFAULT_CLIENTS;
+        long requests = argc > 2 ? atol(argv[2]) : LOADGEN_DEFAULT_REQUESTS;
+        int writePercent = argc > 3 ? atoi(argv[3]) : 0;
+        if (clients < 1 || clients > SERVE_MAX_CLIENTS || requests < 1 || writePercent < 0 || writePercent > 100) {
+            fprintf(stderr, "loadgen needs 1 to %d clients, at least one request each and a write percentage of 0 to 100.\n",
+                    SERVE_MAX_CLIENTS);
+            return 1;
+        }
+        return runLoadgen(SERVE_SOCKET_FILE, clients, requests, writePercent);
+    }
+    if (strcmp(command, "bench") == 0 && argc <= 3) {
+        char *end = NULL;
+        unsigned long long size = argc > 1 ? strtoull(argv[1], &end, 10) : BENCH_DEFAULT_SIZE;
+        if ((end && *end) || size < 1 || size > BENCH_MAX_SIZE) {
+            fprintf(stderr, "The benchmark size must be between 1 and %d.\n", BENCH_MAX_SIZE);
+            return 1;
+        }
+        unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+        return runBench((size_t)size, seed, store->threads, BENCH_OUTPUT_FILE);
+    }
+
+    printUsage();
+    return 2;
+}
+
+// Run commands read from `in`, one per line with tab-separated arguments, e.g. "add\tAnn\t+4412\tLeeds\ta@b.c".
+// Blank lines and lines starting with '#' are skipped. A failing command is reported with its line number and
+// the rest still run; all the changes are committed to the journal together at the end
+int runBatch(struct ContactStore *store, FILE *in) {
+    char *line = NULL;
+    size_t lineCap = 0;
+    long lineNumber = 0, failed = 0;
+    char *args[BATCH_MAX_ARGS];
+    while (getline(&line, &lineCap, in) != -1) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        int argc = 0;
+        for (char *arg = line; arg && argc < BATCH_MAX_ARGS; argc++) {
+            args[argc] = arg;
+            arg = strchr(arg, '\t');
+            if (arg) *arg++ = '\0';
+        }
+        if (strcmp(args[0], "batch") == 0) { // Would read the rest of our own input
+            fprintf(stderr, "batch line %ld: batch can't be nested\n", lineNumber);
+            failed++;
+            continue;
+        }
+        if (runCommand(store, argc, args) != 0) {
+            fprintf(stderr, "batch line %ld: %s failed\n", lineNumber, args[0]);
+            failed++;
+        }
+        if (storeCompactDue(store)) storeCompact(store); // Positions don't outlive a command
+    }
+    free(line);
+    if (journalCommit(store) != 0) {
+        fprintf(stderr, "Failed to save contacts to %s.\n", JOURNAL_FILE);
+        return 1;
+    }
+    if (failed > 0) fprintf(stderr, "%ld of the batch's commands failed.\n", failed);
+    return failed > 0;
+}
+
+// Seeded random numbers for the benchmark's synthetic books (splitmix64), so a seed gives the same book on any machine
+struct BenchRandom {
+    uint64_t state;
+};
+
+static uint64_t benchNext(struct BenchRandom *random) {
+    uint64_t z = (random->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Index below n; skewed picks favour the front of the list heavily, the way a few names and domains are very common
+static size_t benchPick(struct BenchRandom *random, size_t n, int skewed) {
+    double u = (double)(benchNext(random) >> 11) * 0x1.0p-53;
+    if (skewed) u = u * u * u;
+    return (size_t)(u * (double)n);
+}
+
+#define BENCH_COUNT(list) (sizeof(list) / sizeof(list[0]))
+static const char *const benchFirstNames[] = {
+    "James", "Olivia", "John", "Amelia", "Robert", "Isla", "Michael", "Ava", "William", "Mia", "David", "Emily",
+    "Mohammed", "Sophia", "Richard", "Grace", "Joseph", "Lily", "Thomas", "Freya", "Daniel", "Chloe", "Oliver",
+    "Ella", "George", "Ivy", "Harry", "Poppy", "Noah", "Evie", "Jack", "Sienna", "Leo", "Aisha", "Arthur", "Priya",
+    "Luca", "Hannah", "Oscar", "Zara", "Wei", "Yuki", "Mateo", "Ines", "Kwame", "Fatima", "Sven", "Ingrid",
+};
+static const char *const benchSurnames[] = {
+    "Smith", "Jones", "Williams", "Taylor", "Brown", "Davies", "Evans", "Wilson", "Thomas", "Johnson", "Roberts",
+    "Robinson", "Thompson", "Wright", "Walker", "White", "Edwards", "Hughes", "Green", "Hall", "Lewis", "Harris",
+    "Clarke", "Patel", "Jackson", "Wood", "Turner", "Martin", "Cooper", "Hill", "Ward", "Morris", "Moore", "Clark",
+    "Lee", "King", "Baker", "Harrison", "Morgan", "Allen", "Khan", "Nguyen", "Garcia", "Muller", "Rossi", "Okafor",
+    "Kowalski", "Tanaka", "O'Brien", "Fitzgerald-Jones",
+};
+static const char *const benchStreets[] = {
+    "High", "Station", "Main", "Park", "Church", "London", "Victoria", "Green", "Manor", "Mill", "Queens", "Kings",
+    "New", "School", "Grange", "North", "Springfield", "Windsor", "Highfield", "Alexandra",
+};
+static const char *const benchStreetTypes[] = {"Street", "Road", "Lane", "Avenue", "Close", "Drive", "Way", "Place"};
+static const char *const benchTowns[] = {
+    "London", "Leeds", "Manchester", "Bristol", "Glasgow", "Cardiff", "York", "Norwich", "Belfast", "Brighton",
+    "Edinburgh", "Oxford", "Cambridge", "Bath", "Exeter", "Hull", "Derby", "Dundee", "Swansea", "Inverness",
+};
+static const char *const benchDomains[] = {
+    "gmail.com", "outlook.com", "yahoo.co.uk", "hotmail.com", "icloud.com", "btinternet.com", "proton.me",
+    "sky.com", "example.org", "mail.example.net",
+};
+static const char *const benchCountryCodes[] = {"44", "1", "49", "33", "353", "91", "61", "81"};
+
+// Fields of one generated contact
+struct BenchContact {
+    char name[128];
+    char phone[32];
+    char address[128];
+    char email[128];
+};
+
+// Make up contact number i. Names and email domains follow a skewed distribution, so common names repeat
+// often; phones are a bijection of i and never repeat
+static void benchContact(struct BenchRandom *random, uint64_t seed, size_t i, struct BenchContact *out) {
+    const char *first = benchFirstNames[benchPick(random, BENCH_COUNT(benchFirstNames), 1)];
+    const char *last = benchSurnames[benchPick(random, BENCH_COUNT(benchSurnames), 1)];
+    if (benchPick(random, 3, 0) == 0) // A third of the book has a middle initial
+        snprintf(out->name, sizeof(out->name), "%s %c. %s", first, (char)('A' + benchPick(random, 26, 0)), last);
+    else
+        snprintf(out->name, sizeof(out->name), "%s %s", first, last);
+
+    uint64_t digits = ((uint64_t)i * 7919000003ULL + seed) % 10000000000ULL; // Odd and not a multiple of 5: no repeats
+    snprintf(out->phone, sizeof(out->phone), "+%s%010llu", benchCountryCodes[benchPick(random, BENCH_COUNT(benchCountryCodes), 1)],
+             (unsigned long long)digits);
+
+    snprintf(out->address, sizeof(out->address), "%zu %s %s, %s", 1 + benchPick(random, 250, 1),
+             benchStreets[benchPick(random, BENCH_COUNT(benchStreets), 0)],
+             benchStreetTypes[benchPick(random, BENCH_COUNT(benchStreetTypes), 1)],
+             benchTowns[benchPick(random, BENCH_COUNT(benchTowns), 1)]);
+
+    int length = snprintf(out->email, sizeof(out->email), "%s.%s", first, last);
+    if (benchPick(random, 2, 0) == 0) length += snprintf(out->email + length, sizeof(out->email) - length, "%zu", benchPick(random, 100, 0));
+    snprintf(out->email + length, sizeof(out->email) - length, "@%s", benchDomains[benchPick(random, BENCH_COUNT(benchDomains), 1)]);
+    for (char *c = out->email; *c; c++) *c = (char)tolower((unsigned char)*c);
+}
+
+static uint64_t benchNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int benchCompareTimes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Timings of one benchmark operation: `items` contacts handled in `samples` timed calls
+struct BenchTimer {
+    uint64_t *times; // Nanoseconds per call
+    size_t samples;
+    size_t cap;
+    uint64_t total;
+    uint64_t started;
+};
+
+static int benchStart(struct BenchTimer *timer, size_t samples) {
+    timer->times = malloc((samples ? samples : 1) * sizeof(*timer->times));
+    timer->samples = 0;
+    timer->cap = samples;
+    timer->total = 0;
+    return timer->times ? 0 : -1;
+}
+
+static void benchBegin(struct BenchTimer *timer) {
+    timer->started = benchNow();
+}
+
+static void benchEnd(struct BenchTimer *timer) {
+    uint64_t elapsed = benchNow() - timer->started;
+    timer->total += elapsed;
+    if (timer->samples < timer->cap) timer->times[timer->samples++] = elapsed;
+}
+
+// Write one result row and free the timings. `contacts` is the size of the book the operation ran on; the rate is
+// items per second, contacts for bulk operations like save and calls for the rest. Peak RSS is the process's
+// high-water mark so far, so it only ever grows down the file
+static void benchReport(FILE *out, struct BenchTimer *timer, const char *operation, size_t contacts, size_t items) {
+    qsort(timer->times, timer->samples, sizeof(*timer->times), benchCompareTimes);
+    uint64_t p50 = timer->samples ? timer->times[(timer->samples - 1) / 2] : 0;
+    uint64_t p99 = timer->samples ? timer->times[(timer->samples - 1) * 99 / 100] : 0;
+    double seconds = (double)timer->total / 1e9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char row[256];
+    snprintf(row, sizeof(row), "%s\t%zu\t%zu\t%.6f\t%.0f\t%.3f\t%.3f\t%ld\n", operation, contacts, timer->samples, seconds,
+             seconds > 0 ? (double)items / seconds : 0.0, (double)p50 / 1e3, (double)p99 / 1e3, usage.ru_maxrss);
+    fputs(row, out);
+    fputs(row, stdout);
+    free(timer->times);
+}
+
+// Pick a random stored contact and copy one of its fields, so later operations can't be fooled by a moved record
+static void benchSample(struct BenchRandom *random, const struct ContactStore *store, enum ContactField field, char *buffer, size_t size) {
+    size_t pos;
+    do pos = benchPick(random, store->slots, 0);
+    while (storeIsDeleted(store, pos));
+    snprintf(buffer, size, "%s", storeField(store, pos, field));
+}
+
+// Build a synthetic book of `size` contacts from `seed` and time every operation on it through the same calls
+// the menu and commands use, writing one TSV row per operation to `path`. The user's own book isn't touched;
+// the snapshot and CSV the benchmark writes sit next to `path` and are removed afterwards. Returns 0 on success
+int runBench(size_t size, uint64_t seed, int threads, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Can't write %s.\n", path);
+        return 1;
+    }
+    char snapPath[4096], csvPath[4096];
+    snprintf(snapPath, sizeof(snapPath), "%s.snap", path);
+    snprintf(csvPath, sizeof(csvPath), "%s.csv", path);
+    fprintf(out, "# contactManagement bench size=%zu seed=%llu threads=%d\n", size, (unsigned long long)seed, threads);
+    fputs("operation\tcontacts\tsamples\tseconds\tper_second\tp50_us\tp99_us\tpeak_rss_kb\n", out);
+    fputs("operation\tcontacts\tsamples\tseconds\tper_second\tp50_us\tp99_us\tpeak_rss_kb\n", stdout);
+
+    struct ContactStore store, copy;
+    storeInit(&store);
+    storeInit(&copy);
+    store.threads = copy.threads = threads;
+    struct BenchRandom random = {seed};
+    struct BenchTimer timer;
+    struct BenchContact generated;
+    size_t queries = size < BENCH_QUERIES ? size : BENCH_QUERIES;
+    size_t searches = size < BENCH_SEARCHES ? size : BENCH_SEARCHES;
+    size_t scans = size < BENCH_SCANS ? size : BENCH_SCANS;
+    char key[128];
+    int status = 1, failed;
+
+    // add: validation plus insert, as addContact does it. A name already in the book gets the contact's
+    // number appended, which can't clash with anything
+    if (benchStart(&timer, size) != 0) goto oom;
+    for (size_t i = 0; i < size; i++) {
+        benchContact(&random, seed, i, &generated);
+        struct Contact contact = {generated.name, generated.phone, generated.address, generated.email};
+        benchBegin(&timer);
+        enum ContactError error = validateContact(&store, &contact, CONTACT_NOT_FOUND);
+        if (error == CONTACT_DUPLICATE_NAME) {
+            size_t length = strlen(generated.name);
+            snprintf(generated.name + length, sizeof(generated.name) - length, " %zu", i);
+            error = validateContact(&store, &contact, CONTACT_NOT_FOUND);
+        }
+        size_t pos = error == CONTACT_OK ? storeInsert(&store, &contact) : CONTACT_NOT_FOUND;
+        benchEnd(&timer);
+        if (error != CONTACT_OK) {
+            fprintf(stderr, "bench: generated contact '%s' was rejected: %s\n", generated.name, contactErrorMessage(error));
+            free(timer.times);
+            goto done;
+        }
+        if (pos == CONTACT_NOT_FOUND) {
+            free(timer.times);
+            goto oom;
+        }
+    }
+    benchReport(out, &timer, "add", store.count, size);
+
+    if (benchStart(&timer, queries) != 0) goto oom;
+    for (size_t i = 0; i < queries; i++) {
+        benchSample(&random, &store, FIELD_NAME, key, sizeof(key));
+        benchBegin(&timer);
+        storeFindByName(&store, key);
+        benchEnd(&timer);
+    }
+    benchReport(out, &timer, "find_name", store.count, queries);
+
+    if (benchStart(&timer, queries) != 0) goto oom;
+    for (size_t i = 0; i < queries; i++) {
+        benchSample(&random, &store, FIELD_PHONE, key, sizeof(key));
+        benchBegin(&timer);
+        storeFindByPhone(&store, key);
+        benchEnd(&timer);
+    }
+    benchReport(out, &timer, "find_phone", store.count, queries);
+
+    // phone_trie: building the phone trie, which stays built and kept up to date for the rest of the run;
+    // complete: the first ten names starting with a real name's first three letters; complete_phone: the first
+    // ten numbers starting with a real number's first six characters; caller_id: a real number with an extension
+    // dialled on the end, so the walk goes to the end of the number and falls back to the contact's
+    if (benchStart(&timer, 1) != 0) goto oom;
+    benchBegin(&timer);
+    failed = storeBuildPhoneTrie(&store);
+    benchEnd(&timer);
+    if (failed) {
+        free(timer.times);
+        goto oom;
+    }
+    benchReport(out, &timer, "phone_trie", store.count, store.count);
+    for (int kind = 0; kind < 3; kind++) {
+        static const char *const operations[] = {"complete", "complete_phone", "caller_id"};
+        size_t positions[COMPLETE_DEFAULT_LIMIT];
+        int exact;
+        if (benchStart(&timer, queries) != 0) goto oom;
+        for (size_t i = 0; i < queries; i++) {
+            benchSample(&random, &store, kind == 0 ? FIELD_NAME : FIELD_PHONE, key, sizeof(key));
+            if (kind < 2) key[kind == 0 ? 3 : 6] = '\0';
+            else strncat(key, "42", sizeof(key) - strlen(key) - 1);
+            benchBegin(&timer);
+            if (kind == 0) storeCompleteName(&store, key, positions, COMPLETE_DEFAULT_LIMIT);
+            else if (kind == 1) storeCompletePhone(&store, key, positions, COMPLETE_DEFAULT_LIMIT);
+            else storeFindCaller(&store, key, &exact);
+            benchEnd(&timer);
+        }
+        benchReport(out, &timer, operations[kind], store.count, queries);
+    }
+
+    // search: part of a real name, long enough for the trigram index; search_short: two letters, which scan
+    // every name; scan_email: an email domain, which scans the email column; search_top10: two letters again,
+    // keeping only the first ten results in name order
+    struct ContactMatches matches;
+    struct OutputPage topTen = {0, 10, NULL};
+    matchesInit(&matches);
+    for (int kind = 0; kind < 4; kind++) {
+        static const char *const operations[] = {"search", "search_short", "scan_email", "search_top10"};
+        size_t samples = kind == 0 ? searches : scans;
+        if (benchStart(&timer, samples) != 0) goto oom;
+        for (size_t i = 0; i < samples; i++) {
+            int failed;
+            if (kind == 2) {
+                snprintf(key, sizeof(key), "@%s", benchDomains[benchPick(&random, BENCH_COUNT(benchDomains), 0)]);
+                benchBegin(&timer);
+                failed = storeScanField(&store, FIELD_EMAIL, key, &matches);
+            } else {
+                benchSample(&random, &store, FIELD_NAME, key, sizeof(key));
+                size_t length = strlen(key), want = kind == 0 ? 4 : 2;
+                size_t from = length > want ? benchPick(&random, length - want + 1, 0) : 0;
+                memmove(key, key + from, length - from + 1);
+                key[want < length ? want : length] = '\0';
+                benchBegin(&timer);
+                if (kind == 3) {
+                    struct HitPage hitPage;
+                    failed = searchPage(&store, key, FIELD_NAME, &topTen, &hitPage) != 0;
+                    if (!failed) free(hitPage.hits);
+                } else {
+                    failed = storeSearchName(&store, key, &matches);
+                }
+            }
+            benchEnd(&timer);
+            if (failed) {
+                free(timer.times);
+                matchesFree(&matches);
+                goto oom;
+            }
+        }
+        benchReport(out, &timer, operations[kind], store.count, samples);
+    }
+    matchesFree(&matches);
+
+    // list and list_jsonl: every contact in name order, formatted the way the list command prints them
+    FILE *sink = fopen("/dev/null", "w");
+    if (!sink) goto oom;
+    for (int kind = 0; kind < 2; kind++) {
+        struct OutBuf sinkOut;
+        struct OutputPage everything = {0, 0, NULL};
+        size_t last;
+        if (benchStart(&timer, 1) != 0) {
+            fclose(sink);
+            goto oom;
+        }
+        benchBegin(&timer);
+        outInit(&sinkOut, sink);
+        writeContactList(&store, "", "", &everything, kind == 0 ? OUTPUT_TSV : OUTPUT_JSONL, &sinkOut, &last);
+        outClose(&sinkOut);
+        benchEnd(&timer);
+        benchReport(out, &timer, kind == 0 ? "list" : "list_jsonl", store.count, store.count);
+    }
+    fclose(sink);
+
+    // edit: a new address for a random contact, validated the way editContact does
+    if (benchStart(&timer, queries) != 0) goto oom;
+    for (size_t i = 0; i < queries; i++) {
+        size_t pos = benchPick(&random, store.count, 0);
+        benchContact(&random, seed, i, &generated);
+        struct Contact contact = storeGet(&store, pos);
+        contact.address = generated.address;
+        benchBegin(&timer);
+        int failed = validateContact(&store, &contact, pos) != CONTACT_OK || storeUpdate(&store, pos, &contact) != 0;
+        benchEnd(&timer);
+        if (failed) {
+            free(timer.times);
+            goto oom;
+        }
+    }
+    benchReport(out, &timer, "edit", store.count, queries);
+
+    if (benchStart(&timer, 1) != 0) goto oom;
+    benchBegin(&timer);
+    failed = saveSnapshot(&store, snapPath);
+    benchEnd(&timer);
+    benchReport(out, &timer, "save", store.count, store.count);
+    if (failed) {
+        fprintf(stderr, "bench: failed to write %s\n", snapPath);
+        goto done;
+    }
+
+    if (benchStart(&timer, 1) != 0) goto oom;
+    benchBegin(&timer);
+    failed = loadSnapshot(&copy, snapPath) != 0;
+    benchEnd(&timer);
+    benchReport(out, &timer, "load", copy.count, copy.count);
+    storeFree(&copy);
+    if (failed) {
+        fprintf(stderr, "bench: failed to read %s back\n", snapPath);
+        goto done;
+    }
+
+    if (benchStart(&timer, 1) != 0) goto oom;
+    benchBegin(&timer);
+    failed = exportDelimitedFile(&store, csvPath, ',');
+    benchEnd(&timer);
+    benchReport(out, &timer, "export_csv", store.count, store.count);
+    if (failed) {
+        fprintf(stderr, "bench: failed to write %s\n", csvPath);
+        goto done;
+    }
+
+    struct ImportReport report;
+    if (benchStart(&timer, 1) != 0) goto oom;
+    benchBegin(&timer);
+    long imported = importDelimitedFile(&copy, csvPath, ',', &report);
+    benchEnd(&timer);
+    benchReport(out, &timer, "import_csv", copy.count, copy.count);
+    storeFree(&copy);
+    if (imported != (long)store.count) {
+        fprintf(stderr, "bench: imported %ld of %zu contacts back\n", imported, store.count);
+        goto done;
+    }
+
+    // delete: look the name up and remove it, as deleteContact does. At most half the book goes, so the
+    // later deletes aren't timed on a nearly empty store
+    size_t deletes = queries < size / 2 ? queries : size / 2 ? size / 2 : 1;
+    size_t before = store.count;
+    if (benchStart(&timer, deletes) != 0) goto oom;
+    for (size_t i = 0; i < deletes; i++) {
+        benchSample(&random, &store, FIELD_NAME, key, sizeof(key));
+        benchBegin(&timer);
+        size_t pos = storeFindByName(&store, key);
+        if (pos != CONTACT_NOT_FOUND) storeRemove(&store, pos);
+        benchEnd(&timer);
+    }
+    benchReport(out, &timer, "delete", before, deletes);
+
+    // add_reused: new contacts going into the slots those deletes freed, which first clears out the trigram
+    // entries the deleted names left behind
+    size_t reused = store.slots - store.count;
+    before = store.count;
+    if (reused > 0) {
+        if (benchStart(&timer, reused) != 0) goto oom;
+        for (size_t i = 0; i < reused; i++) {
+            benchContact(&random, seed, size + i, &generated);
+            struct Contact contact = { generated.name, generated.phone, generated.address, generated.email };
+            benchBegin(&timer);
+            enum ContactError error = validateContact(&store, &contact, CONTACT_NOT_FOUND);
+            if (error == CONTACT_DUPLICATE_NAME) {
+                size_t length = strlen(generated.name);
+                snprintf(generated.name + length, sizeof(generated.name) - length, " %zu", size + i);
+                error = validateContact(&store, &contact, CONTACT_NOT_FOUND);
+            }
+            size_t pos = error == CONTACT_OK ? storeInsert(&store, &contact) : CONTACT_NOT_FOUND;
+            benchEnd(&timer);
+            if (error != CONTACT_OK) {
+                fprintf(stderr, "bench: generated contact '%s' was rejected: %s\n", generated.name, contactErrorMessage(error));
+                free(timer.times);
+                goto done;
+            }
+            if (pos == CONTACT_NOT_FOUND) {
+                free(timer.times);
+                goto oom;
+            }
+        }
+        benchReport(out, &timer, "add_reused", before, reused);
+    }
+    status = 0;
+    goto done;
+
+oom:
+    fprintf(stderr, "Out of memory. Benchmark stopped.\n");
+done:
+    storeFree(&store);
+    storeFree(&copy);
+    unlink(snapPath);
+    unlink(csvPath);
+    if (fclose(out) != 0) status = 1;
+    if (status == 0) fprintf(stderr, "Benchmark results written to %s.\n", path);
+    return status;
+}
+
+// Set by SIGINT or SIGTERM to make the server stop accepting clients and shut down
+static volatile sig_atomic_t serveStopping;
+
+static void serveStop(int signal) {
+    (void)signal;
+    serveStopping = 1;
+}
+
+// State the server's threads share. The book is kept twice, left-right style: readers use the active replica
+// without taking any lock, while the one writer allowed at a time changes the other replica, switches readers
+// over to it, waits until no reader can still be on the old one, and then makes the same change there.
+// Readers never wait for a writer; a writer waits for the reads already in progress
+struct ServeState {
+    struct ContactStore *replicas[2]; // replicas[0] is the caller's store and the only one with a journal
+    atomic_int active;                // Replica new readers go to
+    atomic_int version;               // Read indicator new readers check in at
+    atomic_long readers[2];           // Readers checked in at each indicator that haven't left yet
+    atomic_int writerSleeping;        // Set while the writer sleeps on readersGone
+    pthread_mutex_t readersLock;      // Pairs with readersGone
+    pthread_cond_t readersGone;       // Signalled by the last reader to leave an indicator the writer sleeps on
+    pthread_mutex_t writeLock;        // Held by the writer
+    pthread_mutex_t clientsLock;      // Guards the client table
+    pthread_cond_t clientsGone;       // Signalled as each client thread ends
+    int clients[SERVE_MAX_CLIENTS];   // Connected sockets, -1 for a free slot
+    int clientCount;
+    int lagging;                      // Replica that missed a change and is rebuilt before the next write, -1 if none
+};
+
+// One connection and the slot it holds in the client table
+struct ServeClient {
+    struct ServeState *state;
+    int slot;
+    int fd;
+};
+
+// Check in as a reader; returns the indicator to check out of, and the replica to read is the active one after this
+static int serveReadBegin(struct ServeState *state) {
+    int version = atomic_load(&state->version);
+    atomic_fetch_add(&state->readers[version], 1);
+    return version;
+}
+
+// Check out again. Only the last reader out while the writer sleeps takes a lock, just long enough to wake it
+static void serveReadEnd(struct ServeState *state, int version) {
+    if (atomic_fetch_sub(&state->readers[version], 1) == 1 && atomic_load(&state->writerSleeping)) {
+        pthread_mutex_lock(&state->readersLock);
+        pthread_cond_broadcast(&state->readersGone);
+        pthread_mutex_unlock(&state->readersLock);
+    }
+}
+
+// Wait until every reader checked in at an indicator has left. Reads are short, so the writer yields a few times
+// first and only then sleeps. Setting writerSleeping before checking the count, as readers check out before
+// looking at the flag, means the last reader either sees the flag or the writer sees the count at zero
+static void serveWaitReaders(struct ServeState *state, int version) {
+    for (int spins = 0; spins < SERVE_WAIT_SPINS; spins++) {
+        if (atomic_load(&state->readers[version]) == 0) return;
+        sched_yield();
+    }
+    pthread_mutex_lock(&state->readersLock);
+    atomic_store(&state->writerSleeping, 1);
+    while (atomic_load(&state->readers[version]) > 0) pthread_cond_wait(&state->readersGone, &state->readersLock);
+    atomic_store(&state->writerSleeping, 0);
+    pthread_mutex_unlock(&state->readersLock);
+}
+
+// Answer a lookup, phone, search, complete or caller request: "OK count" and then that many contacts as TSV. A search
+// can carry a limit and a name to carry on after, as the search command's --limit and --after do, and a completion
+// a limit. The reply is built in memory so
+// the read is over before anything is sent, however slowly the client takes it
+static int serveRead(struct ServeState *state, int argc, char *argv[], int fd) {
+    char *body = NULL;
+    size_t bodySize = 0;
+    FILE *buffer = open_memstream(&body, &bodySize);
+    if (!buffer) return writeAll(fd, "ERR out of memory\n", 18);
+
+    struct OutBuf out;
+    outInit(&out, buffer);
+    int version = serveReadBegin(state);
+    const struct ContactStore *store = state->replicas[atomic_load(&state->active)];
+    long count = 0;
+    if (strcmp(argv[0], "search") == 0) {
+        struct OutputPage page = {0, argc > 2 ? strtoul(argv[2], NULL, 10) : 0, argc > 3 ? argv[3] : NULL};
+        size_t last;
+        count = argc >= 2 && argc <= 4 ? writeSearchResults(store, argv[1], FIELD_NAME, &page, OUTPUT_TSV, &out, &last) : -2;
+    } else if (strcmp(argv[0], "complete") == 0 && (argc == 2 || argc == 3)) {
+        size_t positions[COMPLETE_MAX_LIMIT], limit = argc > 2 ? strtoul(argv[2], NULL, 10) : COMPLETE_DEFAULT_LIMIT;
+        if (limit == 0 || limit > COMPLETE_MAX_LIMIT) limit = COMPLETE_MAX_LIMIT;
+        int byPhone = argv[1][0] == '+' || isdigit((unsigned char)argv[1][0]);
+        count = (long)(byPhone ? storeCompletePhone(store, argv[1], positions, limit)
+                               : storeCompleteName(store, argv[1], positions, limit));
+        for (long i = 0; i < count; i++) {
+            struct Contact contact = storeGet(store, positions[i]);
+            outDelimitedRecord(&out, &contact, '\t');
+        }
+    } else if (argc == 2) {
+        int exact;
+        size_t pos = argv[0][0] == 'l' ? storeFindByName(store, argv[1])
+                   : argv[0][0] == 'p' ? storeFindByPhone(store, argv[1]) : storeFindCaller(store, argv[1], &exact);
+        if (pos != CONTACT_NOT_FOUND) {
+            struct Contact contact = storeGet(store, pos);
+            outDelimitedRecord(&out, &contact, '\t');
+            count = 1;
+        }
+    } else {
+        count = -2;
+    }
+    serveReadEnd(state, version);
+
+    int status, failed = outClose(&out) != 0;
+    if (fclose(buffer) != 0 || failed || count == -1) {
+        status = writeAll(fd, "ERR out of memory\n", 18);
+    } else if (count == -2) {
+        status = writeAll(fd, "ERR wrong number of fields\n", 27);
+    } else {
+        char head[32];
+        int length = snprintf(head, sizeof(head), "OK %ld\n", count);
+        status = writeAll(fd, head, (size_t)length) != 0 || writeAll(fd, body, bodySize) != 0 ? -1 : 0;
+    }
+    free(body);
+    return status;
+}
+
+// Answer a stats request with the statistics table, one line per row
+static int serveStats(int fd) {
+    char *body = NULL;
+    size_t bodySize = 0;
+    FILE *buffer = open_memstream(&body, &bodySize);
+    if (!buffer) return writeAll(fd, "ERR out of memory\n", 18);
+    statsPrint(buffer);
+    int status;
+    if (fclose(buffer) != 0) {
+        status = writeAll(fd, "ERR out of memory\n", 18);
+    } else {
+        long lines = 0;
+        for (size_t i = 0; i < bodySize; i++) lines += body[i] == '\n';
+        char head[32];
+        int length = snprintf(head, sizeof(head), "OK %ld\n", lines);
+        status = writeAll(fd, head, (size_t)length) != 0 || writeAll(fd, body, bodySize) != 0 ? -1 : 0;
+    }
+    free(body);
+    return status;
+}
+
+// Make one change to one replica, running the same checks as the commands. Returns NULL or why it was refused
+static const char *serveApply(struct ContactStore *store, enum JournalOp op, const char *key, const struct Contact *contact) {
+    size_t pos = key ? storeFindByName(store, key) : CONTACT_NOT_FOUND;
+    if (key && pos == CONTACT_NOT_FOUND) return "no such contact";
+    if (op != JOURNAL_DELETE) {
+        enum ContactError error = validateContact(store, contact, pos);
+        if (error != CONTACT_OK) return contactErrorMessage(error);
+    }
+    if (op == JOURNAL_ADD) return storeInsert(store, contact) == CONTACT_NOT_FOUND ? "out of memory" : NULL;
+    if (op == JOURNAL_EDIT) return storeUpdate(store, pos, contact) != 0 ? "out of memory" : NULL;
+    return storeRemove(store, pos) != 0 ? "out of memory" : NULL;
+}
+
+// Send new readers to the replica that isn't `active`, then wait until none can still be on `active`
+static void serveSwitch(struct ServeState *state, int active) {
+    atomic_store(&state->active, !active);
+    // Readers that checked in before the switch may still be on the old replica. Flip the indicator new
+    // readers use, waiting for the other one to drain first, then wait out everyone on the old one
+    int version = atomic_load(&state->version);
+    serveWaitReaders(state, !version);
+    atomic_store(&state->version, !version);
+    serveWaitReaders(state, version);
+}
+
+// Rebuild the lagging replica as a copy of the other one. No reader is on it, and it's emptied first so the copy
+// doesn't need room for both. It keeps its own journal and LSN. Returns 0, or -1 if out of memory with it still lagging
+static int serveResync(struct ServeState *state) {
+    struct ContactStore *lagging = state->replicas[state->lagging];
+    struct Journal *journal = lagging->journal;
+    uint64_t lsn = lagging->lsn;
+    lagging->journal = NULL;
+    storeFree(lagging);
+    int failed = storeCopy(lagging, state->replicas[!state->lagging]) != 0 || storeBuildPhoneTrie(lagging) != 0;
+    lagging->journal = journal;
+    lagging->lsn = lsn;
+    if (failed) return -1;
+    state->lagging = -1;
+    return 0;
+}
+
+// Make a change to both replicas and commit it to the journal. Returns NULL or why it was refused
+static const char *serveWrite(struct ServeState *state, enum JournalOp op, const char *key, const struct Contact *contact) {
+    pthread_mutex_lock(&state->writeLock);
+    if (state->lagging >= 0 && serveResync(state) != 0) {
+        pthread_mutex_unlock(&state->writeLock);
+        return "out of memory";
+    }
+    int active = atomic_load(&state->active);
+    const char *error = serveApply(state->replicas[!active], op, key, contact);
+    if (!error) {
+        serveSwitch(state, active); // New readers see the change from here on
+        if (serveApply(state->replicas[active], op, key, contact) != NULL) {
+            // There's no undoing the change readers can already see, so the old replica is rebuilt from the new one
+            // instead, now or before the next write. A failed change never reached the journal, which only the
+            // caller's store keeps, so if that was the one it's logged here
+            fprintf(stderr, "Out of memory while updating the server's second copy of the book; rebuilding it.\n");
+            if (active == 0) journalLog(state->replicas[0], op, key, op == JOURNAL_DELETE ? NULL : contact);
+            state->lagging = active;
+            serveResync(state);
+        }
+        if (journalCommit(state->replicas[0]) != 0) error = "could not write the journal";
+        // Requests find contacts by name, so no position outlives one and the replicas can be compacted the
+        // same way as a change: the idle one first, then the other once readers have moved off it
+        if (op == JOURNAL_DELETE && state->lagging < 0 && storeCompactDue(state->replicas[active])) {
+            storeCompact(state->replicas[active]);
+            serveSwitch(state, !active);
+            storeCompact(state->replicas[!active]);
+        }
+    }
+    pthread_mutex_unlock(&state->writeLock);
+    return error;
+}
+
+// Serve one client until it disconnects: one request per line, fields separated by tabs as in batch mode
+static void *serveClient(void *arg) {
+    struct ServeClient *client = arg;
+    struct ServeState *state = client->state;
+    int fd = client->fd;
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL;
+    size_t lineCap = 0;
+    char *args[BATCH_MAX_ARGS];
+    while (in && getline(&line, &lineCap, in) != -1) {
+        line[strcspn(line, "\r\n")] = 0;
+        int argc = 0;
+        for (char *field = line; field && argc < BATCH_MAX_ARGS; argc++) {
+            args[argc] = field;
+            field = strchr(field, '\t');
+            if (field) *field++ = '\0';
+        }
+
+        int status;
+        const char *request = args[0];
+        if (strcmp(request, "lookup") == 0 || strcmp(request, "phone") == 0 || strcmp(request, "search") == 0 ||
+            strcmp(request, "complete") == 0 || strcmp(request, "caller") == 0) {
+            status = serveRead(state, argc, args, fd);
+        } else if (strcmp(request, "add") == 0 || strcmp(request, "edit") == 0 || strcmp(request, "delete") == 0) {
+            enum JournalOp op = request[0] == 'a' ? JOURNAL_ADD : request[0] == 'e' ? JOURNAL_EDIT : JOURNAL_DELETE;
+            int keyed = op != JOURNAL_ADD;
+            struct Contact contact;
+            const char *error = "wrong number of fields";
+            if (argc == (op == JOURNAL_DELETE ? 2 : keyed + 5)) {
+                if (op != JOURNAL_DELETE) contactFromArgs(&contact, args + 1 + keyed);
+                error = serveWrite(state, op, keyed ? args[1] : NULL, &contact);
+            }
+            char reply[128];
+            int length = error ? snprintf(reply, sizeof(reply), "ERR %s\n", error) : snprintf(reply, sizeof(reply), "OK 0\n");
+            status = writeAll(fd, reply, (size_t)length);
+        } else if (strcmp(request, "stats") == 0 && argc == 1) {
+            status = serveStats(fd);
+        } else {
+            status = writeAll(fd, "ERR unknown request\n", 20);
+        }
+        if (status != 0) break; // The client has gone
+    }
+    free(line);
+    STATS_THREAD_DONE();
+
+    pthread_mutex_lock(&state->clientsLock);
+    state->clients[client->slot] = -1;
+    state->clientCount--;
+    if (in) fclose(in); // Closes the socket too; done under the lock so shutdown never hits a reused descriptor
+    else close(fd);
+    pthread_cond_signal(&state->clientsGone);
+    pthread_mutex_unlock(&state->clientsLock);
+    free(client);
+    return NULL;
+}
+
+// Listen on a Unix socket at `path` and serve the store to up to SERVE_MAX_CLIENTS local clients at once until
+// SIGINT or SIGTERM. Requests are lookup NAME, phone NUMBER, search TEXT [LIMIT [AFTER]], complete PREFIX [LIMIT],
+// caller NUMBER and stats, answered with "OK count" and that many lines (contacts as TSV), and add, edit and delete
+// with the same fields as the commands, answered with "OK 0" or "ERR reason". Changes are journaled like any other,
+// and the journal is compacted by the writer rather than a forked child. Returns 0 after a clean shutdown
+int runServer(struct ContactStore *store, const char *path) {
+    struct ServeState state;
+    struct ContactStore copy;
+    storeInit(&copy);
+    // Readers can't build the phone trie on demand, so both replicas get theirs up front
+    if (storeCopy(&copy, store) != 0 || storeBuildPhoneTrie(store) != 0 || storeBuildPhoneTrie(&copy) != 0) {
+        fprintf(stderr, "Out of memory. Cannot start the server.\n");
+        storeFree(&copy);
+        return 1;
+    }
+    if (store->journal) {
+        journalFinishCompaction(store, 1); // A child forked before any thread started is fine to wait for
+        store->journal->inlineCompaction = 1;
+    }
+    state.replicas[0] = store;
+    state.replicas[1] = &copy;
+    atomic_init(&state.active, 0);
+    atomic_init(&state.version, 0);
+    atomic_init(&state.readers[0], 0);
+    atomic_init(&state.readers[1], 0);
+    pthread_mutex_init(&state.writeLock, NULL);
+    pthread_mutex_init(&state.clientsLock, NULL);
+    pthread_cond_init(&state.clientsGone, NULL);
+    atomic_init(&state.writerSleeping, 0);
+    pthread_mutex_init(&state.readersLock, NULL);
+    pthread_cond_init(&state.readersGone, NULL);
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) state.clients[i] = -1;
+    state.clientCount = 0;
+    state.lagging = -1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        storeFree(&copy);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // A socket left behind by a server that didn't shut down cleanly
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SERVE_BACKLOG) != 0) {
+        perror(path);
+        if (listener >= 0) close(listener);
+        storeFree(&copy);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept() and the loop gets to see serveStopping
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serveStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up mid-reply is reported by write() instead
+    sigset_t stopSignals, previous;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    fprintf(stderr, "Serving %zu contacts on %s.\n", store->count, path);
+
+    while (!serveStopping) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue; // Interrupted, or a client that gave up while queued
+
+        pthread_mutex_lock(&state.clientsLock);
+        int slot = 0;
+        while (slot < SERVE_MAX_CLIENTS && state.clients[slot] >= 0) slot++;
+        if (slot < SERVE_MAX_CLIENTS) {
+            state.clients[slot] = fd;
+            state.clientCount++;
+        }
+        pthread_mutex_unlock(&state.clientsLock);
+        struct ServeClient *client = slot < SERVE_MAX_CLIENTS ? malloc(sizeof(*client)) : NULL;
+        pthread_t thread;
+        int started = 0;
+        if (client) {
+            client->state = &state;
+            client->slot = slot;
+            client->fd = fd;
+            pthread_sigmask(SIG_BLOCK, &stopSignals, &previous); // Only this thread should be woken by them
+            started = pthread_create(&thread, NULL, serveClient, client) == 0;
+            pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        }
+        if (started) {
+            pthread_detach(thread);
+            continue;
+        }
+        writeAll(fd, "ERR server busy\n", 16);
+        free(client);
+        pthread_mutex_lock(&state.clientsLock);
+        if (slot < SERVE_MAX_CLIENTS) {
+            state.clients[slot] = -1;
+            state.clientCount--;
+        }
+        close(fd);
+        pthread_mutex_unlock(&state.clientsLock);
+    }
+
+    close(listener);
+    unlink(path);
+    // Hang up on every client so its thread sees end of input, and wait for them all before the store goes
+    pthread_mutex_lock(&state.clientsLock);
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+        if (state.clients[i] >= 0) shutdown(state.clients[i], SHUT_RDWR);
+    while (state.clientCount > 0) pthread_cond_wait(&state.clientsGone, &state.clientsLock);
+    pthread_mutex_unlock(&state.clientsLock);
+    fprintf(stderr, "Server stopped.\n");
+    if (state.lagging == 0) { // The caller's store missed a change; hand it the copy instead, which can't fail
+        struct Journal *journal = store->journal;
+        uint64_t lsn = store->lsn;
+        storeFree(store);
+        *store = copy;
+        store->journal = journal;
+        store->lsn = lsn;
+        storeInit(&copy);
+    }
+    if (store->journal) store->journal->inlineCompaction = 0;
+    storeFree(&copy);
+    return 0;
+}
+
+// One load generator connection and what it measured
+struct LoadClient {
+    const char *path;
+    int id;
+    long requests;
+    int writePercent;
+    uint64_t *readTimes;  // Nanoseconds per read request
+    uint64_t *writeTimes; // Nanoseconds per write request
+    size_t reads;
+    size_t writes;
+    long errors;
+    int failed;           // Couldn't connect or the server hung up
+};
+
+// Send one request and read the whole reply; returns 0 for OK, 1 for ERR, -1 if the connection broke
+static int loadRequest(int fd, FILE *in, char **line, size_t *lineCap, const char *request) {
+    if (writeAll(fd, request, strlen(request)) != 0 || getline(line, lineCap, in) == -1) return -1;
+    if (strncmp(*line, "OK ", 3) != 0) return 1;
+    for (long rows = atol(*line + 3); rows > 0; rows--)
+        if (getline(line, lineCap, in) == -1) return -1;
+    return 0;
+}
+
+// Run one client: add LOADGEN_KEYS contacts of its own, send `requests` random requests about them (edits for
+// writePercent of them, otherwise mostly lookups with some phone lookups and searches), then delete them again
+static void *loadClient(void *arg) {
+    struct LoadClient *client = arg;
+    struct BenchRandom random = {(uint64_t)client->id * 0x9e3779b97f4a7c15ULL + (uint64_t)getpid()};
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", client->path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    FILE *in = NULL;
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || !(in = fdopen(fd, "r"))) {
+        if (fd >= 0) close(fd);
+        client->failed = 1;
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    char request[256];
+    int pid = (int)getpid() % 100000;
+    for (int key = 0; key < LOADGEN_KEYS && !client->failed; key++) {
+        snprintf(request, sizeof(request), "add\tLoad %d %d %d\t+99%05d%03d%04d\t%d Test Street\tload%d@example.com\n",
+                 pid, client->id, key, pid, client->id, key, key, key);
+        int status = loadRequest(fd, in, &line, &lineCap, request);
+        if (status < 0) client->failed = 1;
+        else if (status > 0) client->errors++;
+    }
+
+    for (long i = 0; i < client->requests && !client->failed; i++) {
+        int key = (int)benchPick(&random, LOADGEN_KEYS, 0);
+        int write = (int)benchPick(&random, 100, 0) < client->writePercent;
+        size_t kind = benchPick(&random, 10, 0);
+        if (write)
+            snprintf(request, sizeof(request), "edit\tLoad %d %d %d\tLoad %d %d %d\t+99%05d%03d%04d\t%ld Test Street\tload%d@example.com\n",
+                     pid, client->id, key, pid, client->id, key, pid, client->id, key, i, key);
+        else if (kind == 0)
+            snprintf(request, sizeof(request), "search\tLoad %d %d %d\n", pid, client->id, key);
+        else if (kind == 1)
+            snprintf(request, sizeof(request), "phone\t+99%05d%03d%04d\n", pid, client->id, key);
+        else
+            snprintf(request, sizeof(request), "lookup\tLoad %d %d %d\n", pid, client->id, key);
+        uint64_t started = benchNow();
+        int status = loadRequest(fd, in, &line, &lineCap, request);
+        uint64_t elapsed = benchNow() - started;
+        if (status < 0) client->failed = 1;
+        else if (status > 0) client->errors++;
+        if (write) client->writeTimes[client->writes++] = elapsed;
+        else client->readTimes[client->reads++] = elapsed;
+    }
+
+    for (int key = 0; key < LOADGEN_KEYS && !client->failed; key++) {
+        snprintf(request, sizeof(request), "delete\tLoad %d %d %d\n", pid, client->id, key);
+        if (loadRequest(fd, in, &line, &lineCap, request) < 0) client->failed = 1;
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+// Print a throughput and latency line for one kind of request, gathered from every client
+static void loadReport(const char *kind, struct LoadClient *clients, int count, int writes, double seconds) {
+    size_t total = 0;
+    for (int c = 0; c < count; c++) total += writes ? clients[c].writes : clients[c].reads;
+    uint64_t *times = malloc((total ? total : 1) * sizeof(*times));
+    if (!times) return;
+    size_t at = 0;
+    for (int c = 0; c < count; c++) {
+        size_t n = writes ? clients[c].writes : clients[c].reads;
+        memcpy(times + at, writes ? clients[c].writeTimes : clients[c].readTimes, n * sizeof(*times));
+        at += n;
+    }
+    qsort(times, total, sizeof(*times), benchCompareTimes);
+    printf("%-6s %10zu %12.0f %10.1f %10.1f %10.1f\n", kind, total, seconds > 0 ? total / seconds : 0.0,
+           total ? times[(total - 1) / 2] / 1e3 : 0.0, total ? times[(total - 1) * 99 / 100] / 1e3 : 0.0,
+           total ? times[total - 1] / 1e3 : 0.0);
+    free(times);
+}
+
+// Drive a running server with `clients` concurrent connections sending `requests` requests each, and print
+// the request rate and latencies. Returns 0 if every client ran to the end without a broken connection
+int runLoadgen(const char *path, int clients, long requests, int writePercent) {
+    signal(SIGPIPE, SIG_IGN);
+    struct LoadClient *load = calloc((size_t)clients, sizeof(*load));
+    pthread_t *threads = calloc((size_t)clients, sizeof(*threads));
+    int status = 0, started = 0;
+    if (!load || !threads) status = -1;
+    for (int c = 0; c < clients && status == 0; c++) {
+        load[c].path = path;
+        load[c].id = c;
+        load[c].requests = requests;
+        load[c].writePercent = writePercent;
+        load[c].readTimes = malloc((size_t)requests * sizeof(uint64_t));
+        load[c].writeTimes = malloc((size_t)requests * sizeof(uint64_t));
+        if (!load[c].readTimes || !load[c].writeTimes) status = -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Out of memory. Cannot run the load generator.\n");
+    } else {
+        uint64_t begin = benchNow();
+        for (; started < clients; started++)
+            if (pthread_create(&threads[started], NULL, loadClient, &load[started]) != 0) break;
+        for (int c = 0; c < started; c++) pthread_join(threads[c], NULL);
+        double seconds = (benchNow() - begin) / 1e9;
+
+        long errors = 0;
+        int failed = started < clients ? clients - started : 0;
+        for (int c = 0; c < started; c++) {
+            errors += load[c].errors;
+            failed += load[c].failed;
+        }
+        printf("%d clients, %ld requests each, %d%% writes, %.3f s\n", clients, requests, writePercent, seconds);
+        printf("%-6s %10s %12s %10s %10s %10s\n", "kind", "requests", "per second", "p50 us", "p99 us", "max us");
+        loadReport("read", load, started, 0, seconds);
+        loadReport("write", load, started, 1, seconds);
+        if (errors > 0) printf("%ld requests were refused by the server\n", errors);
+        if (failed > 0) {
+            fprintf(stderr, "%d clients couldn't connect to %s or lost the connection.\n", failed, path);
+            status = 1;
+        }
+    }
+    for (int c = 0; load && c < clients; c++) {
+        free(load[c].readTimes);
+        free(load[c].writeTimes);
+    }
+    free(load);
+    free(threads);
+    return status != 0;
+}
@@ -1,33 +1,469 @@
 // contactManagement.h
 // Header file for Contact Management System
+// Build with: cc -std=c11 -O2 -pthread contactManagement.c -o contactManagement
 
 #ifndef CONTACTMANAGEMENT_H
 #define CONTACTMANAGEMENT_H
 
-// Maximum limits for contact list and field lengths
-#define MAX_CONTACTS 100    // Maximum number of contacts
-#define MAX_NAME_LEN 30     // Maximum length of contact name
-#define MAX_ADDRESS_LEN 50  // Maximum length of contact address
-#define MAX_EMAIL_LEN 30    // Maximum length of contact email
-#define MAX_PHONE_LEN 20    // Maximum length of phone number
+#include <stddef.h>  // For size_t
+#include <stdint.h>  // For fixed-width integer types used by the indexes
+#include <sys/types.h> // For pid_t
 
-// Structure for storing contact details
+// A contact's details as NUL-terminated strings of any length. Contacts handed to the store are copied
+// into it; contacts read back from the store point into its string heaps and stay valid until it changes
 struct Contact {
-    char phone[MAX_PHONE_LEN];      // Phone number 
-    char name[MAX_NAME_LEN];        // Contact name
-    char address[MAX_ADDRESS_LEN];  // Contact address
-    char email[MAX_EMAIL_LEN];      // Contact email
+    const char *name;     // Contact name
+    const char *phone;    // Phone number
+    const char *address;  // Contact address
+    const char *email;    // Contact email
 };
 
+// Fields are stored column by column; the folded name is a lowercase copy of the name for search and sorting
+enum ContactField {
+    FIELD_NAME,
+    FIELD_PHONE,
+    FIELD_ADDRESS,
+    FIELD_EMAIL,
+    FIELD_FOLDED_NAME,
+    FIELD_COUNT
+};
+
+// One field of every contact: a heap of NUL-terminated strings and each record's offset into it.
+// Replaced strings are left in the heap as garbage until there is enough of it to be worth compacting
+struct StringColumn {
+    uint32_t *offsets; // Heap offset of each record's string
+    char *heap;        // The strings, back to back
+    size_t heapSize;   // Bytes of the heap in use
+    size_t heapCap;    // Bytes allocated for the heap
+    size_t garbage;    // Bytes in use by strings no record points at any more
+};
+
+#define COLUMN_MIN_HEAP 4096             // First heap allocation of a column
+#define COLUMN_MAX_HEAP UINT32_MAX       // Offsets are 32 bits, so a heap can't grow past this
+#define COLUMN_COMPACT_MIN (64 << 10)    // Garbage a column must have before it's worth compacting
+#define SCAN_MAX_GAP 4096                // Widest gap between neighbouring records' strings that a scan reads through
+
+#define CONTACT_NOT_FOUND ((size_t)-1) // Returned by lookups that find nothing
+#define STORE_COMPACT_MIN 4096         // Deleted records a store must have before it's worth compacting
+
+// Hash indexes grow once they are 70% full so probe sequences stay short
+#define HASH_INDEX_MIN_CAP 64   // Smallest table allocated
+#define HASH_INDEX_LOAD_NUM 7   // Maximum load factor numerator
+#define HASH_INDEX_LOAD_DEN 10  // Maximum load factor denominator
+
+// Which contact field a hash index is keyed on
+enum HashIndexKey {
+    INDEX_BY_NAME,  // Case-folded name
+    INDEX_BY_PHONE  // Normalized phone number (no '+' or '00' prefix)
+};
+
+// Open-addressing (linear probing) hash index from a contact field to its store position
+struct HashIndex {
+    enum HashIndexKey key; // Field this index is keyed on
+    uint32_t *slots;       // Store position + 1 for each slot, 0 marks an empty slot
+    uint32_t *hashes;      // Cached hash of each occupied slot so rehashing never re-reads contacts
+    size_t cap;            // Number of slots, always a power of two
+    size_t used;           // Number of occupied slots
+};
+
+// Posting list for one trigram (three consecutive lowercase bytes of a name)
+struct TrigramPosting {
+    uint32_t key;        // The trigram packed into 24 bits, 0 marks an empty table slot
+    uint32_t count;      // Number of store positions in the list
+    uint32_t cap;        // Capacity of the positions array
+    uint32_t *positions; // Store positions of every name containing the trigram, kept sorted
+};
+
+// Inverted index from trigram to the names containing it, used to narrow substring searches
+struct TrigramIndex {
+    struct TrigramPosting *table; // Open-addressing table of posting lists
+    size_t cap;                   // Number of table slots, always a power of two
+    size_t used;                  // Number of distinct trigrams seen
+};
+
+// Typo-tolerant name search uses a BK-tree over the distinct case-folded words of every name. Each node hangs off
+// its parent by its edit distance to it, and edit distance obeys the triangle inequality, so a search within k of
+// a word only has to visit the children whose distance to their parent is within k of the word's own
+#define FUZZY_MAX_WORD 32        // Words are cut to this many bytes, both in names and in queries
+#define FUZZY_MAX_DISTANCE 3     // Largest edit distance a query may ask for per word
+#define FUZZY_MAX_QUERY_WORDS 8  // Words of a query past this many are ignored
+#define FUZZY_NO_NODE UINT32_MAX // Marks a missing node
+#define FUZZY_MENU_RESULTS 20    // Closest matches the menu's fuzzy search shows
+
+// One distinct word and the names it appears in
+struct FuzzyNode {
+    uint32_t word;       // Offset of the word in the index's word heap
+    uint16_t distance;   // Edit distance to the parent node; 0 for the root
+    uint16_t length;     // Length of the word
+    uint32_t child;      // First child, FUZZY_NO_NODE if none
+    uint32_t sibling;    // Next child of the same parent, FUZZY_NO_NODE at the end
+    uint32_t count;      // Number of store positions in the list
+    uint32_t cap;        // Capacity of the positions array
+    uint32_t *positions; // Store positions of every name with the word, kept sorted; may empty out, nodes are never removed
+};
+
+// BK-tree of name words with a hash table for finding a word's node directly. It's built the first time a
+// fuzzy search runs and kept up to date from then on; until then changes to the store don't touch it
+struct FuzzyIndex {
+    struct FuzzyNode *nodes; // Node 0 is the root
+    size_t count;            // Number of nodes
+    size_t cap;              // Capacity of the nodes array
+    uint32_t *slots;         // Node + 1 for each slot of an open-addressing table keyed on the word, 0 when empty
+    size_t slotCap;          // Number of slots, always a power of two
+    char *words;             // Every node's word, NUL-terminated, back to back
+    size_t wordsSize;        // Bytes of the word heap in use
+    size_t wordsCap;         // Bytes allocated for it
+    int built;               // Set once the index covers every contact
+};
+
+// One result of a fuzzy search
+struct FuzzyMatch {
+    size_t pos;        // Store position of the contact
+    unsigned distance; // Edit distance from each query word to the closest word of the name, added up
+};
+
+// Caller ID and phone completion use a radix trie over phone keys: the digits of a number after its '+' or '00',
+// the same form the phone index uses. Each node holds the run of digits on the edge into it, so a lookup reads
+// each digit of the number once. A run longer than a node holds takes a chain of nodes
+#define PHONE_TRIE_LABEL 11           // Digits a node holds
+#define PHONE_TRIE_MAX_KEY 32         // Digits of a phone key that are indexed; E.164 numbers have at most 15
+#define PHONE_TRIE_NONE UINT32_MAX    // Marks a missing node
+#define COMPLETE_DEFAULT_LIMIT 10     // Completions listed when no count is given
+#define COMPLETE_MAX_LIMIT 1000       // Most completions one request may ask for
+
+// One node of the phone trie
+struct PhoneTrieNode {
+    char label[PHONE_TRIE_LABEL]; // Digits on the edge from the parent; the root's is empty
+    uint8_t length;               // Number of digits in the label
+    uint32_t parent;              // Parent node, PHONE_TRIE_NONE for the root
+    uint32_t child;               // First child; children are kept sorted by their first digit
+    uint32_t sibling;             // Next child of the same parent, or the next free node
+    uint32_t pos;                 // Store position + 1 of the contact whose phone key ends here, 0 if none
+};
+
+// Radix trie of phone keys. Like the word index it's built the first time it's needed and kept up to date from
+// then on; until then changes to the store don't touch it
+struct PhoneTrie {
+    struct PhoneTrieNode *nodes; // Node 0 is the root
+    size_t count;                // Nodes allocated from the array, free ones included
+    size_t cap;                  // Capacity of the nodes array
+    uint32_t freeNodes;          // First node of the free list, PHONE_TRIE_NONE if empty
+    size_t freeCount;            // Nodes on the free list
+    int built;                   // Set once the trie covers every contact
+};
+
+// The ordered index is a sorted list of store positions split into blocks (a two-level B+tree),
+// so inserting or removing a contact only shifts entries inside one block
+#define ORDER_BLOCK_CAP 256 // Maximum positions per block
+
+// One block of the ordered index
+struct OrderBlock {
+    uint32_t count;                       // Number of positions in the block
+    uint32_t positions[ORDER_BLOCK_CAP];  // Store positions sorted by case-folded name
+};
+
+// Every contact in alphabetical order without ever moving a record
+struct OrderIndex {
+    struct OrderBlock **blocks; // Blocks in order; every block except when empty holds at least one entry
+    size_t blockCount;          // Number of blocks in use
+    size_t blockCap;            // Capacity of the blocks array
+    struct OrderBlock *spare;   // Set aside by orderIndexReserve for the next new block, NULL if none
+};
+
+// Position within the ordered index, used to walk contacts alphabetically
+struct OrderCursor {
+    size_t block;  // Block number
+    size_t offset; // Entry within the block
+};
+
+// Growable list of store positions filled in by searches
+struct ContactMatches {
+    size_t *positions; // Matching store positions
+    size_t count;      // Number of matches
+    size_t cap;        // Capacity of the positions array
+};
+
+// Growable contact store; there is no fixed cap, each column grows by doubling. A contact's position is its
+// handle: deleting a record only marks it deleted and puts its slot on a free list for the next insert to reuse,
+// so positions stay put until storeCompact squeezes the deleted ones out. Nothing in the store compacts on its own:
+// callers that hold no positions do it when storeCompactDue says so, namely journal replay, the menu after a
+// delete, batch mode after each line and the server's writer between replica switches. Any position held
+// across one of those is invalid afterwards
+struct ContactStore {
+    struct StringColumn columns[FIELD_COUNT]; // The contacts, one column per field
+    size_t count;                // Number of contacts currently stored
+    size_t slots;                // Records in the columns, deleted ones included; positions run up to this
+    size_t cap;                  // Records the columns' offset arrays have room for
+    unsigned char *deleted;      // One flag per record, set while it's deleted; NULL until the first delete
+    uint32_t *freeSlots;         // Positions of the slots - count deleted records, the most recent last
+    struct HashIndex nameIndex;  // Case-insensitive name lookups and duplicate checks
+    struct HashIndex phoneIndex; // Normalized phone lookups and duplicate checks
+    struct TrigramIndex nameTrigrams; // Substring search over case-folded names
+    struct FuzzyIndex nameWords; // Typo-tolerant search over the words of names, built on first use
+    struct PhoneTrie phoneTrie;  // Caller ID and phone completion, built on first use
+    struct OrderIndex order;     // Contacts sorted by case-folded name
+    struct Journal *journal;     // Where changes are logged, NULL while loading or replaying
+    uint64_t lsn;                // Sequence number of the last journaled change applied to the store
+    int threads;                 // Threads bulk imports may use
+};
+
+// Files the contact book is kept in
+#define SNAPSHOT_FILE "contacts.snap"   // Binary snapshot loaded at startup and written on exit
+#define LEGACY_TEXT_FILE "contacts.txt" // Old four-lines-per-contact text format, imported if no snapshot exists
+#define JOURNAL_FILE "contacts.journal" // Append-only log of changes made since the snapshot
+
+// Command mode limits
+#define IMPORT_MAX_REPORTED 10 // Rejected records printed individually during an import; the rest are only counted
+#define BATCH_MAX_ARGS 16      // Most tab-separated arguments a batch line can have, command included
+#define IMPORT_CHUNK_BYTES (1 << 20) // Imports are split into chunks of about this size for the worker threads
+#define IMPORT_MAX_THREADS 64        // Upper limit for -j
+
+// Instrumentation: call counts and latency histograms for each operation plus index counters, shown by the
+// stats command. On by default; build with -DCM_ENABLE_STATS=0 to compile all of it out
+#ifndef CM_ENABLE_STATS
+#define CM_ENABLE_STATS 1
+#endif
+#define STAT_BUCKETS 40 // Latency bucket b counts times from 2^b up to 2^(b+1) ns; the last one takes anything slower
+
+// Operations that are timed
+enum StatOperation {
+    STAT_OP_ADD,     // storeInsert, including journal replay on startup
+    STAT_OP_SEARCH,  // Substring searches, indexed or scanned
+    STAT_OP_SORT,    // Sorting search results for display
+    STAT_OP_LIST,    // Printing the book or a range of it
+    STAT_OP_EDIT,    // storeUpdate
+    STAT_OP_DELETE,  // storeRemove
+    STAT_OP_LOAD,    // Loading the book at startup, journal replay included
+    STAT_OP_SAVE,    // Writing a snapshot
+    STAT_OP_COMMIT,  // Writing and syncing buffered journal records
+    STAT_OP_IMPORT,  // Bulk imports
+    STAT_OP_FUZZY,   // Typo-tolerant name searches, including building the index the first time
+    STAT_OP_COMPLETE, // Name and phone completions
+    STAT_OP_CALLER,  // Caller ID lookups
+    STAT_OPERATION_COUNT
+};
+
+// Event counters
+enum StatCounter {
+    STAT_NAME_HITS,          // Name index lookups that found a contact
+    STAT_NAME_MISSES,        // ... and that didn't
+    STAT_PHONE_HITS,         // Phone index lookups that found a contact
+    STAT_PHONE_MISSES,       // ... and that didn't
+    STAT_HASH_PROBES,        // Slots looked at by those lookups; divided by the lookups it's the mean probe length
+    STAT_DUPLICATES,         // Contacts refused for a duplicate name or phone
+    STAT_TRIGRAM_SEARCHES,   // Searches narrowed down by the trigram index
+    STAT_TRIGRAM_CANDIDATES, // Names those searches had to check
+    STAT_SCAN_SEARCHES,      // Searches that scanned a whole column
+    STAT_SEARCH_MATCHES,     // Contacts returned by all searches
+    STAT_COMPACTIONS,        // Column heaps compacted
+    STAT_STORE_COMPACTIONS,  // Stores compacted to squeeze out deleted records
+    STAT_SLOTS_REUSED,       // Contacts added in the slot of a deleted one
+    STAT_JOURNAL_BYTES,      // Bytes written to the journal
+    STAT_FUZZY_VISITS,       // Words fuzzy searches compared the query with
+    STAT_COUNTER_COUNT
+};
+
+// Latency histogram of one operation
+struct StatHistogram {
+    uint64_t calls;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[STAT_BUCKETS];
+};
+
+// Everything the instrumentation collects; each thread fills in its own and statsPrint adds them up
+struct Stats {
+    struct StatHistogram operations[STAT_OPERATION_COUNT];
+    uint64_t counters[STAT_COUNTER_COUNT];
+};
+
+// Server mode
+#define SERVE_SOCKET_FILE "contacts.sock" // Unix socket `serve` listens on and `loadgen` connects to
+#define SERVE_MAX_CLIENTS 256             // Clients served at once; more are turned away
+#define SERVE_BACKLOG 64                  // Connections the kernel queues before they're accepted
+#define SERVE_WAIT_SPINS 64               // Times a writer yields to readers before it sleeps until they're gone
+#define LOADGEN_KEYS 100                  // Contacts each load generator client adds and then queries
+#define LOADGEN_DEFAULT_CLIENTS 8
+#define LOADGEN_DEFAULT_REQUESTS 10000    // Per client
+
+// Benchmark settings
+#define BENCH_OUTPUT_FILE "bench_output.txt" // Where `bench` writes its results, one TSV row per operation
+#define BENCH_DEFAULT_SIZE 100000  // Contacts in the generated book when no size is given
+#define BENCH_MAX_SIZE 10000000    // Largest book `bench` will generate
+#define BENCH_QUERIES 100000       // Timed lookups, edits and deletes, fewer if the book is smaller
+#define BENCH_SEARCHES 1000        // Timed indexed substring searches
+#define BENCH_SCANS 100            // Timed searches that scan a whole column
+
+// Binary snapshot layout: a header, then sections padded to 8 bytes. Integers are in the machine's native
+// byte order. Each field is saved as a column, the same way the store keeps it: count uint32 offsets into a
+// heap of NUL-terminated strings. The other sections are pre-built indexes. The header holds a checksum of
+// every section: a damaged column makes the snapshot unusable, a damaged index is rebuilt. Only this version is
+// read; a book from before snapshots existed is imported from the old contacts.txt instead
+#define SNAPSHOT_MAGIC "CMSNAP\0"  // 8 bytes including the terminating NUL
+#define SNAPSHOT_VERSION 4
+
+// Sections of a snapshot; an index section with size 0 is simply rebuilt on load
+enum SnapshotSection {
+    SNAP_ORDER,       // count x uint32 record numbers in name order
+    SNAP_NAME_HASH,   // uint64 capacity, then capacity x uint32 slots, then capacity x uint32 hashes
+    SNAP_PHONE_HASH,  // Same layout as SNAP_NAME_HASH
+    SNAP_TRIGRAMS,    // uint64 list count, then {uint32 key, uint32 count} per list, then every list's positions
+    SNAP_COLUMNS,     // Each field's count x uint32 offsets, then its heap, in ContactField order
+    SNAP_SECTION_COUNT = SNAP_COLUMNS + 2 * FIELD_COUNT
+};
+
+// Header at the start of every snapshot
+struct SnapshotHeader {
+    char magic[8];          // SNAPSHOT_MAGIC
+    uint32_t version;       // SNAPSHOT_VERSION
+    uint32_t sectionCount;  // SNAP_SECTION_COUNT when written
+    uint64_t count;         // Number of contacts
+    uint64_t lsn;           // Last journal record already reflected in the snapshot
+    struct {
+        uint64_t offset;    // Byte offset of the section from the start of the file
+        uint64_t size;      // Size of the section in bytes
+    } sections[SNAP_SECTION_COUNT];
+    uint64_t checksums[SNAP_SECTION_COUNT]; // snapshotChecksum of each section
+};
+
+// Journal records are buffered and written with one fsync per batch (group commit); once the file passes
+// the compaction threshold a child process writes a fresh snapshot and the journal is cut back
+#define JOURNAL_BUFFER_SIZE (1 << 20)      // Bytes buffered before a commit is forced
+#define JOURNAL_COMPACT_BYTES (16 << 20)   // Journal size that triggers a background snapshot
+#define JOURNAL_MAX_RECORD (1 << 16)       // Largest record body replay will accept
+
+// Kinds of change recorded in the journal; each record body is a uint64 LSN, the op byte and NUL-terminated fields
+enum JournalOp {
+    JOURNAL_ADD = 1,    // name, phone, address, email
+    JOURNAL_EDIT = 2,   // old name, then the new name, phone, address, email
+    JOURNAL_DELETE = 3  // name
+};
+
+// Open journal attached to a store; every change to the store is appended to it
+struct Journal {
+    int fd;                 // Journal file, opened for appending
+    char *buffer;           // Records not yet written
+    size_t length;          // Bytes used in the buffer
+    uint64_t fileSize;      // Bytes in the journal file
+    int failed;             // Set after a write error so it's only reported once
+    pid_t compactor;        // Child writing a snapshot, 0 if none is running
+    uint64_t compactOffset; // Journal size when the child was started; everything before it is in its snapshot
+    int inlineCompaction;   // Set in threaded processes: the snapshot is written by journalCommit instead of a child
+};
+
+// Why a contact was rejected by validation
+enum ContactError {
+    CONTACT_OK,              // Nothing wrong
+    CONTACT_EMPTY_NAME,      // Name is empty
+    CONTACT_DUPLICATE_NAME,  // Another contact has the same name, ignoring case
+    CONTACT_EMPTY_PHONE,     // Phone is empty
+    CONTACT_INVALID_PHONE,   // Phone isn't +digits, 00digits or digits
+    CONTACT_DUPLICATE_PHONE, // Another contact has the same normalized phone
+    CONTACT_EMPTY_EMAIL,     // Email is empty
+    CONTACT_INVALID_EMAIL,   // Email lacks '@' or '.'
+    CONTACT_TOO_LONG,        // The fields add up to more than CONTACT_MAX_BYTES
+    CONTACT_ERROR_COUNT
+};
+
+#define CONTACT_MAX_BYTES (16 << 10) // Longest contact accepted, all four fields together; keeps journal records bounded
+
+// File formats understood by import and export
+enum FileFormat {
+    FORMAT_CSV,  // Comma-separated name,phone,address,email with optional quoting
+    FORMAT_TSV,  // Tab-separated, same columns
+    FORMAT_TEXT  // Legacy contacts.txt layout, one field per line
+};
+
+// How list and search print contacts
+enum OutputFormat {
+    OUTPUT_TABLE, // Padded columns for reading, as the menu shows them
+    OUTPUT_TSV,   // Tab-separated name, phone, address, email, quoted like CSV when needed
+    OUTPUT_JSONL  // One JSON object per line with name, phone, address and email keys
+};
+
+// Which part of a listing or of a search's results to print. Results are always in name order
+struct OutputPage {
+    size_t offset;     // Results to skip
+    size_t limit;      // Most results to print, 0 for all of them
+    const char *after; // Only print names after this one, NULL or "" to start at the beginning; set it to the
+                       // last name printed to carry on where a limited page stopped
+};
+
+#define OUTPUT_BUFFER_SIZE (64 << 10) // Listings are formatted into blocks this big before being written out
+
+// Outcome of a bulk import
+struct ImportReport {
+    long imported;                       // Contacts added
+    long rejected[CONTACT_ERROR_COUNT];  // Records refused, by reason
+    long malformed;                      // Records without four fields
+};
+
+// Contact store functions
+void storeInit(struct ContactStore *store);                                                // Set up an empty store
+void storeFree(struct ContactStore *store);                                                // Release all memory held by the store
+size_t storeInsert(struct ContactStore *store, const struct Contact *contact);              // Store and index a contact, CONTACT_NOT_FOUND if out of memory
+int storeUpdate(struct ContactStore *store, size_t index, const struct Contact *contact);  // Replace a contact and re-index it, 0 on success
+struct Contact storeGet(const struct ContactStore *store, size_t index);                   // Get the record at a position
+const char *storeField(const struct ContactStore *store, size_t index, enum ContactField field); // One field of the record at a position
+int storeCopy(struct ContactStore *copy, const struct ContactStore *store);  // Copy and index every contact into an empty store, 0 on success
+int storeRemove(struct ContactStore *store, size_t index);                                 // Delete the record at a position, 0 on success
+int storeIsDeleted(const struct ContactStore *store, size_t index);                        // Whether the record at a position is deleted
+int storeCompactDue(const struct ContactStore *store);                                     // Whether enough records are deleted to compact
+void storeCompact(struct ContactStore *store);                                             // Squeeze out deleted records; positions change
+size_t storeFindByName(const struct ContactStore *store, const char *name);                // Case-insensitive exact name lookup
+size_t storeFindByPhone(const struct ContactStore *store, const char *phone);              // Normalized phone lookup
+const char *phoneKey(const char *phone);                                                   // Phone number without its '+' or '00' prefix
+int storeSearchName(const struct ContactStore *store, const char *needle, struct ContactMatches *matches); // Case-insensitive substring search on names, 0 on success
+int storeScanField(const struct ContactStore *store, enum ContactField field, const char *needle, struct ContactMatches *matches); // Same search on any field by scanning its column
+int storeFuzzySearch(struct ContactStore *store, const char *query, int maxDistance, struct FuzzyMatch **matches, size_t *count); // Names within an edit distance of every query word, 0 on success
+void storeOrderSeek(const struct ContactStore *store, const char *name, struct OrderCursor *cursor); // Cursor at the first name >= the given one ("" for the start)
+size_t storeOrderNext(const struct ContactStore *store, struct OrderCursor *cursor);       // Next position in name order, CONTACT_NOT_FOUND at the end
+size_t storeOrderSkip(const struct ContactStore *store, struct OrderCursor *cursor, size_t n); // Move the cursor n contacts on, returns how many it moved
+int storeBuildPhoneTrie(struct ContactStore *store);                                       // Build the phone trie if it isn't yet, 0 on success
+size_t storeCompleteName(const struct ContactStore *store, const char *prefix, size_t *positions, size_t limit); // First names in order starting with a prefix
+size_t storeCompletePhone(const struct ContactStore *store, const char *prefix, size_t *positions, size_t limit); // First phone keys in order starting with a prefix
+size_t storeFindCaller(const struct ContactStore *store, const char *number, int *exact);  // Contact whose phone is the number or its longest prefix
+void matchesInit(struct ContactMatches *matches);                                          // Set up an empty match list
+void matchesFree(struct ContactMatches *matches);                                          // Release a match list
+
+// Validation shared by the menu and batch mode; `self` is the position being edited or CONTACT_NOT_FOUND
+enum ContactError validateName(const struct ContactStore *store, const char *name, size_t self);
+enum ContactError validatePhone(const struct ContactStore *store, const char *phone, size_t self);
+enum ContactError validateEmail(const char *email);
+enum ContactError validateContact(const struct ContactStore *store, const struct Contact *contact, size_t self);
+const char *contactErrorMessage(enum ContactError error); // Short description of a validation error
+
+// Non-interactive mode
+int runCommand(struct ContactStore *store, int argc, char *argv[]); // Run one command such as "import file.csv", 0 on success
+int runBatch(struct ContactStore *store, FILE *in);                 // Run tab-separated commands, one per line, 0 if all succeeded
+int runBench(size_t size, uint64_t seed, int threads, const char *path); // Time every operation on a generated book, 0 on success
+void statsPrint(FILE *fp);                                          // Write the counters and latency histograms as a table
+int runServer(struct ContactStore *store, const char *path);       // Serve the store on a Unix socket until stopped, 0 on a clean stop
+int runLoadgen(const char *path, int clients, long requests, int writePercent); // Load test a running server, 0 if no client failed
+
 // Function declarations 
-void addContact(struct Contact contacts[], int *count);           // Add a contact
-void listContacts(struct Contact contacts[], int count);          // Display all contacts
-void searchContact(struct Contact contacts[], int count);         // Find a contact by name
-void editContact(struct Contact contacts[], int count);           // Update contact details
-void deleteContact(struct Contact contacts[], int *count);        // Remove a contact
-void saveContactsToFile(struct Contact contacts[], int count);    // Save to file
-void loadContactsFromFile(struct Contact contacts[], int *count); // Load from file
-void displayMenu();                                               // Show the menu
+void addContact(struct ContactStore *store);           // Add a contact
+void listContacts(struct ContactStore *store);         // Display all contacts
+void listContactRange(struct ContactStore *store);     // Display contacts within a name range
+void searchContact(struct ContactStore *store);        // Find a contact by name
+void fuzzySearchContact(struct ContactStore *store);   // Find a contact by name, allowing for typos
+void editContact(struct ContactStore *store);          // Update contact details
+void deleteContact(struct ContactStore *store);        // Remove a contact
+void saveContactsToFile(struct ContactStore *store);   // Save to file
+void loadContactsFromFile(struct ContactStore *store); // Load from file
+int saveSnapshot(const struct ContactStore *store, const char *path);  // Write a binary snapshot, 0 on success
+int loadSnapshot(struct ContactStore *store, const char *path);        // Map a binary snapshot into an empty store, 0 on success, 1 if an index was rebuilt
+int journalOpen(struct ContactStore *store, const char *path);         // Replay a journal into the store and keep logging to it, 0 on success
+int journalCommit(struct ContactStore *store);                          // Write and fsync buffered records, 0 on success
+int journalCheckpoint(struct ContactStore *store);                      // Write a snapshot now and empty the journal, 0 on success
+void journalClose(struct ContactStore *store);                          // Commit, wait for compaction and detach the journal
+long importDelimitedFile(struct ContactStore *store, const char *path, char delimiter, struct ImportReport *report); // Import CSV/TSV, -1 if unreadable
+int exportDelimitedFile(const struct ContactStore *store, const char *path, char delimiter); // Export CSV/TSV, 0 on success
+long importTextFile(struct ContactStore *store, const char *path, struct ImportReport *report); // Import the legacy text format, -1 if unreadable
+long importLegacyTextFile(struct ContactStore *store, const char *path); // Load an old contacts.txt unchecked, returns contacts read or -1
+int exportTextFile(const struct ContactStore *store, const char *path); // Export to the legacy text format, 0 on success
+void displayMenu();                                    // Show the menu
+void clearLine(void);                                  // Skip the rest of the input line
 
 #endif // End of contactManegement header
 
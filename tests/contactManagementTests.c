@@ -0,0 +1,601 @@
+// Behaviour tests for the Contact Management System
+// The program is compiled in with its main renamed, so the tests can reach its static functions too.
+// Build and run from the repository root:
+//   cc -std=c11 -O1 -g -pthread tests/contactManagementTests.c -o contactManagementTests && ./contactManagementTests
+// Add -fsanitize=address,undefined to catch the vector scans reading past a buffer. Files are written to a fresh
+// directory under /tmp that is removed afterwards. Prints each failed check and exits 1 if there were any
+
+#define main contactManagementMain
+#include "../contactManagement.c"
+#undef main
+
+static int failures; // Checks failed so far
+
+// Report a failed check with where it was and why, and carry on with the rest
+#define CHECK(condition, ...)                                   \
+    do {                                                        \
+        if (!(condition)) {                                     \
+            failures++;                                         \
+            printf("FAILED %s:%d: ", __func__, __LINE__);       \
+            printf(__VA_ARGS__);                                \
+            printf("\n");                                       \
+        }                                                       \
+    } while (0)
+
+// Same sequence on every run, so a failure can be reproduced
+static uint64_t randomState = 88172645463325252ull;
+static uint64_t testRandom(void) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Every live contact in name order, one tab-separated line each; the caller frees it
+static char *dumpStore(const struct ContactStore *store) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&text, &size);
+    struct OrderCursor cursor;
+    storeOrderSeek(store, "", &cursor);
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND;) {
+        struct Contact contact = storeGet(store, pos);
+        fprintf(fp, "%s\t%s\t%s\t%s\n", contact.name, contact.phone, contact.address, contact.email);
+    }
+    fclose(fp);
+    return text;
+}
+
+// Every slot in position order, deleted ones marked as such; the caller frees it
+static char *dumpSlots(const struct ContactStore *store) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&text, &size);
+    for (size_t pos = 0; pos < store->slots; pos++) {
+        struct Contact contact = storeGet(store, pos);
+        if (storeIsDeleted(store, pos)) fprintf(fp, "%zu deleted\n", pos);
+        else fprintf(fp, "%zu\t%s\t%s\t%s\t%s\n", pos, contact.name, contact.phone, contact.address, contact.email);
+    }
+    fclose(fp);
+    return text;
+}
+
+// Every live contact can be found by its name and phone number, and the ordered index has each of them once
+static void checkIndexes(const struct ContactStore *store, const char *when) {
+    size_t listed = 0;
+    struct OrderCursor cursor;
+    storeOrderSeek(store, "", &cursor);
+    for (size_t pos; (pos = storeOrderNext(store, &cursor)) != CONTACT_NOT_FOUND; listed++) {
+        CHECK(!storeIsDeleted(store, pos), "%s: deleted position %zu is listed", when, pos);
+        CHECK(storeFindByName(store, storeField(store, pos, FIELD_NAME)) == pos, "%s: name '%s' not found", when,
+              storeField(store, pos, FIELD_NAME));
+        CHECK(storeFindByPhone(store, storeField(store, pos, FIELD_PHONE)) == pos, "%s: phone '%s' not found", when,
+              storeField(store, pos, FIELD_PHONE));
+    }
+    CHECK(listed == store->count, "%s: %zu listed but the store has %zu", when, listed, store->count);
+}
+
+// Add a contact made from a number, failing the test if the store refuses it. Returns its position
+static size_t insertNumbered(struct ContactStore *store, const char *prefix, long number) {
+    char name[64], phone[32], email[64];
+    snprintf(name, sizeof(name), "%s %ld", prefix, number);
+    snprintf(phone, sizeof(phone), "+44%09ld", number);
+    snprintf(email, sizeof(email), "user%ld@example.com", number);
+    struct Contact contact = {name, phone, "1 High Street", email};
+    size_t pos = storeInsert(store, &contact);
+    CHECK(pos != CONTACT_NOT_FOUND, "could not add %s", name);
+    return pos;
+}
+
+// Whether a match list holds a position
+static int matchesHave(const struct ContactMatches *matches, size_t pos) {
+    for (size_t i = 0; i < matches->count; i++)
+        if (matches->positions[i] == pos) return 1;
+    return 0;
+}
+
+// Copy a file, keeping only its first `size` bytes
+static void copyPrefix(const char *from, const char *to, size_t size) {
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    char *data = malloc(size ? size : 1);
+    CHECK(in && out && data && fread(data, 1, size, in) == size && fwrite(data, 1, size, out) == size,
+          "could not copy %zu bytes of %s", size, from);
+    free(data);
+    if (in) fclose(in);
+    if (out) fclose(out);
+}
+
+static size_t fileSize(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// The vector scans must find the same first match as the byte-at-a-time one for every haystack length, needle
+// length and match position, including matches that straddle a 16 or 32 byte block and ones in the tail the
+// vector loops leave to the scalar code. Haystacks are allocated to their exact size so reading past the end is
+// caught under AddressSanitizer. The bytes include the neighbours of A-Z and a-z and some above 127, which the
+// vector case folding must leave alone
+static void testScanBoundaries(void) {
+    static const char alphabet[] = "aAbBzZ@[`{ \xc1\xe1";
+    const size_t letters = sizeof(alphabet) - 1;
+    long scans = 0;
+    for (size_t length = 0; length <= 100; length++) {
+        for (size_t needleLength = 1; needleLength <= 40 && needleLength <= length + 1; needleLength++) {
+            for (int trial = 0; trial < 12; trial++) {
+                char *haystack = malloc(length ? length : 1);
+                char needle[41], folded[41];
+                for (size_t i = 0; i < length; i++) haystack[i] = alphabet[testRandom() % letters];
+                // Mostly plant the needle somewhere, half the time right at the end, in a different case
+                if (trial % 4 != 3 && needleLength <= length) {
+                    size_t at = trial % 2 ? length - needleLength : testRandom() % (length - needleLength + 1);
+                    for (size_t i = 0; i < needleLength; i++) needle[i] = haystack[at + i];
+                } else {
+                    for (size_t i = 0; i < needleLength; i++) needle[i] = alphabet[testRandom() % letters];
+                }
+                for (size_t i = 0; i < needleLength; i++) {
+                    if (testRandom() % 2) needle[i] = (char)toupper((unsigned char)needle[i]);
+                    folded[i] = (char)tolower((unsigned char)needle[i]);
+                }
+                needle[needleLength] = folded[needleLength] = '\0';
+
+                const char *end = haystack + length;
+                const char *expected = scanFindScalar(haystack, end, folded, needleLength);
+#ifdef SCAN_X86
+                const char *sse2 = scanFindSse2(haystack, end, folded, needleLength);
+                CHECK(sse2 == expected, "SSE2 scan differs: haystack %zu, needle %zu", length, needleLength);
+                if (__builtin_cpu_supports("avx2")) {
+                    const char *avx2 = scanFindAvx2(haystack, end, folded, needleLength);
+                    CHECK(avx2 == expected, "AVX2 scan differs: haystack %zu, needle %zu", length, needleLength);
+                }
+#endif
+                // The plain string search, the one the menu used to run, finds the same place
+                char *terminated = malloc(length + 1);
+                memcpy(terminated, haystack, length);
+                terminated[length] = '\0';
+                const char *plain = caseInsensitiveStrStr(terminated, needle);
+                CHECK((plain ? plain - terminated : -1) == (expected ? expected - haystack : -1),
+                      "caseInsensitiveStrStr differs: haystack %zu, needle %zu", length, needleLength);
+                free(terminated);
+                free(haystack);
+                scans++;
+            }
+        }
+    }
+    printf("scan boundaries: %ld haystacks\n", scans);
+}
+
+// Column scans and trigram searches find exactly the live contacts whose field contains the needle, after edits
+// have moved strings to the end of the heap and deletes have left tombstones among them
+static void testSearchMatchesBruteForce(void) {
+    struct ContactStore store;
+    storeInit(&store);
+    static const char syllables[][4] = {"an", "Bel", "co", "DI", "ers", "fo", "gu", "Hal", "i", "jo"};
+    char name[64];
+    for (int i = 0; i < 3000; i++) {
+        size_t length = 0;
+        for (int parts = 1 + (int)(testRandom() % 6); parts > 0; parts--)
+            length += (size_t)snprintf(name + length, sizeof(name) - length, "%s", syllables[testRandom() % 10]);
+        snprintf(name + length, sizeof(name) - length, " %d", i);
+        char phone[32], email[64];
+        snprintf(phone, sizeof(phone), "+1%08d", i);
+        snprintf(email, sizeof(email), "%d@example.com", i);
+        struct Contact contact = {name, phone, "", email};
+        CHECK(storeInsert(&store, &contact) != CONTACT_NOT_FOUND, "could not add %s", name);
+    }
+    for (int i = 0; i < 300; i++) {
+        size_t pos = testRandom() % store.slots;
+        if (storeIsDeleted(&store, pos)) continue;
+        if (i % 2) {
+            CHECK(storeRemove(&store, pos) == 0, "could not delete %zu", pos);
+        } else {
+            struct Contact contact = storeGet(&store, pos);
+            snprintf(name, sizeof(name), "Edited %sHal %d", syllables[i % 10], i);
+            struct Contact edited = {name, contact.phone, contact.address, contact.email};
+            CHECK(storeUpdate(&store, pos, &edited) == 0, "could not edit %zu", pos);
+        }
+    }
+
+    static const char *needles[] = {"a", "AN", "bel", "ERS", "hal", "ohal", "anbel", "edited", "coDI", "x", "fogu",
+                                    "ijo", "1 2", " 29", "jojojo"};
+    struct ContactMatches scanned, searched;
+    matchesInit(&scanned);
+    matchesInit(&searched);
+    for (size_t n = 0; n < sizeof(needles) / sizeof(*needles); n++) {
+        CHECK(storeScanField(&store, FIELD_NAME, needles[n], &scanned) == 0, "scan for '%s' failed", needles[n]);
+        CHECK(storeSearchName(&store, needles[n], &searched) == 0, "search for '%s' failed", needles[n]);
+        size_t expected = 0;
+        for (size_t pos = 0; pos < store.slots; pos++) {
+            if (storeIsDeleted(&store, pos)) continue;
+            if (!caseInsensitiveStrStr(storeField(&store, pos, FIELD_NAME), needles[n])) continue;
+            expected++;
+            CHECK(matchesHave(&scanned, pos), "scan for '%s' missed %zu", needles[n], pos);
+            CHECK(matchesHave(&searched, pos), "search for '%s' missed %zu", needles[n], pos);
+        }
+        CHECK(scanned.count == expected, "scan for '%s' found %zu, expected %zu", needles[n], scanned.count, expected);
+        CHECK(searched.count == expected, "search for '%s' found %zu, expected %zu", needles[n], searched.count, expected);
+    }
+    matchesFree(&scanned);
+    matchesFree(&searched);
+    storeFree(&store);
+}
+
+// A crash can leave the journal ending part-way through a record. Replay has to stop at the last whole record,
+// whatever byte the file ends on, cut the file back to it and carry on appending from there
+static void testJournalTornTail(void) {
+    enum { STEPS = 40 };
+    size_t boundary[STEPS + 1];
+    char *expected[STEPS + 1];
+    remove("torn.journal");
+
+    struct ContactStore store;
+    storeInit(&store);
+    CHECK(journalOpen(&store, "torn.journal") == 0, "could not open the journal");
+    boundary[0] = 0;
+    expected[0] = dumpStore(&store);
+    for (int step = 1; step <= STEPS; step++) {
+        // Mostly adds, with edits and deletes of earlier contacts mixed in, each committed on its own
+        size_t pos = store.slots ? testRandom() % store.slots : 0;
+        if (step % 5 == 0 && !storeIsDeleted(&store, pos)) {
+            CHECK(storeRemove(&store, pos) == 0, "could not delete %zu", pos);
+        } else if (step % 5 == 3 && !storeIsDeleted(&store, pos)) {
+            char name[64];
+            snprintf(name, sizeof(name), "Renamed %d", step);
+            struct Contact contact = storeGet(&store, pos);
+            struct Contact edited = {name, contact.phone, "Somewhere else", contact.email};
+            CHECK(storeUpdate(&store, pos, &edited) == 0, "could not edit %zu", pos);
+        } else {
+            insertNumbered(&store, "Journal", step);
+        }
+        CHECK(journalCommit(&store) == 0, "commit %d failed", step);
+        boundary[step] = fileSize("torn.journal");
+        expected[step] = dumpStore(&store);
+    }
+    journalClose(&store);
+    storeFree(&store);
+
+    int replays = 0;
+    for (int step = 0; step < STEPS; step++) {
+        size_t record = boundary[step + 1] - boundary[step];
+        size_t cuts[] = {0, 1, 4, 8, 9, record / 2, record - 1};
+        for (size_t c = 0; c < sizeof(cuts) / sizeof(*cuts); c++) {
+            if (cuts[c] >= record) continue;
+            copyPrefix("torn.journal", "cut.journal", boundary[step] + cuts[c]);
+            storeInit(&store);
+            CHECK(journalOpen(&store, "cut.journal") == 0, "could not replay a journal cut at %zu", boundary[step] + cuts[c]);
+            char *replayed = dumpStore(&store);
+            CHECK(strcmp(replayed, expected[step]) == 0, "cut %zu bytes into record %d: replay doesn't match", cuts[c], step + 1);
+            CHECK(fileSize("cut.journal") == boundary[step], "cut %zu bytes into record %d: torn tail not dropped", cuts[c], step + 1);
+            free(replayed);
+
+            // A change made after the replay must survive the next one
+            insertNumbered(&store, "After", 100000 + step);
+            char *before = dumpStore(&store);
+            journalClose(&store);
+            storeFree(&store);
+            storeInit(&store);
+            CHECK(journalOpen(&store, "cut.journal") == 0, "could not reopen the journal");
+            char *after = dumpStore(&store);
+            CHECK(strcmp(before, after) == 0, "cut %zu bytes into record %d: change after replay lost", cuts[c], step + 1);
+            checkIndexes(&store, "after replay");
+            free(before);
+            free(after);
+            journalClose(&store);
+            storeFree(&store);
+            replays++;
+        }
+    }
+
+    // A flipped byte inside the last record fails its checksum, so replay stops before it
+    copyPrefix("torn.journal", "cut.journal", boundary[STEPS]);
+    FILE *fp = fopen("cut.journal", "r+b");
+    fseek(fp, (long)(boundary[STEPS - 1] + (boundary[STEPS] - boundary[STEPS - 1]) / 2), SEEK_SET);
+    int byte = fgetc(fp);
+    fseek(fp, -1, SEEK_CUR);
+    fputc(byte ^ 0x5a, fp);
+    fclose(fp);
+    storeInit(&store);
+    CHECK(journalOpen(&store, "cut.journal") == 0, "could not replay a corrupt journal");
+    char *replayed = dumpStore(&store);
+    CHECK(strcmp(replayed, expected[STEPS - 1]) == 0, "a corrupt last record was replayed");
+    free(replayed);
+    journalClose(&store);
+    storeFree(&store);
+
+    for (int step = 0; step <= STEPS; step++) free(expected[step]);
+    remove("torn.journal");
+    remove("cut.journal");
+    printf("journal torn tail: %d replays\n", replays);
+}
+
+// A batch of adds big enough to fill the journal buffer many times over and pass the compaction threshold. The
+// snapshot is only taken at the commit, so it is stamped with the LSN of every contact it holds and replaying
+// the journal on top of it gives the same book, with nothing added twice
+static void testJournalBufferFull(void) {
+    enum { ADDS = 12000 };
+    remove(SNAPSHOT_FILE);
+    remove(JOURNAL_FILE);
+    static char address[2000];
+    memset(address, 'x', sizeof(address) - 1);
+
+    struct ContactStore store;
+    storeInit(&store);
+    CHECK(journalOpen(&store, JOURNAL_FILE) == 0, "could not open the journal");
+    store.journal->inlineCompaction = 1; // Snapshot in this process, so it's done by the time the commit returns
+    for (long i = 0; i < ADDS; i++) {
+        char name[64], phone[32];
+        snprintf(name, sizeof(name), "Batch %ld", i);
+        snprintf(phone, sizeof(phone), "+44%09ld", i);
+        struct Contact contact = {name, phone, address, "batch@example.com"};
+        CHECK(storeInsert(&store, &contact) != CONTACT_NOT_FOUND, "could not add %ld", i);
+    }
+    CHECK(journalCommit(&store) == 0, "commit failed");
+    CHECK(fileSize(SNAPSHOT_FILE) > 0, "the batch never reached the compaction threshold");
+    for (long i = 0; i < 10; i++) insertNumbered(&store, "Later", 100000 + i); // Left in the journal
+    char *expected = dumpStore(&store);
+    journalClose(&store);
+    storeFree(&store);
+
+    CHECK(loadSnapshot(&store, SNAPSHOT_FILE) == 0, "could not load the snapshot");
+    CHECK(store.count == store.lsn, "snapshot holds %zu adds but is stamped with LSN %llu", store.count,
+          (unsigned long long)store.lsn);
+    CHECK(journalOpen(&store, JOURNAL_FILE) == 0, "could not replay the journal");
+    char *replayed = dumpStore(&store);
+    CHECK(store.count == ADDS + 10 && strcmp(replayed, expected) == 0, "replay gave %zu contacts, expected %d", store.count, ADDS + 10);
+    free(replayed);
+
+    // An add the snapshot already holds is skipped on replay rather than stored a second time
+    CHECK(fileSize(JOURNAL_FILE) > 0, "nothing left in the journal to replay");
+    store.lsn = 0; // As if none of the journal had made it into the snapshot
+    CHECK(saveSnapshot(&store, SNAPSHOT_FILE) == 0, "could not save the snapshot");
+    journalClose(&store);
+    storeFree(&store);
+    CHECK(loadSnapshot(&store, SNAPSHOT_FILE) == 0 && journalOpen(&store, JOURNAL_FILE) == 0, "could not reload");
+    replayed = dumpStore(&store);
+    CHECK(store.count == ADDS + 10 && strcmp(replayed, expected) == 0, "replaying adds already in the snapshot duplicated them");
+    checkIndexes(&store, "after replay");
+    free(replayed);
+    free(expected);
+    journalClose(&store);
+    storeFree(&store);
+    remove(SNAPSHOT_FILE);
+    remove(JOURNAL_FILE);
+    printf("journal buffer full: ok\n");
+}
+
+// Write a CSV file big enough to be split into several chunks, with a header row, rejected and malformed records,
+// and quoted fields holding commas, quotes and line breaks, some of which will straddle a chunk boundary
+static void writeImportFile(const char *path, long records) {
+    FILE *fp = fopen(path, "w");
+    fprintf(fp, "name,phone,address,email\n");
+    for (long i = 0; i < records; i++) {
+        long n = (long)(testRandom() % (uint64_t)records); // Repeats make duplicate names and phones
+        switch (testRandom() % 10) {
+            case 0: fprintf(fp, "\"Quoted, %ld\",+44%09ld,\"Flat 2\nThe \"\"Old\"\" Mill\",q%ld@example.com\n", n, n, n); break;
+            case 1: fprintf(fp, "Bad Email %ld,+1%09ld,Street,nowhere\n", i, i); break;
+            case 2: fprintf(fp, "Three Fields %ld,+2%09ld,Street\n", i, i); break;
+            case 3: fprintf(fp, "Bad Phone %ld,12ab34,Street,b%ld@example.com\n", i, i); break;
+            default: fprintf(fp, "Person %ld,+33%09ld,%ld Rue de la Paix,p%ld@example.com\n", n, n, i, n); break;
+        }
+    }
+    fclose(fp);
+}
+
+// A parallel import must come out exactly like a serial one: same contacts at the same positions, same rejects
+static void testImportThreads(void) {
+    writeImportFile("import.csv", 60000);
+    CHECK(fileSize("import.csv") > 3 * IMPORT_CHUNK_BYTES, "import file too small to split");
+
+    char *serialSlots = NULL;
+    struct ImportReport serial;
+    static const int threadCounts[] = {1, 2, 3, 4, 8};
+    for (size_t t = 0; t < sizeof(threadCounts) / sizeof(*threadCounts); t++) {
+        struct ContactStore store;
+        storeInit(&store);
+        store.threads = threadCounts[t];
+        struct ImportReport report;
+        long imported = importDelimitedFile(&store, "import.csv", ',', &report);
+        CHECK(imported > 0 && (size_t)imported == store.count, "-j %d imported %ld into %zu", threadCounts[t], imported, store.count);
+        char *slots = dumpSlots(&store);
+        if (!serialSlots) {
+            serialSlots = slots;
+            serial = report;
+            CHECK(report.malformed > 0, "no malformed records counted");
+        } else {
+            CHECK(strcmp(slots, serialSlots) == 0, "-j %d put different contacts at different positions", threadCounts[t]);
+            CHECK(memcmp(&report, &serial, sizeof(report)) == 0, "-j %d reported different rejects", threadCounts[t]);
+            free(slots);
+        }
+        checkIndexes(&store, "after import");
+        storeFree(&store);
+    }
+    free(serialSlots);
+    remove("import.csv");
+    printf("import threads: %ld imported, %ld malformed\n", serial.imported, serial.malformed);
+}
+
+// An import of the text format is checked like CSV; only the first load of an old contacts.txt into an empty
+// store takes the file as it is
+static void testTextImportChecks(void) {
+    FILE *fp = fopen("import.txt", "w");
+    fprintf(fp, "Ann\n+441234567\nStreet\nann@example.com\n");
+    fprintf(fp, "Bad Phone\n12ab34\nStreet\nbad@example.com\n");
+    fprintf(fp, "Ann\n+449876543\nStreet\nann2@example.com\n");
+    fclose(fp);
+
+    struct ContactStore store;
+    storeInit(&store);
+    struct ImportReport report;
+    long imported = importTextFile(&store, "import.txt", &report);
+    CHECK(imported == 1 && store.count == 1, "text import kept %ld of 3, expected 1", imported);
+    CHECK(report.rejected[CONTACT_INVALID_PHONE] == 1 && report.rejected[CONTACT_DUPLICATE_NAME] == 1,
+          "text import rejects not counted");
+    storeFree(&store);
+
+    CHECK(importLegacyTextFile(&store, "import.txt") == 3 && store.count == 3, "legacy load dropped contacts");
+    storeFree(&store);
+    remove("import.txt");
+    printf("text import checks: ok\n");
+}
+
+// Saving a snapshot and loading it back gives the same book with working indexes and room to change it. A damaged
+// index section is rebuilt, a damaged column refuses the file
+static void testSnapshotRoundTrip(void) {
+    struct ContactStore store;
+    storeInit(&store);
+    for (long i = 0; i < 5000; i++) insertNumbered(&store, i % 2 ? "Snap" : "Shot", i);
+    for (long i = 0; i < 500; i++) {
+        size_t pos = testRandom() % store.slots;
+        if (storeIsDeleted(&store, pos)) continue;
+        if (i % 2) {
+            CHECK(storeRemove(&store, pos) == 0, "could not delete %zu", pos);
+        } else {
+            char name[64];
+            snprintf(name, sizeof(name), "Edited %ld", i);
+            struct Contact contact = storeGet(&store, pos);
+            struct Contact edited = {name, contact.phone, "New address", contact.email};
+            CHECK(storeUpdate(&store, pos, &edited) == 0, "could not edit %zu", pos);
+        }
+    }
+    char *expected = dumpStore(&store);
+    CHECK(saveSnapshot(&store, "round.snap") == 0, "could not save the snapshot");
+    storeFree(&store);
+
+    storeInit(&store);
+    CHECK(loadSnapshot(&store, "round.snap") == 0, "could not load the snapshot");
+    char *loaded = dumpStore(&store);
+    CHECK(strcmp(loaded, expected) == 0, "loaded book differs");
+    checkIndexes(&store, "after load");
+    struct ContactMatches matches;
+    matchesInit(&matches);
+    CHECK(storeSearchName(&store, "edited 1", &matches) == 0 && matches.count > 0, "trigram index not usable");
+    matchesFree(&matches);
+    insertNumbered(&store, "Added after load", 100000);
+    checkIndexes(&store, "after adding to a loaded book");
+    free(loaded);
+    storeFree(&store);
+
+    // Flip a byte in the middle of a section of a copy and load that
+    struct SnapshotHeader header;
+    FILE *fp = fopen("round.snap", "rb");
+    CHECK(fp && fread(&header, sizeof(header), 1, fp) == 1, "could not read the snapshot header");
+    if (fp) fclose(fp);
+    static const int damaged[] = {SNAP_NAME_HASH, SNAP_PHONE_HASH, SNAP_TRIGRAMS, SNAP_ORDER, SNAP_COLUMNS + 1};
+    for (size_t d = 0; d < sizeof(damaged) / sizeof(*damaged); d++) {
+        size_t size = fileSize("round.snap");
+        copyPrefix("round.snap", "damaged.snap", size);
+        fp = fopen("damaged.snap", "r+b");
+        fseek(fp, (long)(header.sections[damaged[d]].offset + header.sections[damaged[d]].size / 2), SEEK_SET);
+        int byte = fgetc(fp);
+        fseek(fp, -1, SEEK_CUR);
+        fputc(byte ^ 0x01, fp);
+        fclose(fp);
+
+        storeInit(&store);
+        int status = loadSnapshot(&store, "damaged.snap");
+        if (damaged[d] >= SNAP_COLUMNS) {
+            CHECK(status == -2, "damaged column %d loaded with status %d", damaged[d], status);
+        } else {
+            CHECK(status == 1, "damaged index %d loaded with status %d", damaged[d], status);
+            loaded = dumpStore(&store);
+            CHECK(strcmp(loaded, expected) == 0, "book differs after rebuilding index %d", damaged[d]);
+            checkIndexes(&store, "after rebuilding an index");
+            free(loaded);
+        }
+        storeFree(&store);
+    }
+    free(expected);
+    remove("round.snap");
+    remove("damaged.snap");
+    printf("snapshot round trip: ok\n");
+}
+
+// Deleted records leave tombstones whose slots the next adds take, newest first, without any other record moving.
+// Nothing may still find a deleted contact, and the new ones must be found everywhere. Compacting afterwards
+// squeezes the tombstones out
+static void testTombstoneReuse(void) {
+    struct ContactStore store;
+    storeInit(&store);
+    CHECK(storeBuildPhoneTrie(&store) == 0, "could not build the phone trie");
+    for (long i = 0; i < 200; i++) insertNumbered(&store, "Keeper", i);
+
+    size_t removed[20];
+    char removedNames[20][64];
+    for (int i = 0; i < 20; i++) {
+        removed[i] = (size_t)(i * 9 + 3);
+        snprintf(removedNames[i], sizeof(removedNames[i]), "%s", storeField(&store, removed[i], FIELD_NAME));
+        CHECK(storeRemove(&store, removed[i]) == 0, "could not delete %zu", removed[i]);
+    }
+    char *before = dumpSlots(&store);
+
+    for (int i = 0; i < 20; i++) {
+        size_t pos = insertNumbered(&store, "Newcomer", 1000 + i);
+        CHECK(pos == removed[19 - i], "add %d went to %zu, not the last freed slot %zu", i, pos, removed[19 - i]);
+    }
+    CHECK(store.slots == 200 && store.count == 200, "slots %zu, count %zu after reuse", store.slots, store.count);
+
+    // Every record that wasn't deleted is where it was
+    char *after = dumpSlots(&store);
+    for (char *line = before, *end; *line; line = end + 1) {
+        end = strchr(line, '\n');
+        if (strstr(line, "deleted")) continue;
+        *end = '\0';
+        CHECK(strstr(after, line) != NULL, "record moved: %s", line);
+        *end = '\n';
+    }
+    free(before);
+    free(after);
+
+    struct ContactMatches matches;
+    matchesInit(&matches);
+    for (int i = 0; i < 20; i++) {
+        CHECK(storeFindByName(&store, removedNames[i]) == CONTACT_NOT_FOUND, "deleted '%s' still found", removedNames[i]);
+        CHECK(storeSearchName(&store, removedNames[i], &matches) == 0, "search for '%s' failed", removedNames[i]);
+        for (size_t m = 0; m < matches.count; m++)
+            CHECK(strcmp(storeField(&store, matches.positions[m], FIELD_NAME), removedNames[i]) != 0,
+                  "search still finds deleted '%s'", removedNames[i]);
+    }
+    CHECK(storeSearchName(&store, "newcomer", &matches) == 0 && matches.count == 20, "search found %zu newcomers", matches.count);
+    CHECK(storeScanField(&store, FIELD_NAME, "NEWCOMER 10", &matches) == 0 && matches.count == 20, "scan found %zu newcomers", matches.count);
+    size_t completed[32];
+    CHECK(storeCompleteName(&store, "newc", completed, 32) == 20, "completion missed newcomers");
+    int exact;
+    size_t caller = storeFindCaller(&store, "+44000001005", &exact);
+    CHECK(caller != CONTACT_NOT_FOUND && exact && strcmp(storeField(&store, caller, FIELD_NAME), "Newcomer 1005") == 0,
+          "caller ID missed a newcomer");
+    checkIndexes(&store, "after reuse");
+
+    // Fresh deletes, then compacting leaves no gaps and everything still found
+    for (size_t pos = 0; pos < store.slots; pos += 2) CHECK(storeRemove(&store, pos) == 0, "could not delete %zu", pos);
+    char *live = dumpStore(&store);
+    storeCompact(&store);
+    char *compacted = dumpStore(&store);
+    CHECK(store.slots == store.count && store.count == 100, "compacting left %zu slots for %zu contacts", store.slots, store.count);
+    CHECK(strcmp(live, compacted) == 0, "compacting changed the book");
+    checkIndexes(&store, "after compacting");
+    free(live);
+    free(compacted);
+    matchesFree(&matches);
+    storeFree(&store);
+    printf("tombstone reuse: ok\n");
+}
+
+int main(void) {
+    char directory[] = "/tmp/contactManagementTestsXXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) != 0) {
+        perror("Cannot set up a test directory");
+        return 1;
+    }
+
+    testScanBoundaries();
+    testSearchMatchesBruteForce();
+    testJournalTornTail();
+    testJournalBufferFull();
+    testImportThreads();
+    testTextImportChecks();
+    testSnapshotRoundTrip();
+    testTombstoneReuse();
+
+    if (chdir("/") != 0 || rmdir(directory) != 0) printf("Left %s behind\n", directory);
+    printf(failures ? "%d checks failed\n" : "All tests passed\n", failures);
+    return failures ? 1 : 0;
+}